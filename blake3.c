@@ -0,0 +1,755 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "defs.h"
+#include "thread_pool.h"
+#include "blake3.h"
+
+/*
+ * Build the lane functions for AVX2 as well and pick at run time
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define B3_TARGET __attribute__((target_clones("avx2", "default")))
+#else
+#define B3_TARGET
+#endif
+
+typedef uint32_t v8u32 __attribute__((vector_size(BLAKE3_LANES * 4)));
+
+#define B3_CHUNK_START         (1 << 0)
+#define B3_CHUNK_END           (1 << 1)
+#define B3_PARENT              (1 << 2)
+#define B3_ROOT                (1 << 3)
+#define B3_KEYED_HASH          (1 << 4)
+#define B3_DERIVE_KEY_CONTEXT  (1 << 5)
+#define B3_DERIVE_KEY_MATERIAL (1 << 6)
+
+/*
+ * Updates smaller than that are not worth starting the threads for,
+ * and every thread gets at least B3_TASK_CHUNKS chunks
+ */
+#define B3_PARALLEL_MIN (1 << 20)
+#define B3_TASK_CHUNKS 256
+#define B3_MAX_TASKS 256
+
+static const uint32_t blake3_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*
+ * Message word order for each of the rounds
+ */
+static const uint8_t blake3_schedule[7][16] =
+{
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static unsigned int blake3_threads;
+
+/*
+ * Chaining value in the output of a chunk or a parent node,
+ * before it is known whether it is the root
+ */
+typedef struct blake3_output_s
+{
+    uint32_t cv[8];
+    unsigned char block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+} blake3_output_t;
+
+/*
+ * Large update split between the threads. Every part is a complete
+ * subtree of the same size
+ */
+typedef struct blake3_job_s
+{
+    const unsigned char *input;
+    size_t part_chunks;
+    unsigned long parts;
+    unsigned long next;        /* next part to hash, taken atomically */
+    const uint32_t *key;
+    uint64_t counter;
+    uint8_t flags;
+    unsigned char cvs[B3_MAX_TASKS * BLAKE3_OUT_LEN];
+} blake3_job_t;
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) |
+           ((uint32_t) p[1] << 8) | p[0];
+}
+
+static inline void put_le32(unsigned char *p, uint32_t w)
+{
+    p[0] = (unsigned char) w;
+    p[1] = (unsigned char) (w >> 8);
+    p[2] = (unsigned char) (w >> 16);
+    p[3] = (unsigned char) (w >> 24);
+}
+
+/*
+ * Works the same on words and on vectors of them
+ */
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define B3_G(v, a, b, c, d, x, y)               \
+    do {                                        \
+        v[a] = v[a] + v[b] + (x);               \
+        v[d] = ROR32(v[d] ^ v[a], 16);          \
+        v[c] = v[c] + v[d];                     \
+        v[b] = ROR32(v[b] ^ v[c], 12);          \
+        v[a] = v[a] + v[b] + (y);               \
+        v[d] = ROR32(v[d] ^ v[a], 8);           \
+        v[c] = v[c] + v[d];                     \
+        v[b] = ROR32(v[b] ^ v[c], 7);           \
+    } while (0)
+
+#define B3_ROUND(v, m, s)                                 \
+    do {                                                  \
+        B3_G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);           \
+        B3_G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);           \
+        B3_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);          \
+        B3_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);          \
+        B3_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);          \
+        B3_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);        \
+        B3_G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);         \
+        B3_G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);         \
+    } while (0)
+
+/*
+ * Compression function. The whole state is returned, the chaining
+ * value is in the first eight words
+ */
+static void blake3_compress(const uint32_t cv[8], const unsigned char *block,
+                            uint8_t block_len, uint64_t counter, uint8_t flags,
+                            uint32_t out[16])
+{
+    uint32_t m[16];
+    uint32_t v[16];
+    unsigned int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = get_le32(block + 4 * i);
+    for (i = 0; i < 8; i++)
+        v[i] = cv[i];
+    for (i = 0; i < 4; i++)
+        v[i + 8] = blake3_iv[i];
+    v[12] = (uint32_t) counter;
+    v[13] = (uint32_t) (counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+
+    for (i = 0; i < 7; i++)
+        B3_ROUND(v, m, blake3_schedule[i]);
+
+    for (i = 0; i < 8; i++)
+    {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+static void blake3_compress_cv(uint32_t cv[8], const unsigned char *block,
+                               uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+    uint32_t out[16];
+
+    blake3_compress(cv, block, block_len, counter, flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void blake3_store_cv(unsigned char *out, const uint32_t cv[8])
+{
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        put_le32(out + 4 * i, cv[i]);
+}
+
+static void blake3_load_cv(uint32_t cv[8], const unsigned char *in)
+{
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        cv[i] = get_le32(in + 4 * i);
+}
+
+/*
+ * Hashes BLAKE3_LANES inputs of blocks blocks each side by side and
+ * stores their chaining values at out. Used for whole chunks, where the
+ * counter goes up by one for every lane, and for parent nodes, where
+ * it stays at zero
+ */
+B3_TARGET
+static void blake3_hash_lanes(const unsigned char *const *inputs, size_t blocks,
+                              const uint32_t key[8], uint64_t counter, int inc_counter,
+                              uint8_t flags, uint8_t flags_start, uint8_t flags_end,
+                              unsigned char *out)
+{
+    v8u32 h[8], v[16], m[16];
+    v8u32 counter_lo, counter_hi;
+    uint8_t block_flags = flags | flags_start;
+    unsigned int i, l;
+    size_t b;
+
+    for (i = 0; i < 8; i++)
+        h[i] = (v8u32) {0} + key[i];
+    for (l = 0; l < BLAKE3_LANES; l++)
+    {
+        uint64_t c = counter + (inc_counter ? l : 0);
+
+        counter_lo[l] = (uint32_t) c;
+        counter_hi[l] = (uint32_t) (c >> 32);
+    }
+
+    for (b = 0; b < blocks; b++)
+    {
+        if (b + 1 == blocks)
+            block_flags |= flags_end;
+
+        for (i = 0; i < 16; i++)
+        {
+            for (l = 0; l < BLAKE3_LANES; l++)
+                m[i][l] = get_le32(inputs[l] + b * BLAKE3_BLOCK_LEN + 4 * i);
+        }
+        for (i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (i = 0; i < 4; i++)
+            v[i + 8] = (v8u32) {0} + blake3_iv[i];
+        v[12] = counter_lo;
+        v[13] = counter_hi;
+        v[14] = (v8u32) {0} + BLAKE3_BLOCK_LEN;
+        v[15] = (v8u32) {0} + block_flags;
+
+        for (i = 0; i < 7; i++)
+            B3_ROUND(v, m, blake3_schedule[i]);
+
+        for (i = 0; i < 8; i++)
+            h[i] = v[i] ^ v[i + 8];
+        block_flags = flags;
+    }
+
+    for (l = 0; l < BLAKE3_LANES; l++)
+    {
+        for (i = 0; i < 8; i++)
+            put_le32(out + l * BLAKE3_OUT_LEN + 4 * i, h[i][l]);
+    }
+}
+
+/*
+ * Chaining value of one whole chunk
+ */
+static void blake3_chunk_cv(const unsigned char *input, const uint32_t key[8],
+                            uint64_t counter, uint8_t flags, unsigned char *out)
+{
+    uint32_t cv[8];
+    unsigned int b;
+
+    memcpy(cv, key, sizeof(cv));
+    for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+    {
+        uint8_t block_flags = flags;
+
+        if (b == 0)
+            block_flags |= B3_CHUNK_START;
+        if (b + 1 == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN)
+            block_flags |= B3_CHUNK_END;
+        blake3_compress_cv(cv, input + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN,
+                           counter, block_flags);
+    }
+    blake3_store_cv(out, cv);
+}
+
+/*
+ * Chaining value of a parent node. The two children are next
+ * to each other in children
+ */
+static void blake3_parent_cv(const unsigned char *children, const uint32_t key[8],
+                             uint8_t flags, unsigned char *out)
+{
+    uint32_t cv[8];
+
+    memcpy(cv, key, sizeof(cv));
+    blake3_compress_cv(cv, children, BLAKE3_BLOCK_LEN, 0, flags | B3_PARENT);
+    blake3_store_cv(out, cv);
+}
+
+/*
+ * Reduces n chaining values, n being a power of two, to one in place
+ */
+static void blake3_reduce(unsigned char *cvs, size_t n, const uint32_t key[8],
+                          uint8_t flags)
+{
+    const unsigned char *inputs[BLAKE3_LANES];
+    size_t i;
+    unsigned int l;
+
+    for (; n > 1; n /= 2)
+    {
+        for (i = 0; i + 2 * BLAKE3_LANES <= n; i += 2 * BLAKE3_LANES)
+        {
+            unsigned char parents[BLAKE3_LANES * BLAKE3_OUT_LEN];
+
+            for (l = 0; l < BLAKE3_LANES; l++)
+                inputs[l] = cvs + (i + 2 * l) * BLAKE3_OUT_LEN;
+            blake3_hash_lanes(inputs, 1, key, 0, 0, flags | B3_PARENT, 0, 0, parents);
+            memcpy(cvs + i / 2 * BLAKE3_OUT_LEN, parents, sizeof(parents));
+        }
+        for (; i < n; i += 2)
+            blake3_parent_cv(cvs + i * BLAKE3_OUT_LEN, key, flags,
+                             cvs + i / 2 * BLAKE3_OUT_LEN);
+    }
+}
+
+/*
+ * Chaining value of a complete subtree of chunks chunks, chunks being
+ * a power of two. The subtree must not be the root of the whole tree
+ */
+static void blake3_subtree_cv(const unsigned char *input, size_t chunks,
+                              const uint32_t key[8], uint64_t counter,
+                              uint8_t flags, unsigned char *out)
+{
+    unsigned char cvs[2 * BLAKE3_LANES * BLAKE3_OUT_LEN];
+    const unsigned char *inputs[BLAKE3_LANES];
+    unsigned int l;
+    size_t i;
+
+    if (chunks > 2 * BLAKE3_LANES)
+    {
+        size_t half = chunks / 2;
+
+        blake3_subtree_cv(input, half, key, counter, flags, cvs);
+        blake3_subtree_cv(input + half * BLAKE3_CHUNK_LEN, half, key,
+                          counter + half, flags, cvs + BLAKE3_OUT_LEN);
+        blake3_parent_cv(cvs, key, flags, out);
+        return;
+    }
+
+    for (i = 0; i + BLAKE3_LANES <= chunks; i += BLAKE3_LANES)
+    {
+        for (l = 0; l < BLAKE3_LANES; l++)
+            inputs[l] = input + (i + l) * BLAKE3_CHUNK_LEN;
+        blake3_hash_lanes(inputs, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, key,
+                          counter + i, 1, flags, B3_CHUNK_START, B3_CHUNK_END,
+                          cvs + i * BLAKE3_OUT_LEN);
+    }
+    for (; i < chunks; i++)
+        blake3_chunk_cv(input + i * BLAKE3_CHUNK_LEN, key, counter + i, flags,
+                        cvs + i * BLAKE3_OUT_LEN);
+    blake3_reduce(cvs, chunks, key, flags);
+    memcpy(out, cvs, BLAKE3_OUT_LEN);
+}
+
+/*
+ * Thread pool task - hashes parts of the job till there is none left
+ */
+static void blake3_job_task(void *arg)
+{
+    blake3_job_t *job = arg;
+    unsigned long n;
+
+    while ((n = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->parts)
+    {
+        blake3_subtree_cv(job->input + n * job->part_chunks * BLAKE3_CHUNK_LEN,
+                          job->part_chunks, job->key,
+                          job->counter + n * job->part_chunks, job->flags,
+                          job->cvs + n * BLAKE3_OUT_LEN);
+    }
+}
+
+/*
+ * Chaining values of the two halves of a complete subtree of chunks
+ * chunks. The pair is returned rather than their parent, as the subtree
+ * might turn out to be the root. With a thread pool the subtree is split
+ * into parts hashed by the workers
+ */
+static void blake3_subtree_halves(const unsigned char *input, size_t chunks,
+                                  const uint32_t key[8], uint64_t counter,
+                                  uint8_t flags, thread_pool_t *pool,
+                                  unsigned char *out)
+{
+    size_t half = chunks / 2;
+    blake3_job_t *job;
+    unsigned int workers = 0, i;
+    unsigned long parts = 2;
+
+    if (pool)
+    {
+        workers = thread_pool_size(pool);
+        while ((parts < B3_MAX_TASKS) && (parts < 4 * workers) &&
+               (chunks / (parts * 2) >= B3_TASK_CHUNKS))
+            parts *= 2;
+    }
+    if ((parts == 2) || !(job = malloc(sizeof(*job))))
+    {
+        blake3_subtree_cv(input, half, key, counter, flags, out);
+        blake3_subtree_cv(input + half * BLAKE3_CHUNK_LEN, half, key,
+                          counter + half, flags, out + BLAKE3_OUT_LEN);
+        return;
+    }
+
+    job->input = input;
+    job->part_chunks = chunks / parts;
+    job->parts = parts;
+    job->next = 0;
+    job->key = key;
+    job->counter = counter;
+    job->flags = flags;
+    for (i = 0; i < workers; i++)
+    {
+        if (thread_pool_submit(pool, blake3_job_task, job) != SUCCESS)
+            break;
+    }
+    /*
+     * Help out and pick up whatever could not be submitted
+     */
+    blake3_job_task(job);
+    thread_pool_wait(pool);
+
+    blake3_reduce(job->cvs, parts / 2, key, flags);
+    blake3_reduce(job->cvs + parts / 2 * BLAKE3_OUT_LEN, parts / 2, key, flags);
+    memcpy(out, job->cvs, BLAKE3_OUT_LEN);
+    memcpy(out + BLAKE3_OUT_LEN, job->cvs + parts / 2 * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+    free(job);
+}
+
+static void blake3_chunk_init(blake3_chunk_t *chunk, const uint32_t key[8],
+                              uint64_t counter, uint8_t flags)
+{
+    memcpy(chunk->cv, key, sizeof(chunk->cv));
+    chunk->counter = counter;
+    memset(chunk->buf, 0, BLAKE3_BLOCK_LEN);
+    chunk->buf_len = 0;
+    chunk->blocks_compressed = 0;
+    chunk->flags = flags;
+}
+
+static size_t blake3_chunk_len(const blake3_chunk_t *chunk)
+{
+    return (size_t) chunk->blocks_compressed * BLAKE3_BLOCK_LEN + chunk->buf_len;
+}
+
+static uint8_t blake3_chunk_start_flag(const blake3_chunk_t *chunk)
+{
+    return chunk->blocks_compressed ? 0 : B3_CHUNK_START;
+}
+
+/*
+ * Adds input to the chunk. The last block is kept in the buffer,
+ * as it needs the end flag if the chunk is done
+ */
+static void blake3_chunk_update(blake3_chunk_t *chunk, const unsigned char *input,
+                                size_t len)
+{
+    while (len)
+    {
+        size_t take;
+
+        if (chunk->buf_len == BLAKE3_BLOCK_LEN)
+        {
+            blake3_compress_cv(chunk->cv, chunk->buf, BLAKE3_BLOCK_LEN, chunk->counter,
+                               chunk->flags | blake3_chunk_start_flag(chunk));
+            chunk->blocks_compressed++;
+            chunk->buf_len = 0;
+            memset(chunk->buf, 0, BLAKE3_BLOCK_LEN);
+        }
+        take = BLAKE3_BLOCK_LEN - chunk->buf_len;
+        if (take > len)
+            take = len;
+        memcpy(chunk->buf + chunk->buf_len, input, take);
+        chunk->buf_len += take;
+        input += take;
+        len -= take;
+    }
+}
+
+static void blake3_chunk_output(const blake3_chunk_t *chunk, blake3_output_t *out)
+{
+    memcpy(out->cv, chunk->cv, sizeof(out->cv));
+    memcpy(out->block, chunk->buf, BLAKE3_BLOCK_LEN);
+    out->block_len = chunk->buf_len;
+    out->counter = chunk->counter;
+    out->flags = chunk->flags | blake3_chunk_start_flag(chunk) | B3_CHUNK_END;
+}
+
+static void blake3_parent_output(const unsigned char *left, const unsigned char *right,
+                                 const uint32_t key[8], uint8_t flags,
+                                 blake3_output_t *out)
+{
+    memcpy(out->cv, key, sizeof(out->cv));
+    memcpy(out->block, left, BLAKE3_OUT_LEN);
+    memcpy(out->block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    out->block_len = BLAKE3_BLOCK_LEN;
+    out->counter = 0;
+    out->flags = flags | B3_PARENT;
+}
+
+static void blake3_output_cv(const blake3_output_t *out, unsigned char *cv)
+{
+    uint32_t words[8];
+
+    memcpy(words, out->cv, sizeof(words));
+    blake3_compress_cv(words, out->block, out->block_len, out->counter, out->flags);
+    blake3_store_cv(cv, words);
+}
+
+static void blake3_output_root(const blake3_output_t *out, unsigned char *dst,
+                               size_t len)
+{
+    uint64_t counter = 0;
+    uint32_t words[16];
+    unsigned char block[BLAKE3_BLOCK_LEN];
+    unsigned int i;
+
+    while (len)
+    {
+        size_t take = len < BLAKE3_BLOCK_LEN ? len : BLAKE3_BLOCK_LEN;
+
+        blake3_compress(out->cv, out->block, out->block_len, counter,
+                        out->flags | B3_ROOT, words);
+        for (i = 0; i < 16; i++)
+            put_le32(block + 4 * i, words[i]);
+        memcpy(dst, block, take);
+        dst += take;
+        len -= take;
+        counter++;
+    }
+}
+
+/*
+ * Merges the chaining values on the stack that belong to complete
+ * subtrees, given total chunks seen so far. What is left is one
+ * value for every bit set in total
+ */
+static void blake3_merge_cv_stack(blake3_hasher_t *hasher, uint64_t total)
+{
+    unsigned int post_len = __builtin_popcountll(total);
+
+    while (hasher->cv_stack_len > post_len)
+    {
+        unsigned char *top = hasher->cv_stack + (hasher->cv_stack_len - 2) * BLAKE3_OUT_LEN;
+
+        blake3_parent_cv(top, hasher->key, hasher->chunk.flags, top);
+        hasher->cv_stack_len--;
+    }
+}
+
+static void blake3_push_cv(blake3_hasher_t *hasher, const unsigned char *cv,
+                           uint64_t counter)
+{
+    blake3_merge_cv_stack(hasher, counter);
+    memcpy(hasher->cv_stack + hasher->cv_stack_len * BLAKE3_OUT_LEN, cv, BLAKE3_OUT_LEN);
+    hasher->cv_stack_len++;
+}
+
+static void blake3_hasher_init_key(blake3_hasher_t *hasher, const uint32_t key[8],
+                                   uint8_t flags)
+{
+    memcpy(hasher->key, key, sizeof(hasher->key));
+    blake3_chunk_init(&hasher->chunk, key, 0, flags);
+    hasher->cv_stack_len = 0;
+    hasher->threads = blake3_threads;
+}
+
+/*
+ *
+ */
+void blake3_set_threads(unsigned int threads)
+{
+    blake3_threads = threads;
+}
+
+/*
+ *
+ */
+void blake3_hasher_init(blake3_hasher_t *hasher)
+{
+    blake3_hasher_init_key(hasher, blake3_iv, 0);
+}
+
+/*
+ *
+ */
+void blake3_hasher_init_derive_key(blake3_hasher_t *hasher, const char *context)
+{
+    unsigned char context_key[BLAKE3_KEY_LEN];
+    uint32_t key[8];
+
+    blake3_hasher_init_key(hasher, blake3_iv, B3_DERIVE_KEY_CONTEXT);
+    blake3_hasher_update(hasher, context, strlen(context));
+    blake3_hasher_finalize(hasher, context_key, BLAKE3_KEY_LEN);
+    blake3_load_cv(key, context_key);
+    blake3_hasher_init_key(hasher, key, B3_DERIVE_KEY_MATERIAL);
+}
+
+/*
+ *
+ */
+void blake3_hasher_update(blake3_hasher_t *hasher, const void *data, size_t len)
+{
+    const unsigned char *input = data;
+    thread_pool_t *pool = NULL;
+    unsigned int threads = hasher->threads;
+
+    /*
+     * Finish the chunk started by the previous update first
+     */
+    if (blake3_chunk_len(&hasher->chunk))
+    {
+        size_t take = BLAKE3_CHUNK_LEN - blake3_chunk_len(&hasher->chunk);
+        blake3_output_t out;
+        unsigned char cv[BLAKE3_OUT_LEN];
+
+        if (take > len)
+            take = len;
+        blake3_chunk_update(&hasher->chunk, input, take);
+        input += take;
+        len -= take;
+        if (!len)
+            return;
+
+        blake3_chunk_output(&hasher->chunk, &out);
+        blake3_output_cv(&out, cv);
+        blake3_push_cv(hasher, cv, hasher->chunk.counter);
+        blake3_chunk_init(&hasher->chunk, hasher->key, hasher->chunk.counter + 1,
+                          hasher->chunk.flags);
+    }
+
+    if (!threads)
+        threads = thread_pool_cpus();
+    if ((threads > 1) && (len >= B3_PARALLEL_MIN))
+    {
+        if (thread_pool_create(&pool, threads) != SUCCESS)
+            pool = NULL;
+    }
+
+    /*
+     * Then take the biggest complete subtrees the input allows.
+     * The last chunk stays in the chunk state, as it may be the root
+     */
+    while (len > BLAKE3_CHUNK_LEN)
+    {
+        uint64_t done = hasher->chunk.counter * BLAKE3_CHUNK_LEN;
+        size_t subtree_len = (size_t) 1 << (63 - __builtin_clzll(len));
+        size_t subtree_chunks;
+        unsigned char cvs[2 * BLAKE3_OUT_LEN];
+
+        while ((subtree_len - 1) & done)
+            subtree_len /= 2;
+        subtree_chunks = subtree_len / BLAKE3_CHUNK_LEN;
+
+        if (subtree_chunks == 1)
+        {
+            blake3_chunk_cv(input, hasher->key, hasher->chunk.counter,
+                            hasher->chunk.flags, cvs);
+            blake3_push_cv(hasher, cvs, hasher->chunk.counter);
+        }
+        else
+        {
+            blake3_subtree_halves(input, subtree_chunks, hasher->key,
+                                  hasher->chunk.counter, hasher->chunk.flags,
+                                  pool, cvs);
+            blake3_push_cv(hasher, cvs, hasher->chunk.counter);
+            blake3_push_cv(hasher, cvs + BLAKE3_OUT_LEN,
+                           hasher->chunk.counter + subtree_chunks / 2);
+        }
+        hasher->chunk.counter += subtree_chunks;
+        input += subtree_len;
+        len -= subtree_len;
+    }
+    if (pool)
+        thread_pool_destroy(pool);
+
+    if (len)
+    {
+        blake3_chunk_update(&hasher->chunk, input, len);
+        blake3_merge_cv_stack(hasher, hasher->chunk.counter);
+    }
+}
+
+/*
+ *
+ */
+void blake3_hasher_finalize(const blake3_hasher_t *hasher, unsigned char *out,
+                            size_t out_len)
+{
+    blake3_output_t output;
+    unsigned char cv[BLAKE3_OUT_LEN];
+    size_t remaining;
+
+    if (!out_len)
+        return;
+
+    if (!hasher->cv_stack_len)
+    {
+        blake3_chunk_output(&hasher->chunk, &output);
+        blake3_output_root(&output, out, out_len);
+        return;
+    }
+
+    /*
+     * Fold the stack from the right. If the chunk state is empty the
+     * input ended on a subtree boundary and the last two values
+     * on the stack are the children of the root
+     */
+    if (blake3_chunk_len(&hasher->chunk))
+    {
+        blake3_chunk_output(&hasher->chunk, &output);
+        remaining = hasher->cv_stack_len;
+    }
+    else
+    {
+        remaining = hasher->cv_stack_len - 2;
+        blake3_parent_output(hasher->cv_stack + remaining * BLAKE3_OUT_LEN,
+                             hasher->cv_stack + (remaining + 1) * BLAKE3_OUT_LEN,
+                             hasher->key, hasher->chunk.flags, &output);
+    }
+    while (remaining)
+    {
+        remaining--;
+        blake3_output_cv(&output, cv);
+        blake3_parent_output(hasher->cv_stack + remaining * BLAKE3_OUT_LEN, cv,
+                             hasher->key, hasher->chunk.flags, &output);
+    }
+    blake3_output_root(&output, out, out_len);
+}
+
+/*
+ *
+ */
+void blake3_hash(const void *input, size_t len, unsigned char *out)
+{
+    blake3_hasher_t hasher;
+
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, input, len);
+    blake3_hasher_finalize(&hasher, out, BLAKE3_OUT_LEN);
+}
@@ -0,0 +1,100 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_BLAKE3_H_
+#define _SPG_BLAKE3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * BLAKE3 tree hash.
+ * The input is split into 1 KiB chunks, every chunk is hashed on its own
+ * and the chaining values are combined in a binary tree, so the chunks
+ * can be processed independently. Eight chunks are hashed at a time, one
+ * per SIMD lane, and large inputs are split into subtrees hashed on the
+ * worker threads. The result is the same no matter how the input is
+ * passed to blake3_hasher_update.
+ */
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_KEY_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+#define BLAKE3_LANES 8
+
+typedef struct blake3_chunk_s
+{
+    uint32_t cv[8];
+    uint64_t counter;
+    unsigned char buf[BLAKE3_BLOCK_LEN];
+    uint8_t buf_len;
+    uint8_t blocks_compressed;
+    uint8_t flags;
+} blake3_chunk_t;
+
+typedef struct blake3_hasher_s
+{
+    uint32_t key[8];
+    blake3_chunk_t chunk;
+    uint8_t cv_stack_len;
+    unsigned char cv_stack[(BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN];
+    unsigned int threads;
+} blake3_hasher_t;
+
+/*
+ * Function: blake3_set_threads
+ * Sets number of threads used by the hashers initialized afterwards.
+ * 0 means one per online CPU
+ */
+void blake3_set_threads(unsigned int threads);
+
+/*
+ * Function: blake3_hasher_init
+ * Initializes hasher for plain hashing
+ */
+void blake3_hasher_init(blake3_hasher_t *hasher);
+
+/*
+ * Function: blake3_hasher_init_derive_key
+ * Initializes hasher for key derivation. The context string should be
+ * hardcoded, globally unique and application specific
+ */
+void blake3_hasher_init_derive_key(blake3_hasher_t *hasher, const char *context);
+
+/*
+ * Function: blake3_hasher_update
+ * Adds len bytes of input. Updates big enough to be worth it are
+ * hashed on multiple threads
+ */
+void blake3_hasher_update(blake3_hasher_t *hasher, const void *input, size_t len);
+
+/*
+ * Function: blake3_hasher_finalize
+ * Writes out_len bytes of output. The hasher is not modified,
+ * so more input can be added afterwards
+ */
+void blake3_hasher_finalize(const blake3_hasher_t *hasher, unsigned char *out,
+                            size_t out_len);
+
+/*
+ * Function: blake3_hash
+ * Hashes the buffer in one go and writes BLAKE3_OUT_LEN bytes to out
+ */
+void blake3_hash(const void *input, size_t len, unsigned char *out);
+
+#endif /* _SPG_BLAKE3_H_ */
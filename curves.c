@@ -17,6 +17,7 @@
  *************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <gcrypt.h>
@@ -435,6 +436,11 @@ void free_curve(curve *c)
 #endif
     mpi_release(c->params.n);
     c->params.h = 0;
+    if (c->params.G_table)
+    {
+        ec_point_table_free(c->params.G_table);
+        FREE(c->params.G_table);
+    }
     return;
 }
 
@@ -26,6 +26,7 @@
 
 extern const char* program_name;
 extern int verbose;
+extern int log_stderr;
 
 typedef enum
 {
@@ -38,26 +39,29 @@ typedef enum
     NOT_IMPLEMENTED
 } status;
 
+/* Messages go to stderr when stdout carries the data */
+#define LOG_STREAM (log_stderr ? stderr : stdout)
+
 #define ERROR_LOG(mesg, params...)                                \
 	do {                                                            \
-	printf("ERROR: %s:%d - "  mesg, __FILE__, __LINE__, ##params);\
+	fprintf(LOG_STREAM, "ERROR: %s:%d - "  mesg, __FILE__, __LINE__, ##params);\
 	} while(0)
 
 
 #define DEBUG_LOG(mesg, params...)                                \
 	do {                                                            \
-	printf("DEBUG: %s:%d - "  mesg, __FILE__, __LINE__, ##params);\
+	fprintf(LOG_STREAM, "DEBUG: %s:%d - "  mesg, __FILE__, __LINE__, ##params);\
 	} while(0)
 
 #define INFO_LOG(mesg, params...)     \
 	do {                                \
-	printf("INFO: "  mesg, ##params); \
+	fprintf(LOG_STREAM, "INFO: "  mesg, ##params); \
 	} while(0)
 
 #define LOG(mesg, params...)                    \
 	do {                                          \
 		if (verbose)                             \
-			printf("MESSAGE: " mesg, ##params); \
+			fprintf(LOG_STREAM, "MESSAGE: " mesg, ##params); \
 	} while(0)
 
 #define CHECK_PARAM(param)                                      \
@@ -83,18 +87,35 @@ do {                  \
 #define PEM_PUB_KEY_NAME "SPG PUBLIC KEY"
 #define PEM_PRV_KEY_NAME "SPG PRIVATE KEY"
 #define PEM_SIGN_NAME    "SPG SIGNATURE"
+#define PEM_PROOF_NAME   "SPG INCLUSION PROOF"
 #define PEM_EMPTY_STR    ""
 
 #define SHA1_LEN 20
 #define SHA512_LEN 64
-#define MAX_MSG_SIZE 0x40000 /*256K Bytes*/
-#define MAX_MSG_SIZE_STR "256K Bytes"
+/* Messages are hashed in chunks of this size */
+#define MSG_CHUNK_SIZE 0x100000 /*1M Bytes*/
+/* Max number of messages signed or verified together */
+#define SIGN_BATCH_SIZE 64
 /* Max size of the big number in bytes. For curve secp521r1 it is 133 */
 #define MAX_BIG_NUM_SIZE 134
 #define MAX_FILE_NAME_SIZE 1024
 #define MAX_SUFFIX_SIZE 5
 #define SYM_CIPHER_DATA_UNIT_SIZE 4096
 #define ENCRYPTED_FILE_SUFFIX ".enc"
+/*
+ * Encrypted file header: magic, format version, cipher, key derivation
+ * function, segment size shift and point R.
+ * Files of the first version have no header and start with R
+ */
+#define ENC_MAGIC "SPGENC"
+#define ENC_MAGIC_SIZE 6
+#define ENC_VERSION_SEGMENTED 3
+#define ENC_HEADER_MAX_SIZE (ENC_MAGIC_SIZE + 4 + 2 * (MAX_BIG_NUM_SIZE + 1))
 #define SIGNATURE_FILE_SUFFIX ".sign"
+#define PRECOMP_FILE_SUFFIX ".tab"
+#define CHUNK_CACHE_FILE_SUFFIX ".chunks"
+#define PROOF_FILE_SUFFIX ".proof"
+#define MANIFEST_FILE_SUFFIX ".manifest"
+#define APPEND_JOURNAL_FILE_SUFFIX ".journal"
 #define SPG_DIR_NAME ".spg"
 #endif /* _SPG_DEFS_H_ */
@@ -26,6 +26,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
 #include <gcrypt.h>
 #include <math.h>
 #include "defs.h"
@@ -357,7 +359,6 @@ status ec_point_add_jacobian(EC_point_t *r, const EC_point_t *p, const EC_point_
     if (ec_point_is_infinity_jacobian(p))
     {
         ec_point_copy(r, q);
-        mpi_set_ui(r->z, 1);
         return stat;
     }
     u1 = mpi_new(0);
@@ -382,8 +383,12 @@ status ec_point_add_jacobian(EC_point_t *r, const EC_point_t *p, const EC_point_
         {
             mpi_release(s1);
             mpi_release(s2);
-            mpi_set_ui(q->z, 1);
-            return ec_point_double_jacobian(r, p, params);
+            /* double in place works on p so make sure it is r */
+            if (r != p)
+            {
+                ec_point_copy(r, p);
+            }
+            return ec_point_double_jacobian(r, r, params);
         }
         else
         {
@@ -804,6 +809,152 @@ EC_point_t ec_point_multiply(const EC_point_t *p, const big_number d, const GFp_
 }
 #endif /* WINDOW_NAF_MULT */
 
+/*
+ * Window width for fixed-base tables. The cost of the table
+ * multiply is about d + 2^w additions where d = bits / w
+ */
+static inline unsigned int get_table_window_size(unsigned int bits)
+{
+    if (bits > 384)
+        return 5;
+    return 4;
+}
+
+/*
+ * Build fixed-base table for point p
+ * points[i] = 2^(w*i) * p for i = 0 .. d-1
+ * All points are stored in affine form (z = 1) so that the
+ * additions in ec_point_multiply_table are mixed additions
+ */
+status ec_point_table_build(EC_point_table_t *t, const EC_point_t *p,
+                            unsigned int bits, const GFp_params_t *params)
+{
+    unsigned int i = 0, j = 0;
+    EC_point_t tmp;
+
+    CHECK_PARAM(t);
+    CHECK_PARAM(p);
+
+    t->w = get_table_window_size(bits);
+    t->d = (bits + t->w - 1) / t->w;
+    t->points = malloc(t->d * sizeof(EC_point_t));
+    if (!t->points)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        t->d = 0;
+        return FAIL;
+    }
+    ec_point_init(&tmp);
+    ec_point_copy(&tmp, p);
+    for (i = 0; i < t->d; i++)
+    {
+        if (i)
+        {
+            for (j = 0; j < t->w; j++)
+            {
+                EC_POINT_DOUBLE_OPT(&tmp, &tmp, params);
+            }
+#ifdef JACOBIAN_COORDINATES
+            ec_point_jacobian_to_affine(&tmp, &tmp, params);
+#endif
+        }
+        ec_point_init(&t->points[i]);
+        ec_point_copy(&t->points[i], &tmp);
+    }
+    ec_point_free(&tmp);
+    return SUCCESS;
+}
+
+/*
+ * Release fixed-base table
+ */
+void ec_point_table_free(EC_point_table_t *t)
+{
+    unsigned int i = 0;
+    if (t->points)
+    {
+        for (i = 0; i < t->d; i++)
+        {
+            ec_point_free(&t->points[i]);
+        }
+        FREE(t->points);
+    }
+    t->d = 0;
+}
+
+/*
+ * Get point i from the table.
+ * The point p has to be freed by the caller
+ */
+void ec_point_table_get(const EC_point_table_t *t, unsigned int i, EC_point_t *p)
+{
+    ec_point_init(p);
+    ec_point_copy(p, &t->points[i]);
+}
+
+/*
+ * Point multiply using fixed-base table
+ * Implementation of Fixed-base windowing method
+ * Algorithm 3.41 in Guide to ECC
+ */
+EC_point_t ec_point_multiply_table(const EC_point_table_t *t, const big_number k,
+                                   const GFp_params_t *params)
+{
+    EC_point_t a, b, pi;
+    unsigned int i = 0, j = 0, x = 0;
+    unsigned int *digits = NULL;
+
+    /*
+     * Scalar bigger than the table - do it the slow way
+     */
+    if ((mpi_get_nbits(k) > t->w * t->d) ||
+            !(digits = malloc(t->d * sizeof(unsigned int))))
+    {
+        ec_point_table_get(t, 0, &pi);
+        a = ec_point_multiply(&pi, k, params);
+        ec_point_free(&pi);
+        return a;
+    }
+    /* k = (K_d-1, ... K_0) in base 2^w */
+    for (i = 0; i < t->d; i++)
+    {
+        digits[i] = 0;
+        for (x = 0; x < t->w; x++)
+        {
+            if (mpi_test_bit(k, i * t->w + x))
+            {
+                digits[i] |= 1 << x;
+            }
+        }
+    }
+    ec_point_init(&a);
+    ec_point_init(&b);
+    for (j = (1 << t->w) - 1; j > 0; j--)
+    {
+        for (i = 0; i < t->d; i++)
+        {
+            if (digits[i] != j)
+            {
+                continue;
+            }
+            EC_POINT_ADD_OPT(&b, &b, &t->points[i], params);
+        }
+        EC_POINT_ADD_OPT(&a, &a, &b, params);
+    }
+    free(digits);
+    ec_point_free(&b);
+#ifdef JACOBIAN_COORDINATES
+    ec_point_jacobian_to_affine(&a, &a, params);
+#endif
+#ifdef VALIDATE_POINT
+    if (! ec_point_on_curve(&a, params))
+    {
+        ERROR_LOG("Point not on curve \n");
+    }
+#endif
+    return a;
+}
+
 #define BUFF_SIZE 256
 /*
  * Debug function - prints out the given point
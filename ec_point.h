@@ -30,6 +30,17 @@ typedef struct EC_point_s
 #endif
 } EC_point_t;
 
+/*
+ * Fixed-base table of point P
+ * points[i] = 2^(w*i) * P, i = 0 .. d-1
+ */
+typedef struct EC_point_table_s
+{
+    unsigned int w; /* window width in bits */
+    unsigned int d; /* number of points */
+    EC_point_t *points;
+} EC_point_table_t;
+
 struct domain_GFp_params_s;
 typedef struct domain_GFp_params_s GFp_params_t;
 
@@ -47,5 +58,11 @@ EC_point_t ec_point_multiply(const EC_point_t *p, const big_number d,
                              const GFp_params_t *params );
 status ec_point_sub(EC_point_t *r, const EC_point_t *q,
                     const EC_point_t *p, const GFp_params_t *params);
+status ec_point_table_build(EC_point_table_t *t, const EC_point_t *p,
+                            unsigned int bits, const GFp_params_t *params);
+void ec_point_table_free(EC_point_table_t *t);
+void ec_point_table_get(const EC_point_table_t *t, unsigned int i, EC_point_t *p);
+EC_point_t ec_point_multiply_table(const EC_point_table_t *t, const big_number k,
+                                   const GFp_params_t *params);
 void ec_debug_print_point(const EC_point_t const *p);
 #endif
@@ -19,11 +19,17 @@
 #include <gcrypt.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include "defs.h"
 #include "ec_point.h"
 #include "ecc.h"
 #include "curves.h"
 #include "utils.h"
+#include "rng.h"
+#include "mb_hash.h"
+#include "blake3.h"
 
 status ec_generate_key(EC_private_key_t* priv_key, const char *curve_name)
 {
@@ -56,6 +62,7 @@ status ec_generate_key(EC_private_key_t* priv_key, const char *curve_name)
      */
     priv_key->pub.c = c;
     priv_key->pub.Q = ec_point_multiply(&c.params.G, priv_key->priv, &c.params);
+    priv_key->pub.Q_table = NULL;
     return stat;
 }
 
@@ -72,118 +79,492 @@ status ec_verify_key(EC_private_key_t* priv_key)
 void ec_release_key(EC_private_key_t* priv_key)
 {
     mpi_release(priv_key->priv);
-    ec_point_free(&priv_key->pub.Q);
-    free_curve(&priv_key->pub.c);
+    ec_release_public_key(&priv_key->pub);
 }
 
 void ec_release_public_key(EC_public_key_t* pub_key)
 {
+    if (pub_key->Q_table)
+    {
+        ec_point_table_free(pub_key->Q_table);
+        FREE(pub_key->Q_table);
+    }
     ec_point_free(&pub_key->Q);
     free_curve(&pub_key->c);
 }
 
-status ec_generate_signature(EC_private_key_t* priv_key, EC_signature_t* sign, void* data, size_t size)
+status ec_public_key_precompute(EC_public_key_t* pub_key)
 {
     status stat = SUCCESS;
-    gcry_md_hd_t hash;
-    char* dgst = NULL;
-    big_number k;
-    big_number e;
-    EC_point_t kG;
-    int gen_s_ok = 1, gen_k_ok = 1;
+    EC_point_table_t *t = NULL;
 
-    CHECK_PARAM(priv_key);
-    CHECK_PARAM(sign);
-    CHECK_PARAM(data);
+    CHECK_PARAM(pub_key);
 
-    sign->r = mpi_new(0);
-    sign->s = mpi_new(0);
+    if (pub_key->Q_table)
+    {
+        return stat;
+    }
+    t = malloc(sizeof(EC_point_table_t));
+    if (!t)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    /*
+     * Scalars multiplied by Q are reduced mod n
+     * and multiplied by cofactor h
+     */
+    stat = ec_point_table_build(t, &pub_key->Q,
+                  mpi_get_nbits(pub_key->c.params.n) + pub_key->c.params.h - 1,
+                  &pub_key->c.params);
+    if (SUCCESS == stat)
+    {
+        pub_key->Q_table = t;
+    }
+    else
+    {
+        free(t);
+    }
+    return stat;
+}
+
+/*
+ * Multiply base point G by k
+ * using the fixed-base table if there is one
+ */
+static EC_point_t ec_base_point_multiply(const GFp_params_t* params, big_number k)
+{
+    if (params->G_table)
+    {
+        return ec_point_multiply_table(params->G_table, k, params);
+    }
+    return ec_point_multiply(&params->G, k, params);
+}
 
-    if (gcry_md_open(&hash, GCRY_MD_SHA512, 0) != GPG_ERR_NO_ERROR)
+/*
+ * Multiply public key point Q by k
+ * using the fixed-base table if there is one
+ */
+static EC_point_t ec_public_key_multiply(EC_public_key_t* pub_key, big_number k)
+{
+    if (pub_key->Q_table)
     {
-        ERROR_LOG("Init hash function failed\n");
+        return ec_point_multiply_table(pub_key->Q_table, k, &pub_key->c.params);
+    }
+    return ec_point_multiply(&pub_key->Q, k, &pub_key->c.params);
+}
+
+/*
+ * Nonce generation type used by ec_generate_signature
+ */
+ec_nonce_type nonce_type = EC_NONCE_RFC6979;
+
+/*
+ * Symmetric key derivation function
+ */
+ec_kdf_type kdf_type = EC_KDF_SHA512;
+
+/*
+ * Signature digests
+ */
+static const struct
+{
+    const char* name;
+    int md_algo;
+    unsigned int size;
+} ec_hashes[EC_HASH_TERM] =
+{
+    [EC_HASH_LEGACY] = { "legacy", GCRY_MD_SHA512, 64 },
+    [EC_HASH_SHA256] = { "sha256", GCRY_MD_SHA256, 32 },
+    [EC_HASH_SHA384] = { "sha384", GCRY_MD_SHA384, 48 },
+    [EC_HASH_SHA512] = { "sha512", GCRY_MD_SHA512, 64 },
+    [EC_HASH_BLAKE2B] = { "blake2b", GCRY_MD_BLAKE2B_512, 64 },
+    [EC_HASH_BLAKE3] = { "blake3", 0, BLAKE3_OUT_LEN },
+};
+
+int ec_hash_md_algo(ec_hash_type hash)
+{
+    return (hash < EC_HASH_TERM) ? ec_hashes[hash].md_algo : 0;
+}
+
+unsigned int ec_hash_size(ec_hash_type hash)
+{
+    return (hash < EC_HASH_TERM) ? ec_hashes[hash].size : 0;
+}
+
+/*
+ * ec_hash_hmac_algo
+ * HMAC hash of the RFC 6979 nonce generator. Hashes gcrypt can't do
+ * HMAC with use SHA-256 instead
+ */
+static int ec_hash_hmac_algo(ec_hash_type hash)
+{
+    return ec_hash_md_algo(hash) ? ec_hash_md_algo(hash) : GCRY_MD_SHA256;
+}
+
+const char* ec_hash_name(ec_hash_type hash)
+{
+    return (hash < EC_HASH_TERM) ? ec_hashes[hash].name : NULL;
+}
+
+status ec_hash_by_name(const char* name, ec_hash_type* hash)
+{
+    unsigned int i;
+
+    CHECK_PARAM(name);
+    CHECK_PARAM(hash);
+
+    for (i = 0; i < EC_HASH_TERM; i++)
+    {
+        if (strcmp(name, ec_hashes[i].name) == 0)
+        {
+            *hash = (ec_hash_type) i;
+            return SUCCESS;
+        }
+    }
+    return BAD_PARAMS;
+}
+
+/*
+ * RFC 6979 HMAC_DRBG state
+ */
+#define RFC6979_MAX_HLEN 64
+typedef struct rfc6979_s
+{
+    unsigned char K[RFC6979_MAX_HLEN];
+    unsigned char V[RFC6979_MAX_HLEN];
+    unsigned int hlen;
+    int md_algo;
+    int first;
+} rfc6979_t;
+
+/*
+ * K = HMAC_K(V || sep || data), sep and data are optional
+ */
+static status rfc6979_hmac(rfc6979_t *st, unsigned char *out, int sep,
+                           const unsigned char *data, size_t len)
+{
+    gcry_md_hd_t hmac;
+    unsigned char s = (unsigned char) sep;
+
+    if (gcry_md_open(&hmac, st->md_algo, GCRY_MD_FLAG_HMAC) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hmac function failed\n");
         return FAIL;
     }
-    gcry_md_write (hash, data, size);
-    gcry_md_final(hash);
-    dgst = (char*) gcry_md_read(hash, 0);
+    gcry_md_setkey(hmac, st->K, st->hlen);
+    gcry_md_write(hmac, st->V, st->hlen);
+    if (sep >= 0)
+        gcry_md_write(hmac, &s, 1);
+    if (data)
+        gcry_md_write(hmac, data, len);
+    gcry_md_final(hmac);
+    memcpy(out, gcry_md_read(hmac, 0), st->hlen);
+    gcry_md_close(hmac);
+    return SUCCESS;
+}
+
+/*
+ * bits2int - leftmost qlen bits of the buffer as an integer
+ */
+static big_number rfc6979_bits2int(const unsigned char *buff, size_t len, unsigned int qlen)
+{
+    big_number z = NULL;
+
+    if (gcry_mpi_scan(&z, GCRYMPI_FMT_USG, buff, len, NULL) != GPG_ERR_NO_ERROR)
+    {
+        return NULL;
+    }
+    if (len * 8 > qlen)
+    {
+        mpi_rshift(z, z, len * 8 - qlen);
+    }
+    return z;
+}
+
+/*
+ * int2octets - the number as rlen = 8 * ceil(qlen / 8) bits
+ */
+static status rfc6979_int2octets(unsigned char *out, big_number z, unsigned int rlen)
+{
+    unsigned char buff[MAX_BIG_NUM_SIZE];
+    size_t len = 0;
+
+    if ((gcry_mpi_print(GCRYMPI_FMT_USG, buff, MAX_BIG_NUM_SIZE, &len, z) != GPG_ERR_NO_ERROR)
+            || (len > rlen))
+    {
+        return FAIL;
+    }
+    memset(out, 0, rlen - len);
+    memcpy(out + rlen - len, buff, len);
+    return SUCCESS;
+}
+
+/*
+ * RFC 6979 section 3.2 steps b. to f.
+ * Seeds the HMAC_DRBG with private key x and hash h1
+ */
+static status rfc6979_init(rfc6979_t *st, int md_algo, big_number x, big_number n,
+                           const unsigned char *h1, size_t h1_len)
+{
+    status stat = SUCCESS;
+    unsigned int qlen = mpi_get_nbits(n);
+    unsigned int rlen = (qlen + 7) / 8;
+    unsigned char seed[2 * MAX_BIG_NUM_SIZE];
+    big_number z = NULL;
+
+    st->md_algo = md_algo;
+    st->hlen = gcry_md_get_algo_dlen(md_algo);
+    st->first = 1;
+    if (st->hlen > RFC6979_MAX_HLEN || rlen > MAX_BIG_NUM_SIZE)
+    {
+        return FAIL;
+    }
+    /* int2octets(x) || bits2octets(h1) */
+    stat = rfc6979_int2octets(seed, x, rlen);
+    z = rfc6979_bits2int(h1, h1_len, qlen);
+    if (!z)
+    {
+        return FAIL;
+    }
+    if (mpi_cmp(z, n) >= 0)
+    {
+        mpi_sub(z, z, n);
+    }
+    if (SUCCESS == stat)
+        stat = rfc6979_int2octets(seed + rlen, z, rlen);
+    mpi_release(z);
+
+    memset(st->V, 0x01, st->hlen);
+    memset(st->K, 0x00, st->hlen);
+    if (SUCCESS == stat)
+        stat = rfc6979_hmac(st, st->K, 0x00, seed, 2 * rlen);
+    if (SUCCESS == stat)
+        stat = rfc6979_hmac(st, st->V, -1, NULL, 0);
+    if (SUCCESS == stat)
+        stat = rfc6979_hmac(st, st->K, 0x01, seed, 2 * rlen);
+    if (SUCCESS == stat)
+        stat = rfc6979_hmac(st, st->V, -1, NULL, 0);
+    memset(seed, 0, sizeof(seed));
+    return stat;
+}
+
+/*
+ * RFC 6979 section 3.2 step h.
+ * Returns next candidate k in [1, n-1] or NULL on error
+ */
+static big_number rfc6979_next(rfc6979_t *st, big_number n)
+{
+    unsigned int qlen = mpi_get_nbits(n);
+    unsigned char T[MAX_BIG_NUM_SIZE + RFC6979_MAX_HLEN];
+    unsigned int tlen = 0;
+    big_number k = NULL;
+
+    while (1)
+    {
+        /*
+         * If previous k was no good, or r or s came out 0,
+         * K = HMAC_K(V || 0x00) and V = HMAC_K(V) before trying again
+         */
+        if (!st->first)
+        {
+            if ((rfc6979_hmac(st, st->K, 0x00, NULL, 0) != SUCCESS) ||
+                    (rfc6979_hmac(st, st->V, -1, NULL, 0) != SUCCESS))
+                return NULL;
+        }
+        st->first = 0;
+        for (tlen = 0; tlen * 8 < qlen; tlen += st->hlen)
+        {
+            if (rfc6979_hmac(st, st->V, -1, NULL, 0) != SUCCESS)
+                return NULL;
+            memcpy(T + tlen, st->V, st->hlen);
+        }
+        k = rfc6979_bits2int(T, tlen, qlen);
+        if (!k)
+            return NULL;
+        if ((mpi_cmp_ui(k, 0) > 0) && (mpi_cmp(k, n) < 0))
+            break;
+        mpi_release(k);
+    }
+    memset(T, 0, sizeof(T));
+    return k;
+}
+
+/*
+ * Generate nonce k and compute k^-1 mod n and r = (k * G).x mod n
+ * so that r != 0. If drbg is given k is taken from the RFC 6979
+ * generator, otherwise it is random
+ */
+static status ec_nonce_pair(const GFp_params_t* params, rfc6979_t* drbg,
+                            big_number kinv, big_number r)
+{
+    big_number k;
+    EC_point_t kG;
 
     do
     {
-        gen_s_ok = 1;
-        do
+        if (drbg)
         {
-            gen_k_ok = 1;
-            /*
-             * Generate random k
-             */
-            k = mpi_new(0);
-            gcry_mpi_randomize (k, mpi_get_nbits(priv_key->pub.c.params.n),
-                                 GCRY_STRONG_RANDOM);
-            /*
-             * Make sure k < n
-             */
-            mpi_mod(k, k, priv_key->pub.c.params.n);
             /*
-             * compute kG = G * k
+             * Generate deterministic k in [1, n-1]
              */
-            kG = ec_point_multiply(&priv_key->pub.c.params.G, k , &priv_key->pub.c.params);
+            k = rfc6979_next(drbg, params->n);
+            if (!k)
+            {
+                ERROR_LOG("Generate deterministic nonce failed\n");
+                return FAIL;
+            }
+        }
+        else
+        {
             /*
-             * r = kG.x
+             * Generate random k
              */
-            mpi_mod(sign->r, kG.x, priv_key->pub.c.params.n);
-            ec_point_free(&kG);
+            k = rng_random_mpi(mpi_get_nbits(params->n));
             /*
-             * if r != 0 then go farther
+             * Make sure k < n
              */
-            if (mpi_cmp_ui(sign->r, 0) == 0)
-            {
-                gen_k_ok = 0;
-                mpi_release(k);
-            }
+            mpi_mod(k, k, params->n);
         }
-        while (!gen_k_ok);
-        if (GPG_ERR_NO_ERROR != gcry_mpi_scan(&e,
-                    GCRYMPI_FMT_USG, dgst, SHA512_LEN, NULL))
+        /*
+         * compute kG = G * k
+         */
+        kG = ec_base_point_multiply(params, k);
+        /*
+         * r = kG.x
+         */
+        mpi_mod(r, kG.x, params->n);
+        ec_point_free(&kG);
+        /*
+         * if r != 0 then go farther
+         */
+        if (mpi_cmp_ui(r, 0) != 0)
         {
-            ERROR_LOG("Generate signature failed\n");
-            gcry_md_close(hash);
-            mpi_release(k);
+            mpi_invm(kinv, k, params->n);
+        }
+        mpi_release(k);
+    }
+    while (mpi_cmp_ui(r, 0) == 0);
+    return SUCCESS;
+}
+
+/*
+ * ec_digest_to_int
+ * Converts message digest to integer e. SEC 1 takes the leftmost
+ * bits of the digest, as many as there is in n. Legacy signatures
+ * used SHA-512 reduced mod n instead
+ */
+static big_number ec_digest_to_int(const unsigned char* dgst, size_t dgst_len,
+                                   ec_hash_type hash, big_number n)
+{
+    big_number e = NULL;
+
+    if (EC_HASH_LEGACY != hash)
+    {
+        return rfc6979_bits2int(dgst, dgst_len, mpi_get_nbits(n));
+    }
+    if (GPG_ERR_NO_ERROR != gcry_mpi_scan(&e,
+                GCRYMPI_FMT_USG, dgst, dgst_len, NULL))
+    {
+        return NULL;
+    }
+    mpi_mod(e, e, n);
+    return e;
+}
+
+/*
+ * ec_digest_check
+ * Checks that the digest given by the caller is the one of the hash
+ */
+static status ec_digest_check(const unsigned char* dgst, size_t dgst_len, ec_hash_type hash)
+{
+    CHECK_PARAM(dgst);
+
+    if (!ec_hash_size(hash))
+    {
+        ERROR_LOG("Invalid hash type %d\n", (int) hash);
+        return BAD_PARAMS;
+    }
+    if (ec_hash_size(hash) != dgst_len)
+    {
+        ERROR_LOG("Digest size %u doesn't match %s hash\n", (unsigned int) dgst_len,
+                  ec_hash_name(hash));
+        return BAD_PARAMS;
+    }
+    return SUCCESS;
+}
+
+status ec_sign_digest(EC_private_key_t* priv_key, EC_signature_t* sign,
+                      const unsigned char* dgst, size_t dgst_len,
+                      ec_hash_type hash)
+{
+    status stat = SUCCESS;
+    big_number e, kinv;
+    rfc6979_t drbg;
+    rfc6979_t* drbg_ptr = NULL;
+    GFp_params_t* params;
+
+    CHECK_PARAM(priv_key);
+    CHECK_PARAM(sign);
+    if ((stat = ec_digest_check(dgst, dgst_len, hash)) != SUCCESS)
+    {
+        return stat;
+    }
+    params = &priv_key->pub.c.params;
+
+    sign->r = mpi_new(0);
+    sign->s = mpi_new(0);
+
+    e = ec_digest_to_int(dgst, dgst_len, hash, params->n);
+    if (!e)
+    {
+        ERROR_LOG("Generate signature failed\n");
+        return FAIL;
+    }
+
+    if (EC_NONCE_RFC6979 == nonce_type)
+    {
+        if (rfc6979_init(&drbg, ec_hash_hmac_algo(hash), priv_key->priv, params->n,
+                         dgst, dgst_len) != SUCCESS)
+        {
+            ERROR_LOG("Init deterministic nonce generator failed\n");
+            mpi_release(e);
             return FAIL;
         }
+        drbg_ptr = &drbg;
+    }
+
+    kinv = mpi_new(0);
+    do
+    {
         /*
-         * Make sure e < n
+         * Get 1/k and r
          */
-        mpi_mod(e, e, priv_key->pub.c.params.n);
+        stat = ec_nonce_pair(params, drbg_ptr, kinv, sign->r);
+        if (SUCCESS != stat)
+        {
+            break;
+        }
         /*
          * s = (e + (r * private_key)) * 1/k
          */
-        mpi_mulm(sign->s, priv_key->priv, sign->r, priv_key->pub.c.params.n);
-        mpi_addm(sign->s, sign->s, e, priv_key->pub.c.params.n);
-        mpi_invm(e, k, priv_key->pub.c.params.n);
-        mpi_mulm(sign->s, sign->s, e, priv_key->pub.c.params.n);
+        mpi_mulm(sign->s, priv_key->priv, sign->r, params->n);
+        mpi_addm(sign->s, sign->s, e, params->n);
+        mpi_mulm(sign->s, sign->s, kinv, params->n);
         /*
          * if s != 0 then pair of unmbers
          * s and r are the valid signature
          */
-        if (mpi_cmp_ui(sign->s, 0) == 0)
-        {
-            gen_s_ok = 0;
-            mpi_release(k);
-            mpi_release(e);
-        }
     }
-    while (!gen_s_ok);
+    while (mpi_cmp_ui(sign->s, 0) == 0);
 
-    mpi_release(k);
+    mpi_release(kinv);
     mpi_release(e);
-    gcry_md_close(hash);
     return stat;
 }
 
-
 /* TODO: add comments in the algorithm code
- * ec_verify_signature()
+ * ec_verify_digest()
  * The algorithm is as follows:
  * 1. Verify that r and s are integers in [1,n - 1]. If not, the signature is invalid.
  * 2. Calculate e = HASH(m), where HASH is the same function used in the signature generation.
@@ -191,74 +572,60 @@ status ec_generate_signature(EC_private_key_t* priv_key, EC_signature_t* sign, v
  * 4. Calculate u1 = ew(mod n) and u2 = rw(mod n).
  * 5. Calculate (x1,y1) = u1 * G + u2 * QA.
  * The signature is valid if r = x1(mod n), invalid otherwise.
+ * Step 2 is done by the caller, the digest is passed in.
  */
-status ec_verify_signature(EC_public_key_t* public_key, EC_signature_t* sign, void* data, size_t size)
+status ec_verify_digest(EC_public_key_t* public_key, EC_signature_t* sign,
+                        const unsigned char* dgst, size_t dgst_len,
+                        ec_hash_type hash)
 {
     status stat = SUCCESS;
+
     CHECK_PARAM(public_key);
     CHECK_PARAM(sign);
-    CHECK_PARAM(data);
+    if ((stat = ec_digest_check(dgst, dgst_len, hash)) != SUCCESS)
+    {
+        return stat;
+    }
 
     /*
      * Check point 1:
      * 1. Verify that r and s are integers in [1,n - 1]. If not, the signature is invalid.
      */
-
-    if (mpi_cmp(sign->r, public_key->c.params.n) > 0)
+    if ((mpi_cmp_ui(sign->r, 0) <= 0) ||
+            (! (mpi_cmp(sign->r, public_key->c.params.n) < 0)))
     {
-        LOG("Signature not valid - R is not in range from 0 to n-1\n");
-        stat = FAIL;
+        LOG("Signature not valid - R is not in range from 1 to n-1\n");
+        stat = SIGNATURE_INVALID;
     }
     if ((stat == SUCCESS) &&
-            (! (mpi_cmp(sign->s, public_key->c.params.n) < 0)))
+            ((mpi_cmp_ui(sign->s, 0) <= 0) ||
+             (! (mpi_cmp(sign->s, public_key->c.params.n) < 0))))
     {
-        LOG("Signature not valid - S is not in range from 0 to n-1\n");
-        stat = FAIL;
+        LOG("Signature not valid - S is not in range from 1 to n-1\n");
+        stat = SIGNATURE_INVALID;
     }
 
     if (SUCCESS == stat)
     {
-        char* dgst = NULL;
-        gcry_md_hd_t hash;
         big_number w, e, u1, u2;
+        EC_point_t u1G, u2QA;
 
-        EC_point_t u1G, u2QA, P;
-
-        w  = mpi_new(0);
-        u1 = mpi_new(0);
-        u2 = mpi_new(0);
-        ec_point_init(&P);
-
-        if (gcry_md_open(&hash, GCRY_MD_SHA512, 0) != GPG_ERR_NO_ERROR)
-        {
-            ERROR_LOG("Init hash function failed\n");
-            mpi_release(w);
-            mpi_release(u1);
-            mpi_release(u2);
-            ec_point_free(&P);
-            return FAIL;
-        }
-        gcry_md_write (hash, data, size);
-        gcry_md_final(hash);
-        dgst = (char*) gcry_md_read(hash, 0);
-        if (GPG_ERR_NO_ERROR != gcry_mpi_scan(&e,
-                    GCRYMPI_FMT_USG, dgst, SHA512_LEN, NULL))
+        e = ec_digest_to_int(dgst, dgst_len, hash, public_key->c.params.n);
+        if (!e)
         {
             ERROR_LOG("Read hash failed\n");
-            gcry_md_close(hash);
-            mpi_release(w);
-            mpi_release(u1);
-            mpi_release(u2);
-            ec_point_free(&P);
             return FAIL;
         }
-        mpi_mod(e, e, public_key->c.params.n);
+        w  = mpi_new(0);
+        u1 = mpi_new(0);
+        u2 = mpi_new(0);
+
         mpi_invm(w, sign->s, public_key->c.params.n);
         mpi_mulm(u1, e, w, public_key->c.params.n);
         mpi_mulm(u2, sign->r, w, public_key->c.params.n);
 
-        u1G = ec_point_multiply(&public_key->c.params.G, u1, &public_key->c.params );
-        u2QA = ec_point_multiply(&public_key->Q, u2, &public_key->c.params );
+        u1G = ec_base_point_multiply(&public_key->c.params, u1);
+        u2QA = ec_public_key_multiply(public_key, u2);
         ec_point_add_affine(&u1G, &u1G, &u2QA, &public_key->c.params);
 
         if (mpi_cmp(sign->r, u1G.x) == 0)
@@ -270,18 +637,322 @@ status ec_verify_signature(EC_public_key_t* public_key, EC_signature_t* sign, vo
             ERROR_LOG("Signature is NOT valid\n");
             stat = SIGNATURE_INVALID;
         }
-        gcry_md_close(hash);
         mpi_release(w);
         mpi_release(e);
         mpi_release(u1);
         mpi_release(u2);
         ec_point_free(&u1G);
         ec_point_free(&u2QA);
-        ec_point_free(&P);
     }
     return stat;
 }
 
+/*
+ * ec_sign_ctx_digest
+ * Finalizes the context hash and returns the digest.
+ * The digest is valid until the context is closed
+ */
+static const unsigned char* ec_sign_ctx_digest(EC_sign_ctx_t* ctx)
+{
+    if (ctx->blake3)
+    {
+        blake3_hasher_finalize(ctx->blake3, ctx->digest, BLAKE3_OUT_LEN);
+        return ctx->digest;
+    }
+    gcry_md_final(ctx->hash);
+    return gcry_md_read(ctx->hash, 0);
+}
+
+/*
+ * ec_sign_ctx_init
+ * Common part of sign and verify init
+ */
+static status ec_sign_ctx_init(EC_sign_ctx_t* ctx, ec_hash_type hash)
+{
+    if (!ec_hash_size(hash))
+    {
+        ERROR_LOG("Invalid hash type %d\n", (int) hash);
+        return BAD_PARAMS;
+    }
+    ctx->hash_type = hash;
+    ctx->hash = NULL;
+    ctx->blake3 = NULL;
+    if (EC_HASH_BLAKE3 == hash)
+    {
+        ctx->blake3 = malloc(sizeof(blake3_hasher_t));
+        if (!ctx->blake3)
+        {
+            ERROR_LOG("Can't allocate memory\n");
+            return FAIL;
+        }
+        blake3_hasher_init(ctx->blake3);
+        return SUCCESS;
+    }
+    if (gcry_md_open(&ctx->hash, ec_hash_md_algo(hash), 0) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hash function failed\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+status ec_sign_init(EC_sign_ctx_t* ctx, EC_private_key_t* priv_key, ec_hash_type hash)
+{
+    CHECK_PARAM(ctx);
+    CHECK_PARAM(priv_key);
+
+    ctx->priv_key = priv_key;
+    ctx->pub_key = &priv_key->pub;
+    return ec_sign_ctx_init(ctx, hash);
+}
+
+status ec_sign_update(EC_sign_ctx_t* ctx, const void* data, size_t size)
+{
+    CHECK_PARAM(ctx);
+
+    if (size)
+    {
+        CHECK_PARAM(data);
+        if (ctx->blake3)
+            blake3_hasher_update(ctx->blake3, data, size);
+        else
+            gcry_md_write(ctx->hash, data, size);
+    }
+    return SUCCESS;
+}
+
+status ec_sign_final(EC_sign_ctx_t* ctx, EC_signature_t* sign)
+{
+    status stat;
+    CHECK_PARAM(ctx);
+    CHECK_PARAM(sign);
+
+    stat = ec_sign_digest(ctx->priv_key, sign, ec_sign_ctx_digest(ctx),
+                          ec_hash_size(ctx->hash_type), ctx->hash_type);
+    ec_sign_ctx_release(ctx);
+    return stat;
+}
+
+status ec_verify_init(EC_sign_ctx_t* ctx, EC_public_key_t* public_key, ec_hash_type hash)
+{
+    CHECK_PARAM(ctx);
+    CHECK_PARAM(public_key);
+
+    ctx->priv_key = NULL;
+    ctx->pub_key = public_key;
+    return ec_sign_ctx_init(ctx, hash);
+}
+
+status ec_verify_update(EC_sign_ctx_t* ctx, const void* data, size_t size)
+{
+    return ec_sign_update(ctx, data, size);
+}
+
+status ec_verify_final(EC_sign_ctx_t* ctx, EC_signature_t* sign)
+{
+    status stat;
+    CHECK_PARAM(ctx);
+    CHECK_PARAM(sign);
+
+    stat = ec_verify_digest(ctx->pub_key, sign, ec_sign_ctx_digest(ctx),
+                            ec_hash_size(ctx->hash_type), ctx->hash_type);
+    ec_sign_ctx_release(ctx);
+    return stat;
+}
+
+status ec_tagged_digest(ec_hash_type hash, const char* tag, unsigned long long param,
+                        const void* data, size_t size, unsigned char* dgst)
+{
+    status stat;
+    EC_sign_ctx_t ctx;
+    unsigned char prefix[9];
+    const unsigned char* md;
+    unsigned int i, len;
+
+    CHECK_PARAM(tag);
+    CHECK_PARAM(dgst);
+
+    if ((stat = ec_sign_ctx_init(&ctx, hash)) != SUCCESS)
+        return stat;
+    /*
+     * tag with its NUL, hash id and param as 8 bytes big endian
+     */
+    prefix[0] = (unsigned char) hash;
+    for (i = 0; i < 8; i++)
+        prefix[1 + i] = (unsigned char) (param >> (56 - 8 * i));
+    ec_sign_update(&ctx, tag, strlen(tag) + 1);
+    ec_sign_update(&ctx, prefix, sizeof(prefix));
+    stat = ec_sign_update(&ctx, data, size);
+    if (SUCCESS == stat)
+    {
+        /*
+         * Inverted, so that it is not H(m) of any message m and the
+         * signature can't be passed off as a plain one of a file
+         * holding the tagged bytes
+         */
+        md = ec_sign_ctx_digest(&ctx);
+        len = ec_hash_size(hash);
+        for (i = 0; i < len; i++)
+            dgst[i] = (unsigned char) ~md[i];
+    }
+    ec_sign_ctx_release(&ctx);
+    return stat;
+}
+
+void ec_sign_ctx_release(EC_sign_ctx_t* ctx)
+{
+    CHECK_PARAM(ctx);
+    if (ctx->hash)
+    {
+        gcry_md_close(ctx->hash);
+        ctx->hash = NULL;
+    }
+    FREE(ctx->blake3);
+}
+
+status ec_generate_signature(EC_private_key_t* priv_key, EC_signature_t* sign, void* data, size_t size)
+{
+    status stat;
+    EC_sign_ctx_t ctx;
+
+    CHECK_PARAM(data);
+
+    stat = ec_sign_init(&ctx, priv_key, EC_HASH_LEGACY);
+    if (SUCCESS == stat)
+    {
+        ec_sign_update(&ctx, data, size);
+        stat = ec_sign_final(&ctx, sign);
+    }
+    return stat;
+}
+
+status ec_verify_signature(EC_public_key_t* public_key, EC_signature_t* sign, void* data, size_t size)
+{
+    status stat;
+    EC_sign_ctx_t ctx;
+
+    CHECK_PARAM(data);
+
+    stat = ec_verify_init(&ctx, public_key, EC_HASH_LEGACY);
+    if (SUCCESS == stat)
+    {
+        ec_verify_update(&ctx, data, size);
+        stat = ec_verify_final(&ctx, sign);
+    }
+    return stat;
+}
+
+/*
+ * ec_batch_digests
+ * Hashes all the messages of a batch in one go. The caller frees the digests
+ */
+static unsigned char* ec_batch_digests(ec_hash_type hash, const void* const* msgs,
+                                       const size_t* lens, unsigned int count)
+{
+    int md_algo = ec_hash_md_algo(hash);
+    unsigned char* dgsts;
+    unsigned int i;
+
+    if (!ec_hash_size(hash))
+    {
+        ERROR_LOG("Invalid hash type %d\n", (int) hash);
+        return NULL;
+    }
+    dgsts = malloc((size_t) count * ec_hash_size(hash) + 1);
+    if (!dgsts)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        return NULL;
+    }
+    if (!md_algo)
+    {
+        /*
+         * BLAKE3 already hashes the chunks of a message side by side
+         */
+        for (i = 0; i < count; i++)
+            blake3_hash(msgs[i], lens[i], dgsts + (size_t) i * BLAKE3_OUT_LEN);
+        return dgsts;
+    }
+    if (mb_hash(md_algo, msgs, lens, count, dgsts) != SUCCESS)
+    {
+        FREE(dgsts);
+        return NULL;
+    }
+    return dgsts;
+}
+
+status ec_sign_batch(EC_private_key_t* priv_key, ec_hash_type hash,
+                     const void* const* msgs, const size_t* lens,
+                     unsigned int count, EC_signature_t* signs)
+{
+    status stat = SUCCESS;
+    unsigned char* dgsts;
+    size_t dlen;
+    unsigned int i;
+
+    CHECK_PARAM(priv_key);
+    CHECK_PARAM(signs);
+
+    dgsts = ec_batch_digests(hash, msgs, lens, count);
+    if (!dgsts)
+    {
+        return FAIL;
+    }
+    dlen = ec_hash_size(hash);
+    for (i = 0; i < count; i++)
+    {
+        stat = ec_sign_digest(priv_key, &signs[i], dgsts + i * dlen, dlen, hash);
+        if (SUCCESS != stat)
+        {
+            /*
+             * Leave no half done batch behind
+             */
+            while (1)
+            {
+                ec_release_signature(&signs[i]);
+                if (!i--)
+                {
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    FREE(dgsts);
+    return stat;
+}
+
+status ec_verify_batch(EC_public_key_t* public_key, ec_hash_type hash,
+                       const void* const* msgs, const size_t* lens,
+                       unsigned int count, EC_signature_t* signs, status* results)
+{
+    status stat = SUCCESS;
+    unsigned char* dgsts;
+    size_t dlen;
+    unsigned int i;
+
+    CHECK_PARAM(public_key);
+    CHECK_PARAM(signs);
+    CHECK_PARAM(results);
+
+    dgsts = ec_batch_digests(hash, msgs, lens, count);
+    if (!dgsts)
+    {
+        return FAIL;
+    }
+    dlen = ec_hash_size(hash);
+    for (i = 0; i < count; i++)
+    {
+        results[i] = ec_verify_digest(public_key, &signs[i], dgsts + i * dlen, dlen, hash);
+        if ((SUCCESS != results[i]) && (FAIL != stat))
+        {
+            stat = results[i];
+        }
+    }
+    FREE(dgsts);
+    return stat;
+}
+
 void ec_release_signature(EC_signature_t* signature)
 {
     CHECK_PARAM(signature);
@@ -294,6 +965,7 @@ void ec_release_signature(EC_signature_t* signature)
  * ec_sym_key_derive - KDF (Key Derivation Function)
  */
 #define BUFFER_SIZE (3 * MAX_BIG_NUM_SIZE)
+#define EC_KDF_BLAKE3_CONTEXT "Small Privacy Guard 2026-10 ECIES k1 k2"
 static status ec_sym_key_derive(EC_enc_key_t* enc_key, big_number Zx)
 {
     status stat = SUCCESS;
@@ -338,7 +1010,23 @@ static status ec_sym_key_derive(EC_enc_key_t* enc_key, big_number Zx)
         ERROR_LOG("Filed to export data");
         stat = FAIL;
     }
-    if (SUCCESS == stat)
+    if ((SUCCESS == stat) && (EC_KDF_BLAKE3 == kdf_type))
+    {
+        blake3_hasher_t kdf;
+
+        enc_key->k1 = malloc(SHA512_LEN);
+        if (!enc_key->k1)
+        {
+            ERROR_LOG("Can't allocate memory\n");
+            return FAIL;
+        }
+        blake3_hasher_init_derive_key(&kdf, EC_KDF_BLAKE3_CONTEXT);
+        blake3_hasher_update(&kdf, buff, space);
+        blake3_hasher_finalize(&kdf, (unsigned char*) enc_key->k1, SHA512_LEN);
+        enc_key->k2 = enc_key->k1 + (SHA512_LEN / 2);
+        enc_key->key_size = SHA512_LEN / 2;
+    }
+    else if (SUCCESS == stat)
     {
         gcry_md_hd_t hash;
         char* dgst = NULL;
@@ -377,9 +1065,7 @@ status ec_generate_enc_key(EC_enc_key_t* enc_key, EC_public_key_t* public_key)
         /*
          * Generate random k
          */
-        k = mpi_new(0);
-        gcry_mpi_randomize (k, mpi_get_nbits(public_key->c.params.n),
-                                 GCRY_STRONG_RANDOM);
+        k = rng_random_mpi(mpi_get_nbits(public_key->c.params.n));
         /*
          * Make sure k < n
          */
@@ -388,11 +1074,11 @@ status ec_generate_enc_key(EC_enc_key_t* enc_key, EC_public_key_t* public_key)
         /*
          * enc_key.R = k * G
          */
-        enc_key->R = ec_point_multiply(&public_key->c.params.G, k, &public_key->c.params);
+        enc_key->R = ec_base_point_multiply(&public_key->c.params, k);
 
         mpi_mul_ui(k, k, public_key->c.params.h);
 
-        Z = ec_point_multiply(&public_key->Q, k, &public_key->c.params);
+        Z = ec_public_key_multiply(public_key, k);
         /*
          * if Z == 0 the generate k again
          */
@@ -64,6 +64,11 @@ struct domain_GFp_params_s
      * cofactor h = #E(Fp)/n
      */
     unsigned int h;
+    /*
+     * Optional fixed-base table for G.
+     * NULL if not precomputed
+     */
+    EC_point_table_t *G_table;
 };
 
 typedef struct curve_over_GFp_s
@@ -91,6 +96,11 @@ typedef struct EC_public_key_s
 {
     EC_point_t Q;
     curve c;
+    /*
+     * Optional fixed-base table for Q.
+     * NULL if not precomputed
+     */
+    EC_point_table_t *Q_table;
 } EC_public_key_t;
 
 /*
@@ -111,6 +121,38 @@ typedef struct EC_signature_s
     big_number s;
 } EC_signature_t;
 
+/*
+ * Message digest used for signatures.
+ * EC_HASH_LEGACY is SHA-512 reduced mod n, the way signatures were made
+ * before the digest could be chosen. The others are truncated to the
+ * bit length of n as SEC 1 says. EC_HASH_BLAKE3 is not in gcrypt,
+ * see blake3.h
+ */
+typedef enum
+{
+    EC_HASH_LEGACY = 0,
+    EC_HASH_SHA256,
+    EC_HASH_SHA384,
+    EC_HASH_SHA512,
+    EC_HASH_BLAKE2B,
+    EC_HASH_BLAKE3,
+    EC_HASH_TERM
+} ec_hash_type;
+
+/*
+ * Streaming sign / verify context
+ */
+#define EC_MAX_DIGEST_LEN 64
+typedef struct EC_sign_ctx_s
+{
+    gcry_md_hd_t hash;
+    struct blake3_hasher_s* blake3; /* instead of hash for EC_HASH_BLAKE3 */
+    unsigned char digest[EC_MAX_DIGEST_LEN];
+    ec_hash_type hash_type;
+    EC_private_key_t* priv_key; /* NULL when verifying */
+    EC_public_key_t* pub_key;
+} EC_sign_ctx_t;
+
 /*
  * Encryption key structure
  */
@@ -122,6 +164,26 @@ typedef struct EC_enc_key_s
     size_t key_size;
 } EC_enc_key_t;
 
+/*
+ * How the per-signature nonce k is generated
+ */
+typedef enum
+{
+    EC_NONCE_RFC6979 = 0, /* deterministic k from private key and digest - default */
+    EC_NONCE_RANDOM       /* random k from per thread DRBG */
+} ec_nonce_type;
+extern ec_nonce_type nonce_type;
+
+/*
+ * How the symmetric keys are derived from the ECDH shared secret
+ */
+typedef enum
+{
+    EC_KDF_SHA512 = 0,  /* SHA-512 of R.x || R.y || Z.x - default */
+    EC_KDF_BLAKE3       /* BLAKE3 in key derivation mode over the same input */
+} ec_kdf_type;
+extern ec_kdf_type kdf_type;
+
 /*
  * Function: ec_generate_key()
  * Generates pair of keys - public and private over a curve
@@ -146,18 +208,144 @@ void ec_release_key(EC_private_key_t* priv_key);
  */
 void ec_release_public_key(EC_public_key_t* pub_key);
 
+/*
+ * Function: ec_public_key_precompute()
+ * Builds fixed-base table for the public key point Q. Once it is
+ * done ec_verify_signature and ec_generate_enc_key use the table
+ */
+status ec_public_key_precompute(EC_public_key_t* pub_key);
+
 /*
  * Function: ec_generate_signature()
- * Generates signature using ECDSA algorithm
+ * Generates signature using ECDSA algorithm with EC_HASH_LEGACY digest
  */
 status ec_generate_signature(EC_private_key_t* priv_key, EC_signature_t* sign, void* data, size_t size);
 
 /*
  * Function: ec_verify_signature()
- * Verifies signature using ECDSA algorithm
+ * Verifies signature using ECDSA algorithm with EC_HASH_LEGACY digest
  */
 status ec_verify_signature(EC_public_key_t* public_key, EC_signature_t* sign, void* data, size_t size);
 
+/*
+ * Function: ec_hash_md_algo()
+ * Returns gcrypt hash algorithm of the signature digest,
+ * 0 if invalid or not a gcrypt one
+ */
+int ec_hash_md_algo(ec_hash_type hash);
+
+/*
+ * Function: ec_hash_size()
+ * Returns size of the signature digest in bytes, 0 if invalid
+ */
+unsigned int ec_hash_size(ec_hash_type hash);
+
+/*
+ * Function: ec_hash_name()
+ * Returns name of the signature digest as used on the command line
+ * and in signature files
+ */
+const char* ec_hash_name(ec_hash_type hash);
+
+/*
+ * Function: ec_hash_by_name()
+ * Looks the signature digest up by its name
+ */
+status ec_hash_by_name(const char* name, ec_hash_type* hash);
+
+/*
+ * Function: ec_sign_init()
+ * Starts signature over a message passed in pieces to ec_sign_update().
+ * The message is hashed with hash. RFC 6979 nonces use the same hash
+ */
+status ec_sign_init(EC_sign_ctx_t* ctx, EC_private_key_t* priv_key, ec_hash_type hash);
+
+/*
+ * Function: ec_sign_update()
+ * Hashes next part of the message
+ */
+status ec_sign_update(EC_sign_ctx_t* ctx, const void* data, size_t size);
+
+/*
+ * Function: ec_sign_final()
+ * Generates signature over all the data passed to ec_sign_update()
+ * and releases the context
+ */
+status ec_sign_final(EC_sign_ctx_t* ctx, EC_signature_t* sign);
+
+/*
+ * Function: ec_verify_init()
+ * Starts verification of a message passed in pieces to ec_verify_update()
+ */
+status ec_verify_init(EC_sign_ctx_t* ctx, EC_public_key_t* public_key, ec_hash_type hash);
+
+/*
+ * Function: ec_verify_update()
+ * Hashes next part of the message
+ */
+status ec_verify_update(EC_sign_ctx_t* ctx, const void* data, size_t size);
+
+/*
+ * Function: ec_verify_final()
+ * Verifies signature over all the data passed to ec_verify_update()
+ * and releases the context
+ */
+status ec_verify_final(EC_sign_ctx_t* ctx, EC_signature_t* sign);
+
+/*
+ * Function: ec_sign_ctx_release()
+ * Releases sign or verify context that was not finalized
+ */
+void ec_sign_ctx_release(EC_sign_ctx_t* ctx);
+
+/*
+ * Function: ec_sign_digest()
+ * Generates signature over message digest computed by the caller with
+ * hash, e.g. content hash from a storage layer. With EC_HASH_LEGACY
+ * it is SHA-512 of the message. dgst_len must be the size of the digest
+ */
+status ec_sign_digest(EC_private_key_t* priv_key, EC_signature_t* sign,
+                      const unsigned char* dgst, size_t dgst_len,
+                      ec_hash_type hash);
+
+/*
+ * Function: ec_verify_digest()
+ * Verifies signature over message digest computed by the caller
+ */
+status ec_verify_digest(EC_public_key_t* public_key, EC_signature_t* sign,
+                        const unsigned char* dgst, size_t dgst_len,
+                        ec_hash_type hash);
+
+/*
+ * Function: ec_tagged_digest()
+ * Computes the digest to pass to ec_sign_digest() for a value that
+ * stands for a message, e.g. a tree root. It is the inverted
+ * hash(tag || hash || param || data), so a signature over it is bound
+ * to the tag and param and never verifies as a plain signature.
+ * dgst must hold ec_hash_size(hash) bytes
+ */
+status ec_tagged_digest(ec_hash_type hash, const char* tag, unsigned long long param,
+                        const void* data, size_t size, unsigned char* dgst);
+
+/*
+ * Function: ec_sign_batch()
+ * Signs count independent messages. The messages are hashed together,
+ * several at a time, see mb_hash(). Signature of msgs[i] goes to signs[i]
+ */
+status ec_sign_batch(EC_private_key_t* priv_key, ec_hash_type hash,
+                     const void* const* msgs, const size_t* lens,
+                     unsigned int count, EC_signature_t* signs);
+
+/*
+ * Function: ec_verify_batch()
+ * Verifies signs[i] over msgs[i] for count messages. Result of each
+ * one is stored in results[i]. Returns SUCCESS if all the signatures
+ * are valid, SIGNATURE_INVALID if any is not
+ */
+status ec_verify_batch(EC_public_key_t* public_key, ec_hash_type hash,
+                       const void* const* msgs, const size_t* lens,
+                       unsigned int count, EC_signature_t* signs, status* results);
+
 /*
  * Function: ec_release_signature()
  * Releases signature
@@ -0,0 +1,1229 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "defs.h"
+#include "sym_cipher.h"
+#include "thread_pool.h"
+#include "io_engine.h"
+#include "enc_segment.h"
+
+static void put_be32(unsigned char* p, uint32_t v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static uint32_t get_be32(const unsigned char* p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ * Nonce of the record - prefix | index | epoch
+ */
+static void enc_segment_nonce(const enc_segment_params_t* p, uint64_t index,
+                              uint32_t epoch, unsigned char* nonce)
+{
+    memcpy(nonce, p->nonce_prefix, ENC_NONCE_PREFIX_SIZE);
+    put_be32(nonce + ENC_NONCE_PREFIX_SIZE, (uint32_t) index);
+    put_be32(nonce + ENC_NONCE_PREFIX_SIZE + 4, epoch);
+}
+
+/*
+ * Starts the record - the associated data is the file header
+ * followed by the record header
+ */
+static status enc_segment_start(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                                int enc, uint64_t index, const unsigned char* record)
+{
+    unsigned char aad[ENC_HEADER_MAX_SIZE + ENC_RECORD_HEADER_SIZE];
+    unsigned char nonce[SYM_CIPHER_IV_SIZE];
+    uint32_t epoch = get_be32(record + 4);
+
+    if (index > ENC_MAX_RECORDS)
+    {
+        ERROR_LOG("Too many records in encrypted file\n");
+        return FAIL;
+    }
+    enc_segment_nonce(p, index, epoch, nonce);
+    memcpy(aad, p->header, p->header_len);
+    memcpy(aad + p->header_len, record, ENC_RECORD_HEADER_SIZE);
+    return sym_cipher_start(cipher, enc, nonce, sizeof(nonce), aad,
+                            p->header_len + ENC_RECORD_HEADER_SIZE);
+}
+
+/*
+ *
+ */
+status enc_segment_params_init(enc_segment_params_t* p, const unsigned char* header,
+                               size_t header_len, const void* k2, unsigned int shift)
+{
+    CHECK_PARAM(p);
+    CHECK_PARAM(header);
+    CHECK_PARAM(k2);
+
+    if ((header_len > ENC_HEADER_MAX_SIZE) || (shift < ENC_SEGMENT_SHIFT_MIN) ||
+        (shift > ENC_SEGMENT_SHIFT_MAX))
+    {
+        return BAD_PARAMS;
+    }
+    memcpy(p->header, header, header_len);
+    p->header_len = header_len;
+    memcpy(p->nonce_prefix, k2, ENC_NONCE_PREFIX_SIZE);
+    p->segment_size = (size_t) 1 << shift;
+    return SUCCESS;
+}
+
+/*
+ *
+ */
+size_t enc_segment_record_size(size_t len)
+{
+    return ENC_RECORD_HEADER_SIZE + len + SYM_CIPHER_TAG_SIZE;
+}
+
+/*
+ *
+ */
+uint64_t enc_segment_offset(const enc_segment_params_t* p, uint64_t index)
+{
+    return p->header_len + index * enc_segment_record_size(p->segment_size);
+}
+
+/*
+ *
+ */
+status enc_segment_seal(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                        uint64_t index, uint32_t epoch, int final,
+                        const void* plain, size_t len, unsigned char* record)
+{
+    status stat;
+
+    if ((len > p->segment_size) || (!final && (len != p->segment_size)))
+        return BAD_PARAMS;
+
+    put_be32(record, (uint32_t) len | (final ? ENC_RECORD_FINAL : 0));
+    put_be32(record + 4, epoch);
+    if ((stat = enc_segment_start(p, cipher, 1, index, record)) != SUCCESS)
+        return stat;
+    if (len && ((stat = sym_cipher_encrypt(cipher, (void*) plain,
+                                           record + ENC_RECORD_HEADER_SIZE, len)) != SUCCESS))
+    {
+        return stat;
+    }
+    return sym_cipher_final(cipher, record + ENC_RECORD_HEADER_SIZE + len,
+                            SYM_CIPHER_TAG_SIZE);
+}
+
+/*
+ *
+ */
+status enc_segment_parse(const enc_segment_params_t* p, const unsigned char* record,
+                         size_t* len, int* final, uint32_t* epoch)
+{
+    uint32_t word = get_be32(record);
+
+    *final = (word & ENC_RECORD_FINAL) != 0;
+    *len = word & ~ENC_RECORD_FINAL;
+    if (epoch)
+        *epoch = get_be32(record + 4);
+    if ((*len > p->segment_size) || (!*final && (*len != p->segment_size)))
+    {
+        ERROR_LOG("The encrypted file is corrupted\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ *
+ */
+status enc_segment_open(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                        uint64_t index, const unsigned char* record,
+                        unsigned char* plain, size_t* len, int* final)
+{
+    status stat;
+
+    if ((stat = enc_segment_parse(p, record, len, final, NULL)) != SUCCESS)
+        return stat;
+    if ((stat = enc_segment_start(p, cipher, 0, index, record)) != SUCCESS)
+        return stat;
+    if (*len && ((stat = sym_cipher_decrypt(cipher, (void*) (record + ENC_RECORD_HEADER_SIZE),
+                                            plain, *len)) != SUCCESS))
+    {
+        return stat;
+    }
+    return sym_cipher_final(cipher, (void*) (record + ENC_RECORD_HEADER_SIZE + *len),
+                            SYM_CIPHER_TAG_SIZE);
+}
+
+/*
+ * State of a batch in the ring - the reader fills it, the workers
+ * seal or open it and the writer empties it
+ */
+typedef enum enc_slot_state_e
+{
+    ENC_SLOT_EMPTY,
+    ENC_SLOT_FILLED,
+    ENC_SLOT_DONE
+} enc_slot_state;
+
+/*
+ * Segments sealed or opened by the workers in one go.
+ * Segment i is at plain + i * segment_size and its record
+ * at records + i * record_size, only the last may be shorter
+ */
+typedef struct enc_batch_s
+{
+    const enc_segment_params_t *p;
+    sym_cipher_hdl_t **ciphers;     /* one per worker */
+    unsigned int slot;
+    int enc;
+    enc_slot_state state;
+    uint64_t first;
+    unsigned int count;
+    unsigned int next;
+    int last_final;
+    size_t last_len;
+    uint32_t epoch;
+    unsigned char *plain;
+    unsigned char *records;
+    size_t record_size;
+    status *stat;
+} enc_batch_t;
+
+/*
+ * Pipeline of a stream. The reader, the workers and the writer
+ * each work on a different batch of the ring at the same time
+ */
+typedef struct enc_pipe_s
+{
+    const enc_segment_params_t *p;
+    int in;
+    int out;
+    int64_t in_off;                 /* -1 for streams */
+    int64_t out_off;
+    io_engine_t *reader_io;
+    io_engine_t *writer_io;
+    thread_pool_t *pool;
+    unsigned int threads;
+    sym_cipher_hdl_t **ciphers;
+    unsigned int segments;          /* per batch */
+    enc_batch_t ring[ENC_RING_SLOTS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    status stat;                    /* first failure of any stage */
+    /*
+     * Appending - the records start at index first and are sealed
+     * with epoch, the carried plain text comes before the input
+     */
+    uint64_t first;
+    uint32_t epoch;
+    const unsigned char *carry;
+    size_t carry_len;
+} enc_pipe_t;
+
+static void enc_batch_task(void *arg)
+{
+    enc_batch_t *b = (enc_batch_t*) arg;
+    sym_cipher_hdl_t *cipher = b->ciphers[__atomic_fetch_add(&b->slot, 1, __ATOMIC_RELAXED)];
+    unsigned int i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+    {
+        unsigned char *plain = b->plain + (size_t) i * b->p->segment_size;
+        unsigned char *record = b->records + (size_t) i * b->record_size;
+        int last = (i == b->count - 1);
+
+        if (b->enc)
+        {
+            b->stat[i] = enc_segment_seal(b->p, cipher, b->first + i, b->epoch,
+                                          last && b->last_final, plain,
+                                          last ? b->last_len : b->p->segment_size, record);
+        }
+        else
+        {
+            size_t len;
+            int final;
+
+            b->stat[i] = enc_segment_open(b->p, cipher, b->first + i, record,
+                                          plain, &len, &final);
+        }
+    }
+}
+
+static void* enc_alloc(size_t size)
+{
+    void *mem = NULL;
+
+    if (posix_memalign(&mem, ENC_BUFFER_ALIGN, size))
+        return NULL;
+    return mem;
+}
+
+static void enc_pipe_release(enc_pipe_t *pipe)
+{
+    unsigned int i;
+
+    if (pipe->pool)
+        thread_pool_destroy(pipe->pool);
+    for (i = 0; pipe->ciphers && (i < pipe->threads); i++)
+    {
+        if (pipe->ciphers[i])
+            sym_cipher_close(pipe->ciphers[i]);
+    }
+    FREE(pipe->ciphers);
+    io_engine_destroy(pipe->reader_io);
+    io_engine_destroy(pipe->writer_io);
+    for (i = 0; i < ENC_RING_SLOTS; i++)
+    {
+        FREE(pipe->ring[i].plain);
+        FREE(pipe->ring[i].records);
+        FREE(pipe->ring[i].stat);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->changed);
+}
+
+static status enc_pipe_init(enc_pipe_t *pipe, const enc_segment_params_t *p, int enc,
+                            sym_cipher cipher, void *key, size_t key_size,
+                            int in, int out, unsigned int threads)
+{
+    struct iovec plain[ENC_RING_SLOTS], records[ENC_RING_SLOTS];
+    unsigned int i;
+
+    memset(pipe, 0, sizeof(*pipe));
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+    pipe->p = p;
+    pipe->in = in;
+    pipe->out = out;
+    pipe->in_off = lseek(in, 0, SEEK_CUR);
+    pipe->out_off = lseek(out, 0, SEEK_CUR);
+    pipe->stat = SUCCESS;
+    if (!threads)
+        threads = thread_pool_cpus();
+    /*
+     * Falls back to the calling thread if the pool can't be started
+     */
+    if ((threads > 1) && (thread_pool_create(&pipe->pool, threads) != SUCCESS))
+    {
+        pipe->pool = NULL;
+        threads = 1;
+    }
+    pipe->threads = threads;
+    pipe->segments = threads * ENC_BATCH_SEGMENTS;
+    if (pipe->segments < ENC_BATCH_MIN_SEGMENTS)
+        pipe->segments = ENC_BATCH_MIN_SEGMENTS;
+    pipe->ciphers = calloc(threads, sizeof(sym_cipher_hdl_t*));
+    if (!pipe->ciphers)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        enc_pipe_release(pipe);
+        return FAIL;
+    }
+    for (i = 0; i < ENC_RING_SLOTS; i++)
+    {
+        enc_batch_t *b = &pipe->ring[i];
+
+        b->p = p;
+        b->enc = enc;
+        b->ciphers = pipe->ciphers;
+        b->state = ENC_SLOT_EMPTY;
+        b->record_size = enc_segment_record_size(p->segment_size);
+        b->plain = enc_alloc((size_t) pipe->segments * p->segment_size);
+        b->records = enc_alloc((size_t) pipe->segments * b->record_size);
+        b->stat = calloc(pipe->segments, sizeof(status));
+        if (!b->plain || !b->records || !b->stat)
+        {
+            ERROR_LOG("Memory allocation failed\n");
+            enc_pipe_release(pipe);
+            return FAIL;
+        }
+        plain[i].iov_base = b->plain;
+        plain[i].iov_len = (size_t) pipe->segments * p->segment_size;
+        records[i].iov_base = b->records;
+        records[i].iov_len = (size_t) pipe->segments * b->record_size;
+    }
+    /*
+     * The reader and the writer have an engine each, with the buffers
+     * they transfer registered. O_DIRECT is for the plain text side,
+     * where the transfers are aligned
+     */
+    if ((io_engine_create(&pipe->reader_io) != SUCCESS) ||
+        (io_engine_create(&pipe->writer_io) != SUCCESS))
+    {
+        enc_pipe_release(pipe);
+        return FAIL;
+    }
+    io_engine_register(pipe->reader_io, enc ? plain : records, ENC_RING_SLOTS);
+    io_engine_register(pipe->writer_io, enc ? records : plain, ENC_RING_SLOTS);
+    /* O_DIRECT on a pipe means packet mode, only files bypass the cache */
+    if (io_engine_config.direct && ((enc ? pipe->in_off : pipe->out_off) >= 0))
+        io_engine_direct(enc ? in : out);
+    LOG("Using %s I/O\n", io_engine_name(pipe->reader_io));
+    for (i = 0; i < threads; i++)
+    {
+        if (sym_cipher_init(&pipe->ciphers[i], cipher, key, key_size) != SUCCESS)
+        {
+            ERROR_LOG("Failed initialise symmectic cipher\n");
+            pipe->ciphers[i] = NULL;
+            enc_pipe_release(pipe);
+            return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Waits till the batch gets to the state. Returns 0 if
+ * another stage failed in the meantime
+ */
+static int enc_pipe_wait(enc_pipe_t *pipe, enc_batch_t *b, enc_slot_state state)
+{
+    int ok;
+
+    pthread_mutex_lock(&pipe->lock);
+    while ((b->state != state) && (SUCCESS == pipe->stat))
+    {
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    ok = (SUCCESS == pipe->stat);
+    pthread_mutex_unlock(&pipe->lock);
+    return ok;
+}
+
+/*
+ * Hands the batch over to the next stage, or stops them all
+ */
+static void enc_pipe_set(enc_pipe_t *pipe, enc_batch_t *b, enc_slot_state state, status stat)
+{
+    pthread_mutex_lock(&pipe->lock);
+    b->state = state;
+    if ((SUCCESS != stat) && (SUCCESS == pipe->stat))
+        pipe->stat = stat;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/*
+ * Reads the next batch of plain text. The last full segment of the
+ * previous batch was kept back, it comes first. The first batch
+ * starts with the carried plain text instead
+ */
+static status enc_pipe_read_plain(enc_pipe_t *pipe, enc_batch_t *b, enc_batch_t *prev)
+{
+    const enc_segment_params_t *p = pipe->p;
+    size_t capacity = (size_t) pipe->segments * p->segment_size;
+    size_t have = 0, got;
+
+    b->first = pipe->first;
+    b->epoch = pipe->epoch;
+    if (prev)
+    {
+        memcpy(b->plain, prev->plain + (size_t) prev->count * p->segment_size, p->segment_size);
+        have = p->segment_size;
+        b->first = prev->first + prev->count;
+    }
+    else if (pipe->carry_len)
+    {
+        memcpy(b->plain, pipe->carry, pipe->carry_len);
+        have = pipe->carry_len;
+    }
+    if (io_engine_read(pipe->reader_io, pipe->in, b->plain + have, capacity - have,
+                       pipe->in_off, &got) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read file to encrypt\n");
+        return FAIL;
+    }
+    have += got;
+    if (pipe->in_off >= 0)
+        pipe->in_off += got;
+    if (have < capacity)
+    {
+        /*
+         * End of the input - the last segment is the final one
+         */
+        b->count = have ? (unsigned int) ((have + p->segment_size - 1) / p->segment_size) : 1;
+        b->last_len = have - (size_t) (b->count - 1) * p->segment_size;
+        b->last_final = 1;
+    }
+    else
+    {
+        /*
+         * The last segment is kept back, it may turn out to be the final one
+         */
+        b->count = pipe->segments - 1;
+        b->last_len = p->segment_size;
+        b->last_final = 0;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Reads the next batch of records and finds where they are,
+ * only the final one may be short
+ */
+static status enc_pipe_read_records(enc_pipe_t *pipe, enc_batch_t *b, enc_batch_t *prev)
+{
+    const enc_segment_params_t *p = pipe->p;
+    size_t capacity = (size_t) pipe->segments * b->record_size;
+    size_t have, pos = 0, len;
+    unsigned char extra;
+    int final = 0;
+    status stat;
+
+    b->first = prev ? prev->first + prev->count : 0;
+    if (io_engine_read(pipe->reader_io, pipe->in, b->records, capacity,
+                       pipe->in_off, &have) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read encrypted file\n");
+        return FAIL;
+    }
+    if (pipe->in_off >= 0)
+        pipe->in_off += have;
+    for (b->count = 0; (pos < have) && !final; b->count++)
+    {
+        if (have - pos < ENC_RECORD_HEADER_SIZE)
+            break;
+        if ((stat = enc_segment_parse(p, b->records + pos, &len, &final, NULL)) != SUCCESS)
+            return stat;
+        if (have - pos < enc_segment_record_size(len))
+        {
+            final = 0;
+            break;
+        }
+        b->last_len = len;
+        pos += enc_segment_record_size(len);
+    }
+    if (!final && (have < capacity))
+    {
+        ERROR_LOG("The encrypted file is truncated\n");
+        return FAIL;
+    }
+    if (final && ((pos != have) ||
+                  (io_engine_read(pipe->reader_io, pipe->in, &extra, 1, pipe->in_off, &len) != SUCCESS) ||
+                  len))
+    {
+        ERROR_LOG("The encrypted file has data after the final segment\n");
+        return FAIL;
+    }
+    b->last_final = final;
+    return SUCCESS;
+}
+
+static status enc_pipe_read(enc_pipe_t *pipe, enc_batch_t *b, enc_batch_t *prev)
+{
+    return b->enc ? enc_pipe_read_plain(pipe, b, prev) : enc_pipe_read_records(pipe, b, prev);
+}
+
+/*
+ * Runs the batch on the workers and returns the status of
+ * the first segment that failed
+ */
+static status enc_pipe_crypt(enc_pipe_t *pipe, enc_batch_t *b)
+{
+    unsigned int i, tasks = pipe->threads;
+
+    b->slot = 0;
+    b->next = 0;
+    if (tasks > b->count)
+        tasks = b->count;
+    if (pipe->pool)
+    {
+        for (i = 0; i < tasks; i++)
+        {
+            if (thread_pool_submit(pipe->pool, enc_batch_task, b) != SUCCESS)
+                break;
+        }
+        thread_pool_wait(pipe->pool);
+        /*
+         * Picks up whatever is left if a task could not be submitted
+         */
+        if (b->next < b->count)
+        {
+            b->slot = 0;
+            enc_batch_task(b);
+        }
+    }
+    else
+    {
+        enc_batch_task(b);
+    }
+    for (i = 0; i < b->count; i++)
+    {
+        if (b->stat[i] != SUCCESS)
+        {
+            if (DECRYPTION_FAILED == b->stat[i])
+            {
+                INFO_LOG("File decryption failed. Segment %llu is not genuine\n",
+                         (unsigned long long) (b->first + i));
+            }
+            return b->stat[i];
+        }
+    }
+    return SUCCESS;
+}
+
+static status enc_pipe_write(enc_pipe_t *pipe, enc_batch_t *b)
+{
+    size_t len;
+
+    if (b->enc)
+    {
+        len = (size_t) (b->count - 1) * b->record_size + enc_segment_record_size(b->last_len);
+        if (io_engine_write(pipe->writer_io, pipe->out, b->records, len, pipe->out_off) != SUCCESS)
+        {
+            ERROR_LOG("Failed to write encrypted file\n");
+            return FAIL;
+        }
+    }
+    else
+    {
+        len = (size_t) (b->count - 1) * pipe->p->segment_size + b->last_len;
+        if (io_engine_write(pipe->writer_io, pipe->out, b->plain, len, pipe->out_off) != SUCCESS)
+        {
+            ERROR_LOG("Failed to write decrypted file\n");
+            return FAIL;
+        }
+    }
+    if (pipe->out_off >= 0)
+        pipe->out_off += len;
+    return SUCCESS;
+}
+
+/*
+ * Reader stage
+ */
+static void* enc_pipe_reader(void *arg)
+{
+    enc_pipe_t *pipe = (enc_pipe_t*) arg;
+    enc_batch_t *b, *prev = NULL;
+    unsigned int n;
+    status stat;
+    int last;
+
+    for (n = 0; ; n++)
+    {
+        b = &pipe->ring[n % ENC_RING_SLOTS];
+        if (!enc_pipe_wait(pipe, b, ENC_SLOT_EMPTY))
+            break;
+        stat = enc_pipe_read(pipe, b, prev);
+        last = b->last_final;
+        enc_pipe_set(pipe, b, ENC_SLOT_FILLED, stat);
+        if ((SUCCESS != stat) || last)
+            break;
+        prev = b;
+    }
+    return NULL;
+}
+
+/*
+ * Writer stage
+ */
+static void* enc_pipe_writer(void *arg)
+{
+    enc_pipe_t *pipe = (enc_pipe_t*) arg;
+    enc_batch_t *b;
+    unsigned int n;
+    status stat;
+    int last;
+
+    for (n = 0; ; n++)
+    {
+        b = &pipe->ring[n % ENC_RING_SLOTS];
+        if (!enc_pipe_wait(pipe, b, ENC_SLOT_DONE))
+            break;
+        stat = enc_pipe_write(pipe, b);
+        /*
+         * The batch may be reused as soon as it is handed over
+         */
+        last = b->last_final;
+        enc_pipe_set(pipe, b, ENC_SLOT_EMPTY, stat);
+        if ((SUCCESS != stat) || last)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Runs the stages. The reader and the writer get a thread each, the
+ * workers are driven from the calling thread. If the threads can't be
+ * started the stages run one after another
+ */
+static status enc_pipe_run(enc_pipe_t *pipe)
+{
+    pthread_t reader, writer;
+    enc_batch_t *b, *prev = NULL;
+    unsigned int n;
+    status stat;
+    int last;
+
+    if (pthread_create(&reader, NULL, enc_pipe_reader, pipe))
+    {
+        for (n = 0; ; n++)
+        {
+            b = &pipe->ring[n % ENC_RING_SLOTS];
+            if (((stat = enc_pipe_read(pipe, b, prev)) != SUCCESS) ||
+                ((stat = enc_pipe_crypt(pipe, b)) != SUCCESS) ||
+                ((stat = enc_pipe_write(pipe, b)) != SUCCESS))
+            {
+                return stat;
+            }
+            if (b->last_final)
+                return SUCCESS;
+            prev = b;
+        }
+    }
+    if (pthread_create(&writer, NULL, enc_pipe_writer, pipe))
+    {
+        enc_pipe_set(pipe, &pipe->ring[0], ENC_SLOT_EMPTY, FAIL);
+        pthread_join(reader, NULL);
+        ERROR_LOG("Failed to start writer thread\n");
+        return FAIL;
+    }
+    for (n = 0; ; n++)
+    {
+        b = &pipe->ring[n % ENC_RING_SLOTS];
+        if (!enc_pipe_wait(pipe, b, ENC_SLOT_FILLED))
+            break;
+        stat = enc_pipe_crypt(pipe, b);
+        last = b->last_final;
+        enc_pipe_set(pipe, b, ENC_SLOT_DONE, stat);
+        if ((SUCCESS != stat) || last)
+            break;
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    return pipe->stat;
+}
+
+static status enc_segment_stream(const enc_segment_params_t* p, int enc, sym_cipher cipher,
+                                 void* key, size_t key_size, int in, int out,
+                                 unsigned int threads)
+{
+    enc_pipe_t pipe;
+    status stat;
+
+    CHECK_PARAM(p);
+
+    if ((stat = enc_pipe_init(&pipe, p, enc, cipher, key, key_size, in, out, threads)) != SUCCESS)
+        return stat;
+    stat = enc_pipe_run(&pipe);
+    /*
+     * Leaves the descriptors where the stream ended, like read and write would
+     */
+    if (pipe.in_off >= 0)
+        lseek(in, pipe.in_off, SEEK_SET);
+    if (pipe.out_off >= 0)
+        lseek(out, pipe.out_off, SEEK_SET);
+    enc_pipe_release(&pipe);
+    return stat;
+}
+
+/*
+ *
+ */
+status enc_segment_encrypt_stream(const enc_segment_params_t* p, sym_cipher cipher,
+                                  void* key, size_t key_size, int in, int out,
+                                  unsigned int threads)
+{
+    return enc_segment_stream(p, 1, cipher, key, key_size, in, out, threads);
+}
+
+/*
+ *
+ */
+status enc_segment_decrypt_stream(const enc_segment_params_t* p, sym_cipher cipher,
+                                  void* key, size_t key_size, int in, int out,
+                                  unsigned int threads)
+{
+    return enc_segment_stream(p, 0, cipher, key, key_size, in, out, threads);
+}
+
+/*
+ * Checks the record read at index against where it is in the file,
+ * only the last one may be shorter and has to be the final one
+ */
+static status enc_range_check(const enc_segment_params_t* p, const unsigned char* record,
+                              size_t size, int last)
+{
+    size_t len;
+    int final;
+    status stat;
+
+    if (size < ENC_RECORD_HEADER_SIZE)
+    {
+        ERROR_LOG("The encrypted file is truncated\n");
+        return FAIL;
+    }
+    if ((stat = enc_segment_parse(p, record, &len, &final, NULL)) != SUCCESS)
+        return stat;
+    if (final && !last)
+    {
+        ERROR_LOG("The encrypted file has data after the final segment\n");
+        return FAIL;
+    }
+    if ((last && !final) || (enc_segment_record_size(len) != size))
+    {
+        ERROR_LOG("The encrypted file is truncated\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ *
+ */
+status enc_segment_decrypt_range(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                                 int in, int out, uint64_t offset, uint64_t length)
+{
+    size_t record_size, len, got;
+    uint64_t first, stop, last, end, i, n;
+    unsigned char *records = NULL, *plain = NULL;
+    io_engine_t *io = NULL;
+    int64_t out_off;
+    struct stat st;
+    status stat = SUCCESS;
+
+    CHECK_PARAM(p);
+    CHECK_PARAM(cipher);
+
+    if (fstat(in, &st) || !S_ISREG(st.st_mode))
+    {
+        ERROR_LOG("Only a regular file can be decrypted in part\n");
+        return BAD_PARAMS;
+    }
+    record_size = enc_segment_record_size(p->segment_size);
+    if ((uint64_t) st.st_size < p->header_len + enc_segment_record_size(0))
+    {
+        ERROR_LOG("The encrypted file is truncated\n");
+        return FAIL;
+    }
+    if (!length)
+        return SUCCESS;
+    /*
+     * The last record is found from the size of the file. It is only
+     * opened if the range gets to it, which is what tells where the
+     * plain text ends
+     */
+    last = (st.st_size - p->header_len - 1) / record_size;
+    end = (offset > UINT64_MAX - length) ? UINT64_MAX : offset + length;
+    first = offset / p->segment_size;
+    stop = (end - 1) / p->segment_size;
+    if (first > last)
+        first = last;
+    if (stop > last)
+        stop = last;
+    LOG("Decrypting segments %llu - %llu of %llu\n", (unsigned long long) first,
+        (unsigned long long) stop, (unsigned long long) last + 1);
+
+    records = enc_alloc((size_t) ENC_BATCH_MIN_SEGMENTS * record_size);
+    plain = enc_alloc(p->segment_size);
+    if (!records || !plain || (io_engine_create(&io) != SUCCESS))
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        stat = FAIL;
+    }
+    out_off = lseek(out, 0, SEEK_CUR);
+    for (i = first; (SUCCESS == stat) && (i <= stop); i += n)
+    {
+        size_t want;
+        uint64_t j;
+
+        n = stop - i + 1;
+        if (n > ENC_BATCH_MIN_SEGMENTS)
+            n = ENC_BATCH_MIN_SEGMENTS;
+        want = (i + n - 1 == last) ? (size_t) (st.st_size - enc_segment_offset(p, i)) :
+                                     (size_t) n * record_size;
+        if (io_engine_read(io, in, records, want, enc_segment_offset(p, i), &got) != SUCCESS)
+        {
+            ERROR_LOG("Failed to read encrypted file\n");
+            stat = FAIL;
+            break;
+        }
+        if (got != want)
+        {
+            ERROR_LOG("The encrypted file is truncated\n");
+            stat = FAIL;
+            break;
+        }
+        for (j = 0; j < n; j++)
+        {
+            unsigned char *record = records + (size_t) j * record_size;
+            uint64_t start = (i + j) * p->segment_size, from, to;
+            int final;
+
+            if ((stat = enc_range_check(p, record, (i + j == last) ? want - (size_t) j * record_size :
+                                        record_size, i + j == last)) != SUCCESS)
+            {
+                break;
+            }
+            if ((stat = enc_segment_open(p, cipher, i + j, record, plain, &len, &final)) != SUCCESS)
+            {
+                if (DECRYPTION_FAILED == stat)
+                    ERROR_LOG("Segment %llu is not genuine\n", (unsigned long long) (i + j));
+                break;
+            }
+            /*
+             * Only the part of the segment inside the range goes out
+             */
+            from = (offset > start) ? offset - start : 0;
+            to = (end - start < len) ? end - start : len;
+            if (from >= to)
+                continue;
+            if (io_engine_write(io, out, plain + from, to - from, out_off) != SUCCESS)
+            {
+                ERROR_LOG("Failed to write decrypted file\n");
+                stat = FAIL;
+                break;
+            }
+            if (out_off >= 0)
+                out_off += to - from;
+        }
+    }
+    if (out_off >= 0)
+        lseek(out, out_off, SEEK_SET);
+    io_engine_destroy(io);
+    FREE(records);
+    FREE(plain);
+    return stat;
+}
+
+/*
+ * Opens the final record of the file, index last and size bytes.
+ * It has to be genuine, its plain text is carried over to the front
+ * of the appended data
+ */
+static status enc_append_final(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                               uint64_t last, size_t size, unsigned char* record,
+                               unsigned char* plain, size_t* len, uint32_t* epoch)
+{
+    status stat;
+    int final;
+
+    if (((stat = enc_range_check(p, record, size, 1)) != SUCCESS) ||
+        ((stat = enc_segment_parse(p, record, len, &final, epoch)) != SUCCESS))
+    {
+        return stat;
+    }
+    if ((stat = enc_segment_open(p, cipher, last, record, plain, len, &final)) != SUCCESS)
+    {
+        if (DECRYPTION_FAILED == stat)
+            ERROR_LOG("Segment %llu is not genuine\n", (unsigned long long) last);
+        return stat;
+    }
+    if (*epoch >= UINT32_MAX - 1)
+    {
+        ERROR_LOG("The encrypted file can't be appended to any more\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Makes a new or removed name in the directory of file_name durable
+ */
+static status enc_sync_dir(const char* file_name)
+{
+    char dir[MAX_FILE_NAME_SIZE];
+    char *slash;
+    status stat = SUCCESS;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s", file_name);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+    fd = open(dir, O_RDONLY);
+    if ((fd < 0) || fsync(fd))
+    {
+        ERROR_LOG("Failed to sync directory %s\n", dir);
+        stat = FAIL;
+    }
+    if (fd >= 0)
+        close(fd);
+    return stat;
+}
+
+/*
+ * Append journal.
+ *   0 u64 size of the file before the append, big endian
+ *   8 final record of the file before the append
+ * It is written under a temporary name and renamed, so it is there
+ * whole or not at all, before the file is changed. It is removed once
+ * the appended records are on the disk
+ */
+static status enc_journal_write(const char* journal, uint64_t file_size,
+                                const unsigned char* record, size_t size)
+{
+    char tmp_name[MAX_FILE_NAME_SIZE + 16];
+    unsigned char head[8];
+    status stat = SUCCESS;
+    int fd;
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", journal, (int) getpid());
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        ERROR_LOG("Can not create file %s.\n", tmp_name);
+        return FAIL;
+    }
+    put_be32(head, (uint32_t) (file_size >> 32));
+    put_be32(head + 4, (uint32_t) file_size);
+    if ((write(fd, head, sizeof(head)) != (ssize_t) sizeof(head)) ||
+            (write(fd, record, size) != (ssize_t) size) || fsync(fd))
+    {
+        ERROR_LOG("Failed to write append journal to %s file\n", tmp_name);
+        stat = FAIL;
+    }
+    if (close(fd))
+        stat = FAIL;
+    if ((SUCCESS == stat) && rename(tmp_name, journal))
+    {
+        ERROR_LOG("Can not create file %s.\n", journal);
+        stat = FAIL;
+    }
+    if (SUCCESS != stat)
+        remove(tmp_name);
+    else
+        stat = enc_sync_dir(journal);
+    return stat;
+}
+
+static status enc_journal_remove(const char* journal)
+{
+    if (unlink(journal))
+    {
+        ERROR_LOG("Failed to remove append journal %s\n", journal);
+        return FAIL;
+    }
+    return enc_sync_dir(journal);
+}
+
+/*
+ * Puts the final record back where it was, sealed again with an epoch
+ * above the one of the append, which may have got to the disk, and
+ * cuts the file back to its size before the append
+ */
+static status enc_append_undo(const enc_segment_params_t* p, sym_cipher_hdl_t* session,
+                              int out, uint64_t last, uint32_t epoch, uint64_t file_size,
+                              const unsigned char* plain, size_t len, unsigned char* record)
+{
+    uint64_t offset = enc_segment_offset(p, last);
+    size_t size = (size_t) (file_size - offset);
+
+    if ((enc_segment_seal(p, session, last, epoch, 1, plain, len, record) != SUCCESS) ||
+            (pwrite(out, record, size, offset) != (ssize_t) size) ||
+            ftruncate(out, file_size) || fsync(out))
+    {
+        ERROR_LOG("Failed to restore the encrypted file\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Finishes an append that was interrupted, if journal is there, by
+ * putting the file back as it was before it
+ */
+static status enc_journal_recover(const enc_segment_params_t* p, sym_cipher_hdl_t* session,
+                                  const char* journal, int out, unsigned char* record,
+                                  unsigned char* plain)
+{
+    size_t record_size = enc_segment_record_size(p->segment_size);
+    unsigned char head[8], more;
+    uint64_t file_size = 0, last;
+    ssize_t size = -1;
+    uint32_t epoch;
+    size_t len;
+    status stat;
+    int fd;
+
+    fd = open(journal, O_RDONLY);
+    if ((fd < 0) && (ENOENT == errno))
+        return SUCCESS;
+    if ((fd >= 0) && (read(fd, head, sizeof(head)) == (ssize_t) sizeof(head)))
+    {
+        size = read(fd, record, record_size);
+        if ((size >= 0) && (read(fd, &more, 1) != 0))
+            size = -1;
+        file_size = ((uint64_t) get_be32(head) << 32) | get_be32(head + 4);
+    }
+    if (fd >= 0)
+        close(fd);
+    if ((size < 0) || (file_size < p->header_len + enc_segment_record_size(0)))
+    {
+        ERROR_LOG("The append journal %s is corrupted\n", journal);
+        return FAIL;
+    }
+    last = (file_size - p->header_len - 1) / record_size;
+    if ((uint64_t) size != file_size - enc_segment_offset(p, last))
+    {
+        ERROR_LOG("The append journal %s is corrupted\n", journal);
+        return FAIL;
+    }
+    INFO_LOG("Restoring the encrypted file from interrupted append\n");
+    if (((stat = enc_append_final(p, session, last, (size_t) size, record, plain,
+                                  &len, &epoch)) != SUCCESS) ||
+        ((stat = enc_append_undo(p, session, out, last, epoch + 2, file_size,
+                                 plain, len, record)) != SUCCESS))
+    {
+        return stat;
+    }
+    return enc_journal_remove(journal);
+}
+
+/*
+ * Seals everything from in after the final record of out. The final
+ * record and the ones after it get the next epoch, so no nonce is
+ * used twice. The old final record goes to the journal first, so an
+ * append that fails or is interrupted can be undone
+ */
+static status enc_append_run(const enc_segment_params_t* p, sym_cipher_hdl_t* session,
+                             sym_cipher cipher, void* key, size_t key_size, int in, int out,
+                             const char* journal, unsigned int threads, uint64_t file_size,
+                             unsigned char* record, unsigned char* plain)
+{
+    size_t record_size = enc_segment_record_size(p->segment_size);
+    uint64_t last = (file_size - p->header_len - 1) / record_size;
+    uint64_t offset = enc_segment_offset(p, last);
+    size_t size = (size_t) (file_size - offset);
+    enc_pipe_t pipe;
+    uint32_t epoch;
+    size_t len;
+    status stat;
+
+    if (pread(out, record, size, offset) != (ssize_t) size)
+    {
+        ERROR_LOG("Failed to read encrypted file\n");
+        return FAIL;
+    }
+    if (((stat = enc_append_final(p, session, last, size, record, plain,
+                                  &len, &epoch)) != SUCCESS) ||
+        ((stat = enc_journal_write(journal, file_size, record, size)) != SUCCESS))
+    {
+        return stat;
+    }
+    LOG("Appending from segment %llu with %lu bytes, epoch %u\n",
+        (unsigned long long) last, (unsigned long) len, epoch + 1);
+    if (lseek(out, offset, SEEK_SET) < 0)
+    {
+        ERROR_LOG("Failed to write encrypted file\n");
+        stat = FAIL;
+    }
+    if ((SUCCESS == stat) &&
+        ((stat = enc_pipe_init(&pipe, p, 1, cipher, key, key_size, in, out, threads)) == SUCCESS))
+    {
+        pipe.first = last;
+        pipe.epoch = epoch + 1;
+        pipe.carry = plain;
+        pipe.carry_len = len;
+        stat = enc_pipe_run(&pipe);
+        if (pipe.in_off >= 0)
+            lseek(in, pipe.in_off, SEEK_SET);
+        enc_pipe_release(&pipe);
+    }
+    if ((SUCCESS == stat) && fsync(out))
+    {
+        ERROR_LOG("Failed to write encrypted file\n");
+        stat = FAIL;
+    }
+    if (SUCCESS == stat)
+        return enc_journal_remove(journal);
+    /*
+     * The journal stays if the file can't be put back,
+     * the next append tries again
+     */
+    if (enc_append_undo(p, session, out, last, epoch + 2, file_size,
+                        plain, len, record) == SUCCESS)
+    {
+        enc_journal_remove(journal);
+    }
+    return stat;
+}
+
+/*
+ *
+ */
+status enc_segment_append(const enc_segment_params_t* p, sym_cipher cipher,
+                          void* key, size_t key_size, int in, int out,
+                          const char* journal, unsigned int threads)
+{
+    unsigned char *record, *plain;
+    sym_cipher_hdl_t *session = NULL;
+    struct stat st;
+    status stat;
+
+    CHECK_PARAM(p);
+    CHECK_PARAM(journal);
+
+    if (fstat(out, &st) || !S_ISREG(st.st_mode))
+    {
+        ERROR_LOG("Only a regular file can be appended to\n");
+        return BAD_PARAMS;
+    }
+    record = enc_alloc(enc_segment_record_size(p->segment_size));
+    plain = enc_alloc(p->segment_size);
+    if (!record || !plain)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        stat = FAIL;
+    }
+    else if ((stat = sym_cipher_init(&session, cipher, key, key_size)) == SUCCESS)
+    {
+        stat = enc_journal_recover(p, session, journal, out, record, plain);
+        if ((SUCCESS == stat) && fstat(out, &st))
+            stat = FAIL;
+        /*
+         * The final record is the last one, found from the size of the file
+         */
+        if ((SUCCESS == stat) &&
+                ((uint64_t) st.st_size < p->header_len + enc_segment_record_size(0)))
+        {
+            ERROR_LOG("The encrypted file is truncated\n");
+            stat = FAIL;
+        }
+        if (SUCCESS == stat)
+        {
+            stat = enc_append_run(p, session, cipher, key, key_size, in, out, journal,
+                                  threads, (uint64_t) st.st_size, record, plain);
+        }
+        sym_cipher_close(session);
+    }
+    FREE(record);
+    FREE(plain);
+    return stat;
+}
@@ -0,0 +1,160 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_ENC_SEGMENT_H_
+#define _SPG_ENC_SEGMENT_H_
+
+/*
+ * Segmented encrypted file, format version 3.
+ *
+ *  +--------+----------+----------+-----+--------------+
+ *  | header | record 0 | record 1 | ... | final record |
+ *  +--------+----------+----------+-----+--------------+
+ *
+ * The plain text is cut into segments of 2^shift bytes, each sealed on
+ * its own into a record:
+ *
+ *  +---------------+-------+------------+-----+
+ *  | length, final | epoch | ciphertext | tag |
+ *  +---------------+-------+------------+-----+
+ *
+ * Only the last record has the final bit set and it may be shorter,
+ * even empty, so every record starts at a known offset. The nonce is
+ * a prefix taken from k2, the record index and the epoch, so records
+ * can't be reordered. The associated data is the file header and the
+ * record header, so the length, final bit and epoch can't be changed
+ * and the file can't be cut at a record boundary either. The epoch
+ * goes up when the final record is written again with more data
+ * appended, so the same nonce is never used twice.
+ */
+#define ENC_RECORD_HEADER_SIZE 8
+#define ENC_RECORD_FINAL 0x80000000u
+#define ENC_NONCE_PREFIX_SIZE 4
+#define ENC_SEGMENT_SHIFT_MIN 12
+#define ENC_SEGMENT_SHIFT_MAX 24
+#define ENC_SEGMENT_SHIFT 16     /* 64K segments by default */
+#define ENC_MAX_RECORDS 0xffffffffULL
+#define ENC_BATCH_SEGMENTS 8     /* per worker thread */
+#define ENC_BATCH_MIN_SEGMENTS 32
+#define ENC_RING_SLOTS 4         /* batches read, sealed and written at once */
+#define ENC_BUFFER_ALIGN 4096
+
+/*
+ * Everything the records of one file share
+ */
+typedef struct enc_segment_params_s
+{
+    unsigned char header[ENC_HEADER_MAX_SIZE];
+    size_t header_len;
+    unsigned char nonce_prefix[ENC_NONCE_PREFIX_SIZE];
+    size_t segment_size;
+} enc_segment_params_t;
+
+/*
+ * Function: enc_segment_params_init
+ * Sets up the parameters from the file header, the MAC key k2
+ * and the segment size shift
+ */
+status enc_segment_params_init(enc_segment_params_t* p, const unsigned char* header,
+                               size_t header_len, const void* k2, unsigned int shift);
+
+/*
+ * Function: enc_segment_record_size
+ * Size of the record sealing len bytes
+ */
+size_t enc_segment_record_size(size_t len);
+
+/*
+ * Function: enc_segment_offset
+ * File offset of the record index
+ */
+uint64_t enc_segment_offset(const enc_segment_params_t* p, uint64_t index);
+
+/*
+ * Function: enc_segment_seal
+ * Encrypts len bytes of plain text into record, which has to have
+ * enc_segment_record_size(len) bytes
+ */
+status enc_segment_seal(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                        uint64_t index, uint32_t epoch, int final,
+                        const void* plain, size_t len, unsigned char* record);
+
+/*
+ * Function: enc_segment_parse
+ * Reads the record header. Fails for lengths that can't be right -
+ * longer than a segment, or shorter for a record that is not final
+ */
+status enc_segment_parse(const enc_segment_params_t* p, const unsigned char* record,
+                         size_t* len, int* final, uint32_t* epoch);
+
+/*
+ * Function: enc_segment_open
+ * Decrypts and authenticates the whole record into plain, which has
+ * to have room for the segment. DECRYPTION_FAILED if it is not genuine
+ */
+status enc_segment_open(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                        uint64_t index, const unsigned char* record,
+                        unsigned char* plain, size_t* len, int* final);
+
+/*
+ * Function: enc_segment_encrypt_stream
+ * Encrypts everything from in into records written to out, sealing
+ * the segments on threads workers, each with its own cipher session.
+ * The records come out in order. If threads is 0 one per online CPU.
+ * Reading, sealing and writing overlap on a ring of batches. The
+ * descriptors are read and written from their current positions
+ * with the engine set in io_engine_config
+ */
+status enc_segment_encrypt_stream(const enc_segment_params_t* p, sym_cipher cipher,
+                                  void* key, size_t key_size, int in, int out,
+                                  unsigned int threads);
+
+/*
+ * Function: enc_segment_decrypt_stream
+ * Decrypts the records from in up to the final one, opening them on
+ * threads workers. Only authenticated segments are written to out,
+ * in order. DECRYPTION_FAILED if a segment is not genuine
+ */
+status enc_segment_decrypt_stream(const enc_segment_params_t* p, sym_cipher cipher,
+                                  void* key, size_t key_size, int in, int out,
+                                  unsigned int threads);
+
+/*
+ * Function: enc_segment_decrypt_range
+ * Decrypts length bytes of plain text starting at offset. Only the
+ * records covering the range are read and authenticated, so the cost
+ * does not depend on the size of the file. in has to be a regular file.
+ * The range is cut at the end of the plain text
+ */
+status enc_segment_decrypt_range(const enc_segment_params_t* p, sym_cipher_hdl_t* cipher,
+                                 int in, int out, uint64_t offset, uint64_t length);
+
+/*
+ * Function: enc_segment_append
+ * Encrypts everything from in onto the end of the segmented file out,
+ * which has to be a regular file open for reading and writing. Only
+ * the final record is read and sealed again, so the cost depends on
+ * the appended data, not on the file. The old final record is kept in
+ * the journal file until the appended records are on the disk. If the
+ * append fails out is put back from it; if it is interrupted, the next
+ * append to out puts it back first
+ */
+status enc_segment_append(const enc_segment_params_t* p, sym_cipher cipher,
+                          void* key, size_t key_size, int in, int out,
+                          const char* journal, unsigned int threads);
+
+#endif /* _SPG_ENC_SEGMENT_H_ */
@@ -0,0 +1,180 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "file_io.h"
+
+/*
+ * Hand the mapping out in chunk sized pieces
+ */
+static status file_io_mapped(const unsigned char *data, size_t size,
+                             size_t chunk, file_io_cb cb, void *ctx)
+{
+    status stat = SUCCESS;
+    size_t off = 0;
+
+    while ((off < size) && (SUCCESS == stat))
+    {
+        size_t len = size - off;
+
+        if (len > chunk)
+            len = chunk;
+        stat = cb(ctx, data + off, len);
+        off += len;
+    }
+    return stat;
+}
+
+/*
+ * Fallback for pipes and anything that can not be mapped.
+ * Fill the buffer up so the callback gets full chunks
+ * no matter how the data arrives
+ */
+static status file_io_read(int fd, size_t chunk, file_io_cb cb, void *ctx)
+{
+    status stat = SUCCESS;
+    unsigned char *buff;
+    size_t len = 0;
+    int eof = 0;
+
+    buff = malloc(chunk);
+    if (!buff)
+    {
+        ERROR_LOG("Memory allocation failed to allocate %lu bytes \n",
+                  (unsigned long) chunk);
+        return FAIL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while ((SUCCESS == stat) && !eof)
+    {
+        ssize_t ret = read(fd, buff + len, chunk - len);
+
+        if (ret < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERROR_LOG("Failed to read input file\n");
+            stat = FAIL;
+            break;
+        }
+        if (0 == ret)
+            eof = 1;
+        else
+            len += (size_t) ret;
+
+        if ((len == chunk) || (eof && len))
+        {
+            stat = cb(ctx, buff, len);
+            len = 0;
+        }
+    }
+    free(buff);
+    return stat;
+}
+
+status file_io_map_fd(int fd, file_io_map_t *m)
+{
+    struct stat st;
+    off_t pos;
+    void *map;
+
+    CHECK_PARAM(m);
+
+    pos = lseek(fd, 0, SEEK_CUR);
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) ||
+            (pos < 0) || (pos >= st.st_size))
+    {
+        return FAIL;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        LOG("Can not map the input file\n");
+        return FAIL;
+    }
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+    m->map = map;
+    m->map_len = (size_t) st.st_size;
+    m->data = (unsigned char *) map + pos;
+    m->size = (size_t) (st.st_size - pos);
+    return SUCCESS;
+}
+
+void file_io_unmap(file_io_map_t *m)
+{
+    if (m && m->map)
+    {
+        munmap(m->map, m->map_len);
+        m->map = NULL;
+        m->data = NULL;
+    }
+}
+
+status file_io_process_fd(int fd, size_t chunk, file_io_cb cb, void *ctx)
+{
+    status stat = SUCCESS;
+    file_io_map_t m;
+
+    CHECK_PARAM(cb);
+
+    if (0 == chunk)
+    {
+        ERROR_LOG("Invalid chunk size\n");
+        return BAD_PARAMS;
+    }
+    if (file_io_map_fd(fd, &m) == SUCCESS)
+    {
+        stat = file_io_mapped(m.data, m.size, chunk, cb, ctx);
+        file_io_unmap(&m);
+        return stat;
+    }
+    /*
+     * Pipes, devices and empty files end up here. Some of the files,
+     * like the ones in /proc, only look empty, so read() is the only
+     * way to tell
+     */
+    return file_io_read(fd, chunk, cb, ctx);
+}
+
+status file_io_process(const char *file_name, size_t chunk,
+                       file_io_cb cb, void *ctx)
+{
+    status stat;
+    int fd;
+
+    CHECK_PARAM(file_name);
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        ERROR_LOG("Can not open file %s\n", file_name);
+        return FAIL;
+    }
+    stat = file_io_process_fd(fd, chunk, cb, ctx);
+    close(fd);
+    return stat;
+}
@@ -0,0 +1,74 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_FILE_IO_H_
+#define _SPG_FILE_IO_H_
+
+/*
+ * Input path shared by sign, verify and encrypt.
+ * Regular files are mapped into memory with sequential access advice
+ * and handed to the callback straight from the mapping, so there is
+ * no copy into an intermediate buffer. Pipes, character devices and
+ * files that can not be mapped are read() into a buffer instead.
+ */
+
+/*
+ * Callback getting the next piece of the file.
+ * Anything other than SUCCESS stops the processing
+ */
+typedef status (*file_io_cb)(void *ctx, const void *data, size_t len);
+
+/*
+ * Read only mapping of a file from a position to its end
+ */
+typedef struct file_io_map_s
+{
+    const unsigned char *data;
+    size_t size;
+    void *map;      /* whole mapping as returned by mmap */
+    size_t map_len;
+} file_io_map_t;
+
+/*
+ * Function: file_io_process
+ * Passes the content of the file to cb in order, in pieces of at most
+ * chunk bytes. An empty file results in no calls to cb.
+ */
+status file_io_process(const char *file_name, size_t chunk,
+                       file_io_cb cb, void *ctx);
+
+/*
+ * Function: file_io_process_fd
+ * Same as file_io_process, but for an already open file descriptor.
+ * The descriptor is read from its current position and is not closed
+ */
+status file_io_process_fd(int fd, size_t chunk, file_io_cb cb, void *ctx);
+
+/*
+ * Function: file_io_map_fd
+ * Maps the file from its current position to the end.
+ * Fails for anything that is not a non empty regular file
+ */
+status file_io_map_fd(int fd, file_io_map_t *m);
+
+/*
+ * Function: file_io_unmap
+ * Releases mapping made by file_io_map_fd
+ */
+void file_io_unmap(file_io_map_t *m);
+
+#endif /* _SPG_FILE_IO_H_ */
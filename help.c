@@ -56,11 +56,49 @@ static void sign_help(void)
 {
     printf("\n SPG " VERSION_STRING "\n\n");
     printf("\nHelp for Sign message operation\n"  );
-    printf("\nUse: %s -s -k<private key> -o<signature file> message_file",program_name );
+    printf("\nUse: %s -s -k<private key> -o<signature file> [-n<nonce type>] [-H<hash>] [-m<mode>] [-j<jobs>] [-C [-R<ranges>]] message_file [message_file ...]",program_name );
+    printf("\n     %s -s -k<private key> -o<signature file> [-H<hash>] -D<digest>",program_name );
+    printf("\n     %s -s -k<private key> -o<signature file> [-H<hash>] -m batch message_file ...",program_name );
+    printf("\n     %s -s -k<private key> [-o<manifest file>] [-H<hash>] [-j<jobs>] directory",program_name );
     printf("\nparameters:");
     printf("\n -k<private key>    - Valid private key file generated with -g command");
     printf("\n -o<signature file> - File name where the signature will be stored" );
-    printf("\n message_file       - Message file to sign\n\n" );
+    printf("\n -n<nonce type>     - rfc6979 (default) - deterministic nonce, the same message\n"
+           "                      and key always give the same signature\n"
+           "                      random - random nonce" );
+    printf("\n -H<hash>           - sha256, sha384, sha512, blake2b or blake3 - message digest,\n"
+           "                      truncated to the size of the curve order. Use the one that\n"
+           "                      matches the curve, e.g. sha256 for secp256r1. The hash is stored\n"
+           "                      in the signature file. Without it SHA-512 reduced mod n is used,\n"
+           "                      same as in older versions. blake3 is a tree hash, it hashes\n"
+           "                      big files on -j threads in stream mode as well. It can't be used\n"
+           "                      for merkle mode, batch mode and directories" );
+    printf("\n -m<mode>           - stream (default) - one hash over the whole message\n"
+           "                      merkle - Merkle tree over 1M chunks hashed in parallel,\n"
+           "                      much faster for big files on multi core machines.\n"
+           "                      batch - one signature of Merkle tree root over all the message\n"
+           "                      files, each message gets inclusion proof message_file" PROOF_FILE_SUFFIX "\n"
+           "                      that shows it is in the signed batch.\n"
+           "                      The mode is stored in the signature file" );
+    printf("\n -j<jobs>           - Number of threads for merkle mode, blake3 and directories.\n"
+           "                      Default is one per CPU" );
+    printf("\n -C                 - Keep hashes of the merkle mode chunks in message_file" CHUNK_CACHE_FILE_SUFFIX "\n"
+           "                      and hash again only the chunks that changed since. Implies -m merkle.\n"
+           "                      If the file was modified without the -R list all chunks are hashed,\n"
+           "                      also when its modification time was set back" );
+    printf("\n -R<ranges>         - OFFSET:LENGTH[,OFFSET:LENGTH...] byte ranges of the message changed\n"
+           "                      since it was signed with -C last time. Implies -C" );
+    printf("\n -D<digest>         - Sign message digest computed already with the -H hash, SHA-512\n"
+           "                      without -H, instead of the message. The digest is in hex, or -\n"
+           "                      to read it from stdin in hex or binary. Output of sha512sum or\n"
+           "                      openssl dgst -r is fine, the file name is ignored. The\n"
+           "                      signature verifies the message as well" );
+    printf("\n message_file       - Message file to sign. With more files each signature is stored\n"
+           "                      in message_file" SIGNATURE_FILE_SUFFIX " and small files are hashed together,\n"
+           "                      several at a time\n" );
+    printf("\n directory          - Hash all the files under the directory in parallel and sign\n"
+           "                      one manifest of their paths, sizes and digests. The manifest\n"
+           "                      with the signature goes to directory" MANIFEST_FILE_SUFFIX " by default\n\n" );
 
 }
 
@@ -68,11 +106,24 @@ static void verify_help(void)
 {
     printf("\n SPG " VERSION_STRING "\n\n");
     printf("\nHelp for Verify Signature operation \n"  );
-    printf("\nUse: %s -v -k<public key> -i<signature file> message_file",program_name );
+    printf("\nUse: %s -v -k<public key> -i<signature file> [-j<jobs>] message_file [message_file ...]",program_name );
+    printf("\n     %s -v -k<public key> -i<signature file> -D<digest>",program_name );
+    printf("\n     %s -v -k<public key> -i<batch signature file> message_file ...",program_name );
+    printf("\n     %s -v -k<public key> [-i<manifest file>] [-j<jobs>] directory",program_name );
     printf("\nparameters:");
     printf("\n -k<public key>     - Valid public key exported from private key with -x command");
     printf("\n -i<signature file> - File name where the signature is stored" );
-    printf("\n message_file       - Message file to which the signatures was generated\n\n" );
+    printf("\n -j<jobs>           - Number of threads for signatures in merkle mode or with blake3\n"
+           "                      and for directories" );
+    printf("\n -D<digest>         - Verify message digest, in hex or - for stdin, instead of the\n"
+           "                      message. Hash of the digest is the one in the signature file" );
+    printf("\n message_file       - Message file to which the signatures was generated. With more\n"
+           "                      files the signatures are read from message_file" SIGNATURE_FILE_SUFFIX ", or\n"
+           "                      with -i all the files are checked against one batch signature\n"
+           "                      using their message_file" PROOF_FILE_SUFFIX " inclusion proofs" );
+    printf("\n directory          - Check the files under the directory against its signed manifest,\n"
+           "                      directory" MANIFEST_FILE_SUFFIX " by default. Changed, missing and new files\n"
+           "                      make the signature invalid\n\n" );
 }
 
 static void encrypt_help(void)
@@ -81,22 +132,100 @@ static void encrypt_help(void)
     printf("\nHelp for encrypt operation.");
     printf("\nOperation will encrypt the <file_to_encrypt> file and the encrypted file will be \n"
            "stored with .enc suffix.\n" );
-    printf("\nUse: %s -e -k<public key> file_to_encrypt",program_name );
+    printf("\nUse: %s -e -k<public key> [-S<cipher>] [-K<kdf>] [-j<jobs>] [-I<io>] [-Q<depth>] [-O] [-o<output file>] file_to_encrypt",program_name );
     printf("\nparameters:");
     printf("\n -k<public key>     - Valid public key exported from private key with -x command");
-    printf("\n file_to_encrypt    - File to be encrypted\n\n" );
+    printf("\n -K<kdf>            - sha512 (default) or blake3 - function deriving the symmetric keys\n"
+           "                      from the shared secret" );
+    printf("\n -S<cipher>         - auto (default), AES-256-GCM, ChaCha20-Poly1305 or Blowfish, see -p.\n"
+           "                      auto picks AES-256-GCM if the CPU has AES instructions and\n"
+           "                      ChaCha20-Poly1305 if not. These cut the file into 64K segments,\n"
+           "                      each encrypted and authenticated on its own, so a damaged, cut\n"
+           "                      or reordered file is detected. The file header records the\n"
+           "                      cipher and -K.\n"
+           "                      Blowfish makes the old format with HMAC-SHA1 and no header,\n"
+           "                      so the same -S and -K have to be given to decrypt it. It can\n"
+           "                      not be used with stdin or stdout" );
+    printf("\n -j<jobs>           - Number of threads encrypting the segments, one per CPU by\n"
+           "                      default. The output is the same for any number" );
+    printf("\n -I<io>             - uring (default) or pread - how segmented files are read and\n"
+           "                      written. uring falls back to pread if the kernel has no io_uring" );
+    printf("\n -Q<depth>          - Number of io_uring requests in flight, 8 by default" );
+    printf("\n -O                 - Read the file with O_DIRECT, bypassing the page cache" );
+    printf("\n -o<output file>    - File where the encrypted data is stored, file_to_encrypt with\n"
+           "                      .enc suffix by default. - writes it to stdout" );
+    printf("\n file_to_encrypt    - File to be encrypted. - reads stdin and writes stdout, so\n"
+           "                      spg can sit in a pipe. Segments are written as they are\n"
+           "                      sealed, the memory used does not grow with the file\n\n" );
 }
 
 static void decrypt_help(void)
 {
     printf("\n SPG " VERSION_STRING "\n\n");
     printf("\nHelp for decrypt operation \n"  );
-    printf("\nUse: %s -d -k<private key> [-o<encrypted file>] file_to_decrypt",program_name );
+    printf("\nUse: %s -d -k<private key> [-S<cipher>] [-K<kdf>] [-j<jobs>] [-I<io>] [-Q<depth>] [-O] [-r<range>] [-o<encrypted file>] file_to_decrypt",program_name );
     printf("\nparameters:");
     printf("\n -k<private key>    - Valid private key file generated with -g command");
+    printf("\n -K<kdf>            - Key derivation function of a file without header, sha512\n"
+           "                      by default" );
+    printf("\n -S<cipher>         - Cipher of a file without header, only Blowfish can be one" );
+    printf("\n                      Segmented files are decrypted segment by segment, each written\n"
+           "                      out only once it is authenticated. If one is not genuine the\n"
+           "                      decryption stops and the output file is removed" );
+    printf("\n -j<jobs>           - Number of threads decrypting the segments, one per CPU by default" );
+    printf("\n -I<io>             - uring (default) or pread - how segmented files are read and\n"
+           "                      written. uring falls back to pread if the kernel has no io_uring" );
+    printf("\n -Q<depth>          - Number of io_uring requests in flight, 8 by default" );
+    printf("\n -O                 - Write the file with O_DIRECT, bypassing the page cache" );
+    printf("\n -r<range>          - OFFSET:LENGTH - decrypt only these bytes of the plain text.\n"
+           "                      Only the segments covering them are read and authenticated,\n"
+           "                      so it takes the same time anywhere in a file of any size.\n"
+           "                      The range is cut at the end of the file. Segmented files only" );
     printf("\n -o<encrypted file> - If the file_to_decrypt file has \".enc\" suffix then the parameter is optional.\n"
-           "                        Otherwise it has to be provided and the decrypted file will be stored in this file." );
-    printf("\n file_to_decrypt    - File to be decrypted\n\n" );
+           "                        Otherwise it has to be provided and the decrypted file will be stored in this file.\n"
+           "                        - writes it to stdout" );
+    printf("\n file_to_decrypt    - File to be decrypted. - reads stdin and writes stdout.\n"
+           "                      Only authenticated segments reach stdout, but a pipe can not\n"
+           "                      take back what was written before a bad segment, so check\n"
+           "                      the exit status. Files without header can not be read from stdin\n"
+           "                      or written to stdout\n\n" );
+}
+
+static void append_help(void)
+{
+    printf("\n SPG " VERSION_STRING "\n\n");
+    printf("\nHelp for append operation \n"  );
+    printf("Operation encrypts the <file to append> file onto the end of a segmented\n"
+           "<encrypted file>. The key is derived again from the file header, so it needs\n"
+           "the private key. Only the final segment of the file is decrypted and sealed\n"
+           "again, so the time it takes depends on the appended data only.\n");
+    printf("\nUse: %s -a -k<private key> [-j<jobs>] [-I<io>] [-Q<depth>] [-O] [-i<file to append>] encrypted_file",program_name );
+    printf("\nparameters:");
+    printf("\n -k<private key>    - Valid private key file generated with -g command");
+    printf("\n -j<jobs>           - Number of threads encrypting the segments, one per CPU by default" );
+    printf("\n -I<io>             - uring (default) or pread - how the files are read and written" );
+    printf("\n -Q<depth>          - Number of io_uring requests in flight, 8 by default" );
+    printf("\n -O                 - Read the file to append with O_DIRECT, bypassing the page cache" );
+    printf("\n -i<file to append> - Data to append, stdin if not given or -" );
+    printf("\n encrypted_file     - File encrypted with AES-256-GCM or ChaCha20-Poly1305.\n"
+           "                      If the append fails it is put back as it was. If it is interrupted\n"
+           "                      encrypted_file" APPEND_JOURNAL_FILE_SUFFIX " keeps what is needed to put it back, which the\n"
+           "                      next append does first; -i /dev/null appends nothing. Until then\n"
+           "                      the file is not decrypted\n\n" );
+}
+
+static void precompute_help(void)
+{
+    printf("\n SPG " VERSION_STRING "\n\n");
+    printf("\nHelp for precompute operation \n"  );
+    printf("Operation builds a table of precomputed points for the public key and stores\n"
+           "it next to the key file with " PRECOMP_FILE_SUFFIX " suffix. The table for the base point\n"
+           "of the curve is stored in ~/" SPG_DIR_NAME ". Sign, verify and encrypt operations map\n"
+           "the tables if they are there, which makes them faster for long-lived keys.\n");
+    printf("\nUse: %s -t [ -k<public key> | -c<curve name> ]",program_name );
+    printf("\nparameters:");
+    printf("\n -k<public key>     - Valid public key exported from private key with -x command");
+    printf("\n -c<curve name>     - Build only the base point table for the curve\n\n");
 }
 
 static help_t operations[ ] =
@@ -111,6 +240,8 @@ static help_t operations[ ] =
     { "enc", encrypt_help },
     { "decrypt", decrypt_help },
     { "dec", decrypt_help },
+    { "append", append_help },
+    { "precompute", precompute_help },
     { NULL, NULL }
 };
 
@@ -128,6 +259,8 @@ void print_help ( void )
            "   -v --verify           Verify message signature\n"
            "   -e --encrypt          Encrypt\n"
            "   -d --decrypt          Decrypt\n"
+           "   -a --append           Append to encrypted file\n"
+           "   -t --precompute       Precompute public key table\n"
            "   -l --list_curves      List implemented curves\n"
            "   -p --list_sym_ciphers List symmetric ciphers\n"
            "   -h --help             Print help and exit\n"
@@ -137,6 +270,20 @@ void print_help ( void )
            "   -i --input            Specifies input file\n"
            "   -k --key              Specifies key input file\n"
            "   -o --output           Specifies output file\n"
+           "   -n --nonce            Specifies signature nonce type (rfc6979, random)\n"
+           "   -H --hash             Specifies signature hash (sha256, sha384, sha512, blake2b, blake3)\n"
+           "   -m --mode             Specifies signature digest mode (stream, merkle, batch)\n"
+           "   -j --jobs             Specifies number of worker threads\n"
+           "   -C --cache            Keep Merkle tree chunk cache of signed message\n"
+           "   -R --changed          Specifies message byte ranges changed since last signature\n"
+           "   -D --digest           Sign or verify message digest instead of message file\n"
+           "   -K --kdf              Specifies encryption key derivation function (sha512, blake3)\n"
+           "   -S --cipher           Specifies symmetric cipher (Blowfish, AES-256-GCM,\n"
+           "                         ChaCha20-Poly1305, auto)\n"
+           "   -I --io               Specifies encryption I/O engine (uring, pread)\n"
+           "   -Q --queue_depth      Specifies number of I/O requests in flight\n"
+           "   -O --direct           Use O_DIRECT for the plain text file\n"
+           "   -r --range            Specifies plain text range to decrypt (OFFSET:LENGTH)\n"
            "   -V --verbose          Turn on the verbose mode\n"
           );
     printf("\nFor more help on commands use: \n%s --help <command> \n", program_name );
@@ -0,0 +1,586 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "defs.h"
+#include "io_engine.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define IO_URING 1
+#endif
+
+io_engine_config_t io_engine_config = { IO_ENGINE_URING, IO_ENGINE_DEPTH, 0 };
+
+static const char* io_engine_names[] = { "uring", "pread" };
+
+struct io_engine_s
+{
+    io_engine_type type;
+#ifdef IO_URING
+    int ring_fd;
+    unsigned int depth;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    struct iovec *fixed;    /* registered buffers */
+    unsigned int fixed_count;
+#endif
+};
+
+/*
+ * pread / pwrite, or read / write for streams
+ */
+static status io_sync_transfer(int out, int fd, unsigned char *buf, size_t len,
+                               int64_t off, size_t *done)
+{
+    *done = 0;
+    while (*done < len)
+    {
+        ssize_t n;
+
+        if (off < 0)
+            n = out ? write(fd, buf + *done, len - *done) : read(fd, buf + *done, len - *done);
+        else if (out)
+            n = pwrite(fd, buf + *done, len - *done, (off_t) (off + *done));
+        else
+            n = pread(fd, buf + *done, len - *done, (off_t) (off + *done));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERROR_LOG("%s failed: %s\n", out ? "Write" : "Read", strerror(errno));
+            return FAIL;
+        }
+        if (!n)
+            break;
+        *done += (size_t) n;
+    }
+    if (out && (*done < len))
+    {
+        ERROR_LOG("Write failed\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+#ifdef IO_URING
+/*
+ * Part of a transfer in flight as one request
+ */
+typedef struct io_request_s
+{
+    unsigned char *buf;
+    size_t len;
+    size_t done;
+    int64_t off;
+} io_request_t;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static void io_uring_release(io_engine_t *e)
+{
+    if (e->sqes)
+        munmap(e->sqes, e->sqes_len);
+    if (e->cq_ring && (e->cq_ring != e->sq_ring))
+        munmap(e->cq_ring, e->cq_ring_len);
+    if (e->sq_ring)
+        munmap(e->sq_ring, e->sq_ring_len);
+    if (e->ring_fd >= 0)
+        close(e->ring_fd);
+    FREE(e->fixed);
+}
+
+/*
+ * Sets the ring up. Needs IORING_OP_READ and IORING_OP_WRITE, which
+ * came with IORING_FEAT_RW_CUR_POS
+ */
+static status io_uring_init(io_engine_t *e, unsigned int depth)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    e->ring_fd = io_uring_setup(depth, &p);
+    if (e->ring_fd < 0)
+        return FAIL;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        io_uring_release(e);
+        return FAIL;
+    }
+    e->depth = depth;
+    e->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    e->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (e->cq_ring_len > e->sq_ring_len)
+            e->sq_ring_len = e->cq_ring_len;
+        e->cq_ring_len = e->sq_ring_len;
+    }
+    e->sq_ring = mmap(NULL, e->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+    if (e->sq_ring == MAP_FAILED)
+    {
+        e->sq_ring = NULL;
+        io_uring_release(e);
+        return FAIL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        e->cq_ring = e->sq_ring;
+    }
+    else
+    {
+        e->cq_ring = mmap(NULL, e->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_CQ_RING);
+        if (e->cq_ring == MAP_FAILED)
+        {
+            e->cq_ring = NULL;
+            io_uring_release(e);
+            return FAIL;
+        }
+    }
+    e->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sqes = mmap(NULL, e->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+    if (e->sqes == MAP_FAILED)
+    {
+        e->sqes = NULL;
+        io_uring_release(e);
+        return FAIL;
+    }
+    sq = e->sq_ring;
+    cq = e->cq_ring;
+    e->sq_head = (unsigned int*) (sq + p.sq_off.head);
+    e->sq_tail = (unsigned int*) (sq + p.sq_off.tail);
+    e->sq_mask = (unsigned int*) (sq + p.sq_off.ring_mask);
+    e->sq_array = (unsigned int*) (sq + p.sq_off.array);
+    e->cq_head = (unsigned int*) (cq + p.cq_off.head);
+    e->cq_tail = (unsigned int*) (cq + p.cq_off.tail);
+    e->cq_mask = (unsigned int*) (cq + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return SUCCESS;
+}
+
+/*
+ * Queues the rest of the request. Uses the registered
+ * buffer it lies in, if any
+ */
+static void io_uring_queue(io_engine_t *e, int out, int fd, io_request_t *r, unsigned int id)
+{
+    unsigned int tail = *e->sq_tail;
+    unsigned int index = tail & *e->sq_mask;
+    struct io_uring_sqe *sqe = &e->sqes[index];
+    unsigned char *buf = r->buf + r->done;
+    size_t len = r->len - r->done;
+    unsigned int i;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = out ? IORING_OP_WRITE : IORING_OP_READ;
+    for (i = 0; i < e->fixed_count; i++)
+    {
+        unsigned char *base = e->fixed[i].iov_base;
+
+        if ((buf >= base) && (buf + len <= base + e->fixed[i].iov_len))
+        {
+            sqe->opcode = out ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (unsigned short) i;
+            break;
+        }
+    }
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = (unsigned int) len;
+    sqe->off = (unsigned long long) (r->off + r->done);
+    sqe->user_data = id;
+    e->sq_array[index] = index;
+    __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Gets the ring back to a clean state after io_uring_enter failed, so
+ * nothing of the transfer is left for the next one and the kernel is
+ * done with its buffers. The requests the kernel has not taken are
+ * dropped and the others waited for. If even that fails the ring is
+ * torn down and the engine goes on with pread
+ */
+static void io_uring_drain(io_engine_t *e, unsigned int in_flight)
+{
+    unsigned int head = __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail;
+
+    in_flight -= *e->sq_tail - head;
+    __atomic_store_n(e->sq_tail, head, __ATOMIC_RELEASE);
+    while (in_flight)
+    {
+        if ((io_uring_enter(e->ring_fd, 0, 1) < 0) && (errno != EINTR))
+        {
+            ERROR_LOG("io_uring requests can't be waited for: %s\n", strerror(errno));
+            io_uring_release(e);
+            e->fixed_count = 0;
+            e->type = IO_ENGINE_PREAD;
+            return;
+        }
+        head = *e->cq_head;
+        tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+        in_flight -= (tail - head < in_flight) ? tail - head : in_flight;
+        __atomic_store_n(e->cq_head, tail, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Splits the transfer into requests and keeps up to depth of them
+ * in flight till all are done. A read request that comes back short
+ * has hit the end of the file. After a failed request the ones in
+ * flight are still reaped before returning
+ */
+static status io_uring_transfer(io_engine_t *e, int out, int fd, unsigned char *buf,
+                                size_t len, int64_t off, size_t *done)
+{
+    unsigned int count = (unsigned int) ((len + IO_ENGINE_REQUEST_SIZE - 1) / IO_ENGINE_REQUEST_SIZE);
+    unsigned int next = 0, in_flight = 0, to_submit = 0, i;
+    io_request_t *reqs;
+    status stat = SUCCESS;
+
+    *done = 0;
+    if (!len)
+        return SUCCESS;
+    reqs = calloc(count, sizeof(io_request_t));
+    if (!reqs)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    for (i = 0; i < count; i++)
+    {
+        reqs[i].buf = buf + (size_t) i * IO_ENGINE_REQUEST_SIZE;
+        reqs[i].off = off + (int64_t) i * IO_ENGINE_REQUEST_SIZE;
+        reqs[i].len = (i == count - 1) ? len - (size_t) i * IO_ENGINE_REQUEST_SIZE :
+                      IO_ENGINE_REQUEST_SIZE;
+    }
+    while (in_flight || ((next < count) && (SUCCESS == stat)))
+    {
+        unsigned int head, tail;
+        int ret;
+
+        while ((SUCCESS == stat) && (next < count) && (in_flight < e->depth))
+        {
+            io_uring_queue(e, out, fd, &reqs[next], next);
+            next++;
+            in_flight++;
+            to_submit++;
+        }
+        ret = io_uring_enter(e->ring_fd, to_submit, 1);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERROR_LOG("io_uring_enter failed: %s\n", strerror(errno));
+            io_uring_drain(e, in_flight);
+            stat = FAIL;
+            break;
+        }
+        to_submit -= (unsigned int) ret;
+
+        head = *e->cq_head;
+        tail = __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &e->cqes[head & *e->cq_mask];
+            io_request_t *r = &reqs[cqe->user_data];
+            int res = cqe->res;
+
+            in_flight--;
+            if ((res == -EINTR) || (res == -EAGAIN))
+            {
+                res = 0;
+            }
+            else if (res < 0)
+            {
+                if (SUCCESS == stat)
+                    ERROR_LOG("%s failed: %s\n", out ? "Write" : "Read", strerror(-res));
+                stat = FAIL;
+                continue;
+            }
+            else if (!res)
+            {
+                if (out && (SUCCESS == stat))
+                {
+                    ERROR_LOG("Write failed\n");
+                    stat = FAIL;
+                }
+                /* end of the file */
+                continue;
+            }
+            r->done += (size_t) res;
+            if ((r->done < r->len) && (SUCCESS == stat))
+            {
+                io_uring_queue(e, out, fd, r, (unsigned int) cqe->user_data);
+                in_flight++;
+                to_submit++;
+            }
+        }
+        __atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+    }
+    for (i = 0; i < count; i++)
+    {
+        *done += reqs[i].done;
+        if (reqs[i].done < reqs[i].len)
+            break;
+    }
+    free(reqs);
+    return stat;
+}
+#endif /* IO_URING */
+
+/*
+ *
+ */
+status io_engine_by_name(const char *name, io_engine_type *type)
+{
+    unsigned int i;
+
+    CHECK_PARAM(name);
+    CHECK_PARAM(type);
+
+    for (i = 0; i < sizeof(io_engine_names) / sizeof(io_engine_names[0]); i++)
+    {
+        if (strcasecmp(name, io_engine_names[i]) == 0)
+        {
+            *type = (io_engine_type) i;
+            return SUCCESS;
+        }
+    }
+    return BAD_PARAMS;
+}
+
+/*
+ *
+ */
+status io_engine_create(io_engine_t **engine)
+{
+    io_engine_t *e;
+    unsigned int depth = io_engine_config.depth;
+
+    CHECK_PARAM(engine);
+
+    e = calloc(1, sizeof(io_engine_t));
+    if (!e)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    if (!depth)
+        depth = 1;
+    if (depth > IO_ENGINE_MAX_DEPTH)
+        depth = IO_ENGINE_MAX_DEPTH;
+    e->type = IO_ENGINE_PREAD;
+#ifdef IO_URING
+    e->ring_fd = -1;
+    if ((IO_ENGINE_URING == io_engine_config.type) && (io_uring_init(e, depth) == SUCCESS))
+        e->type = IO_ENGINE_URING;
+#endif
+    if (e->type != io_engine_config.type)
+        LOG("io_uring is not available, using pread\n");
+    *engine = e;
+    return SUCCESS;
+}
+
+/*
+ *
+ */
+const char* io_engine_name(const io_engine_t *engine)
+{
+    return io_engine_names[engine->type];
+}
+
+/*
+ *
+ */
+status io_engine_register(io_engine_t *engine, const struct iovec *bufs, unsigned int count)
+{
+    CHECK_PARAM(engine);
+    CHECK_PARAM(bufs);
+
+#ifdef IO_URING
+    if ((IO_ENGINE_URING == engine->type) && !engine->fixed_count)
+    {
+        engine->fixed = malloc(count * sizeof(struct iovec));
+        if (!engine->fixed)
+            return FAIL;
+        if (syscall(__NR_io_uring_register, engine->ring_fd, IORING_REGISTER_BUFFERS,
+                    bufs, count) < 0)
+        {
+            LOG("Can not register I/O buffers: %s\n", strerror(errno));
+            FREE(engine->fixed);
+            return FAIL;
+        }
+        memcpy(engine->fixed, bufs, count * sizeof(struct iovec));
+        engine->fixed_count = count;
+        return SUCCESS;
+    }
+#endif
+    (void) count;
+    return NOT_IMPLEMENTED;
+}
+
+/*
+ * Part of the transfer that can be made with O_DIRECT. If it is not
+ * all of it O_DIRECT gets switched off for the rest
+ */
+static size_t io_direct_part(int fd, const unsigned char *buf, size_t len, int64_t off)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if ((flags < 0) || !(flags & O_DIRECT))
+        return len;
+    if (((uintptr_t) buf % IO_ENGINE_ALIGN) || (off < 0) || (off % IO_ENGINE_ALIGN))
+        return 0;
+    return len & ~((size_t) IO_ENGINE_ALIGN - 1);
+}
+
+static status io_engine_part(io_engine_t *engine, int out, int fd, unsigned char *buf,
+                             size_t len, int64_t off, size_t *done)
+{
+#ifdef IO_URING
+    /*
+     * Streams are kept in order with one request at a time
+     */
+    if ((IO_ENGINE_URING == engine->type) && (off >= 0))
+        return io_uring_transfer(engine, out, fd, buf, len, off, done);
+#endif
+    (void) engine;
+    return io_sync_transfer(out, fd, buf, len, off, done);
+}
+
+static status io_engine_transfer(io_engine_t *engine, int out, int fd, unsigned char *buf,
+                                 size_t len, int64_t off, size_t *done)
+{
+    size_t direct = io_direct_part(fd, buf, len, off);
+    size_t rest = 0;
+    status stat = SUCCESS;
+
+    *done = 0;
+    if (direct)
+    {
+        stat = io_engine_part(engine, out, fd, buf, direct, off, done);
+        if ((SUCCESS != stat) || (*done < direct))
+            return stat;
+    }
+    if (direct < len)
+    {
+        int flags = fcntl(fd, F_GETFL);
+
+        if (flags >= 0)
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+        stat = io_engine_part(engine, out, fd, buf + direct, len - direct,
+                              (off < 0) ? off : off + (int64_t) direct, &rest);
+        *done += rest;
+    }
+    return stat;
+}
+
+/*
+ *
+ */
+status io_engine_read(io_engine_t *engine, int fd, void *buf, size_t len,
+                      int64_t off, size_t *done)
+{
+    CHECK_PARAM(engine);
+    CHECK_PARAM(buf);
+    CHECK_PARAM(done);
+
+    return io_engine_transfer(engine, 0, fd, buf, len, off, done);
+}
+
+/*
+ *
+ */
+status io_engine_write(io_engine_t *engine, int fd, const void *buf, size_t len,
+                       int64_t off)
+{
+    size_t done;
+
+    CHECK_PARAM(engine);
+    CHECK_PARAM(buf);
+
+    return io_engine_transfer(engine, 1, fd, (unsigned char*) buf, len, off, &done);
+}
+
+/*
+ *
+ */
+status io_engine_direct(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_DIRECT) < 0))
+    {
+        LOG("O_DIRECT is not supported: %s\n", strerror(errno));
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ *
+ */
+void io_engine_destroy(io_engine_t *engine)
+{
+    if (!engine)
+        return;
+#ifdef IO_URING
+    if (IO_ENGINE_URING == engine->type)
+        io_uring_release(engine);
+#endif
+    free(engine);
+}
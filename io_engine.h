@@ -0,0 +1,110 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_IO_ENGINE_H_
+#define _SPG_IO_ENGINE_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Block I/O of the encrypt and decrypt pipelines. The io_uring engine
+ * splits a transfer into requests of IO_ENGINE_REQUEST_SIZE and keeps
+ * up to the queue depth of them in flight, from registered buffers
+ * where it can. It falls back to pread / pwrite if the kernel or the
+ * build has no io_uring. A negative offset means the current position
+ * of a pipe or other stream, which is always read and written in order.
+ */
+typedef enum io_engine_type_e
+{
+    IO_ENGINE_URING,
+    IO_ENGINE_PREAD
+} io_engine_type;
+
+#define IO_ENGINE_DEPTH 8
+#define IO_ENGINE_MAX_DEPTH 256
+#define IO_ENGINE_REQUEST_SIZE (256 * 1024)
+#define IO_ENGINE_ALIGN 4096
+
+typedef struct io_engine_config_s
+{
+    io_engine_type type;
+    unsigned int depth;
+    int direct;         /* O_DIRECT where the transfers are aligned */
+} io_engine_config_t;
+
+extern io_engine_config_t io_engine_config;
+
+typedef struct io_engine_s io_engine_t;
+
+/*
+ * Function: io_engine_by_name
+ * Engine type from its name - uring or pread
+ */
+status io_engine_by_name(const char *name, io_engine_type *type);
+
+/*
+ * Function: io_engine_create
+ * Creates an engine as set in io_engine_config. Each thread doing
+ * I/O needs its own
+ */
+status io_engine_create(io_engine_t **engine);
+
+/*
+ * Function: io_engine_name
+ * Name of the engine actually used
+ */
+const char* io_engine_name(const io_engine_t *engine);
+
+/*
+ * Function: io_engine_register
+ * Registers buffers the transfers will be made from. Transfers within
+ * them avoid mapping the pages on each request. Failure only means
+ * they are not used
+ */
+status io_engine_register(io_engine_t *engine, const struct iovec *bufs, unsigned int count);
+
+/*
+ * Function: io_engine_read
+ * Reads len bytes at offset off. done is less than len only at the end
+ * of the file
+ */
+status io_engine_read(io_engine_t *engine, int fd, void *buf, size_t len,
+                      int64_t off, size_t *done);
+
+/*
+ * Function: io_engine_write
+ * Writes len bytes at offset off
+ */
+status io_engine_write(io_engine_t *engine, int fd, const void *buf, size_t len,
+                       int64_t off);
+
+/*
+ * Function: io_engine_direct
+ * Turns O_DIRECT on for the descriptor. Transfers that are not aligned
+ * to IO_ENGINE_ALIGN switch it off again, so only the final partial
+ * block goes through the page cache
+ */
+status io_engine_direct(int fd);
+
+/*
+ * Function: io_engine_destroy
+ * Releases the engine
+ */
+void io_engine_destroy(io_engine_t *engine);
+
+#endif /* _SPG_IO_ENGINE_H_ */
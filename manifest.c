@@ -0,0 +1,518 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+#include "defs.h"
+#include "file_io.h"
+#include "thread_pool.h"
+#include "manifest.h"
+
+#define MANIFEST_HASH_FIELD "Hash: "
+
+/*
+ * Adds file path of size, or link path to target of size bytes
+ */
+static status manifest_add(manifest_t *m, const char *path, unsigned long long size,
+                           const char *target)
+{
+    if (m->count == m->alloc)
+    {
+        unsigned long alloc = m->alloc ? m->alloc * 2 : 64;
+        manifest_entry_t *entries = realloc(m->entries, alloc * sizeof(manifest_entry_t));
+
+        if (!entries)
+        {
+            ERROR_LOG("Memory allocation failed\n");
+            return FAIL;
+        }
+        m->entries = entries;
+        m->alloc = alloc;
+    }
+    memset(&m->entries[m->count], 0, sizeof(manifest_entry_t));
+    m->entries[m->count].path = strdup(path);
+    if (target)
+        m->entries[m->count].target = strdup(target);
+    if (!m->entries[m->count].path || (target && !m->entries[m->count].target))
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        FREE(m->entries[m->count].path);
+        FREE(m->entries[m->count].target);
+        return FAIL;
+    }
+    m->entries[m->count].size = size;
+    m->entries[m->count].stat = target ? SUCCESS : FAIL;
+    m->count++;
+    return SUCCESS;
+}
+
+/*
+ * Adds link rel_path, its target is read from path
+ */
+static status manifest_add_link(manifest_t *m, const char *rel_path, const char *path)
+{
+    char target[MAX_FILE_NAME_SIZE];
+    ssize_t len = readlink(path, target, sizeof(target));
+
+    if ((len <= 0) || (len >= (ssize_t) sizeof(target)))
+    {
+        ERROR_LOG("Can not read link %s\n", path);
+        return FAIL;
+    }
+    target[len] = '\0';
+    if (memchr(target, '\n', len))
+    {
+        ERROR_LOG("Link target with new line can't go to manifest %s\n", rel_path);
+        return FAIL;
+    }
+    return manifest_add(m, rel_path, (unsigned long long) len, target);
+}
+
+/*
+ * Walks directory dir/rel, rel is "" for the top one
+ */
+static status manifest_walk(manifest_t *m, const char *dir, const char *rel)
+{
+    char path[MAX_FILE_NAME_SIZE], rel_path[MAX_FILE_NAME_SIZE];
+    status stat = SUCCESS;
+    struct dirent *e;
+    struct stat st;
+    DIR *d;
+
+    snprintf(path, MAX_FILE_NAME_SIZE, "%s/%s", dir, rel);
+    d = opendir(path);
+    if (!d)
+    {
+        ERROR_LOG("Can not open directory %s\n", path);
+        return FAIL;
+    }
+    while ((SUCCESS == stat) && (e = readdir(d)))
+    {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        if (((size_t) snprintf(rel_path, MAX_FILE_NAME_SIZE, "%s%s%s", rel, *rel ? "/" : "",
+                               e->d_name) >= MAX_FILE_NAME_SIZE) ||
+                ((size_t) snprintf(path, MAX_FILE_NAME_SIZE, "%s/%s", dir, rel_path)
+                 >= MAX_FILE_NAME_SIZE))
+        {
+            ERROR_LOG("File name too long %s/%s\n", dir, rel_path);
+            stat = FAIL;
+            break;
+        }
+        if (strchr(rel_path, '\n'))
+        {
+            ERROR_LOG("File name with new line can't go to manifest %s\n", rel_path);
+            stat = FAIL;
+            break;
+        }
+        if (lstat(path, &st) != 0)
+        {
+            ERROR_LOG("Can not stat %s\n", path);
+            stat = FAIL;
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            stat = manifest_walk(m, dir, rel_path);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            stat = manifest_add(m, rel_path, (unsigned long long) st.st_size, NULL);
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            stat = manifest_add_link(m, rel_path, path);
+        }
+        else
+        {
+            INFO_LOG("Skipping %s, not a regular file or link\n", path);
+        }
+    }
+    closedir(d);
+    return stat;
+}
+
+static int manifest_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const manifest_entry_t *) a)->path, ((const manifest_entry_t *) b)->path);
+}
+
+static status manifest_init(manifest_t *m, int md_algo)
+{
+    memset(m, 0, sizeof(manifest_t));
+    m->md_algo = md_algo;
+    m->dlen = gcry_md_get_algo_dlen(md_algo);
+    if (!m->dlen || (m->dlen > SHA512_LEN))
+    {
+        ERROR_LOG("Invalid hash algorithm\n");
+        return BAD_PARAMS;
+    }
+    return SUCCESS;
+}
+
+status manifest_scan(manifest_t *m, const char *dir, int md_algo)
+{
+    status stat;
+
+    CHECK_PARAM(m);
+    CHECK_PARAM(dir);
+
+    if ((stat = manifest_init(m, md_algo)) != SUCCESS)
+        return stat;
+    stat = manifest_walk(m, dir, "");
+    if (SUCCESS == stat)
+        qsort(m->entries, m->count, sizeof(manifest_entry_t), manifest_entry_cmp);
+    return stat;
+}
+
+/*
+ * Files being hashed, each worker takes the next one
+ */
+typedef struct manifest_job_s
+{
+    manifest_t *m;
+    const char *dir;
+    unsigned long next;
+} manifest_job_t;
+
+static status manifest_hash_cb(void *ctx, const void *data, size_t len)
+{
+    gcry_md_write((gcry_md_hd_t) ctx, data, len);
+    return SUCCESS;
+}
+
+static status manifest_hash_file(const manifest_t *m, const char *dir, manifest_entry_t *e)
+{
+    char path[MAX_FILE_NAME_SIZE];
+    gcry_md_hd_t hash;
+    struct stat st;
+    status stat;
+    int fd;
+
+    snprintf(path, MAX_FILE_NAME_SIZE, "%s/%s", dir, e->path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        ERROR_LOG("Can not open %s\n", path);
+        return FAIL;
+    }
+    if (gcry_md_open(&hash, m->md_algo, 0) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hash function failed\n");
+        close(fd);
+        return FAIL;
+    }
+    stat = file_io_process_fd(fd, MSG_CHUNK_SIZE, manifest_hash_cb, hash);
+    if (SUCCESS == stat)
+    {
+        /*
+         * Size of what got hashed, the file could have changed since the scan
+         */
+        if (fstat(fd, &st) == 0)
+            e->size = (unsigned long long) st.st_size;
+        memcpy(e->digest, gcry_md_read(hash, 0), m->dlen);
+    }
+    gcry_md_close(hash);
+    close(fd);
+    return stat;
+}
+
+static void manifest_hash_task(void *arg)
+{
+    manifest_job_t *job = arg;
+    unsigned long i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->m->count)
+    {
+        manifest_entry_t *e = &job->m->entries[i];
+
+        if (!e->target)
+            e->stat = manifest_hash_file(job->m, job->dir, e);
+    }
+}
+
+status manifest_hash(manifest_t *m, const char *dir, unsigned int threads)
+{
+    thread_pool_t *pool = NULL;
+    manifest_job_t job;
+    unsigned int i;
+
+    CHECK_PARAM(m);
+    CHECK_PARAM(dir);
+
+    job.m = m;
+    job.dir = dir;
+    job.next = 0;
+
+    if (!threads)
+        threads = thread_pool_cpus();
+    if (threads > m->count)
+        threads = m->count;
+
+    if ((threads > 1) && (thread_pool_create(&pool, threads) == SUCCESS))
+    {
+        for (i = 0; i < threads; i++)
+        {
+            if (thread_pool_submit(pool, manifest_hash_task, &job) != SUCCESS)
+                break;
+        }
+        thread_pool_destroy(pool);
+    }
+    /*
+     * Picks up whatever is left if the pool could not be used
+     */
+    manifest_hash_task(&job);
+    return SUCCESS;
+}
+
+status manifest_format(const manifest_t *m, const char *hash_name,
+                       char **text, size_t *len)
+{
+    FILE *out;
+    unsigned long i;
+    unsigned int j;
+
+    CHECK_PARAM(m);
+    CHECK_PARAM(text);
+    CHECK_PARAM(len);
+
+    out = open_memstream(text, len);
+    if (!out)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    fprintf(out, MANIFEST_MAGIC MANIFEST_HASH_FIELD "%s\n", hash_name);
+    for (i = 0; i < m->count; i++)
+    {
+        if (m->entries[i].target)
+        {
+            fprintf(out, "l %llu %s %s\n", m->entries[i].size, m->entries[i].target,
+                    m->entries[i].path);
+            continue;
+        }
+        for (j = 0; j < m->dlen; j++)
+            fprintf(out, "%02x", m->entries[i].digest[j]);
+        fprintf(out, " %llu %s\n", m->entries[i].size, m->entries[i].path);
+    }
+    if (fclose(out) != 0)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        FREE(*text);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+static int hex_value(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Reads decimal number at line[*pos] followed by a space
+ */
+static status manifest_parse_size(const char *line, size_t len, size_t *pos,
+                                  unsigned long long *size)
+{
+    size_t start = *pos;
+
+    *size = 0;
+    for (; (*pos < len) && (line[*pos] >= '0') && (line[*pos] <= '9'); (*pos)++)
+        *size = *size * 10 + (unsigned long long) (line[*pos] - '0');
+    if ((*pos == start) || (*pos - start > 19) || (*pos >= len) || (line[*pos] != ' '))
+        return FAIL;
+    (*pos)++;
+    return SUCCESS;
+}
+
+/*
+ * Parses "l <target length> <target> <path>" line of len bytes
+ */
+static status manifest_parse_link(manifest_t *m, const char *line, size_t len)
+{
+    char path[MAX_FILE_NAME_SIZE], target[MAX_FILE_NAME_SIZE];
+    unsigned long long size;
+    size_t pos = 2;
+
+    if ((manifest_parse_size(line, len, &pos, &size) != SUCCESS) || !size ||
+            (size >= MAX_FILE_NAME_SIZE) || (len - pos < size + 2) ||
+            (line[pos + size] != ' ') || (len - pos - size - 1 >= MAX_FILE_NAME_SIZE))
+        return FAIL;
+    memcpy(target, line + pos, size);
+    target[size] = '\0';
+    pos += size + 1;
+    memcpy(path, line + pos, len - pos);
+    path[len - pos] = '\0';
+    if (strlen(target) != size)
+        return FAIL;
+    return manifest_add(m, path, size, target);
+}
+
+/*
+ * Parses "<hex digest> <size> <path>" line of len bytes
+ */
+static status manifest_parse_line(manifest_t *m, const char *line, size_t len)
+{
+    char path[MAX_FILE_NAME_SIZE];
+    unsigned char digest[SHA512_LEN];
+    unsigned long long size = 0;
+    size_t pos = 2 * m->dlen;
+    unsigned int i;
+
+    if ((len > 2) && (line[0] == 'l') && (line[1] == ' '))
+        return manifest_parse_link(m, line, len);
+    if ((len <= pos + 3) || (line[pos] != ' '))
+        return FAIL;
+    for (i = 0; i < m->dlen; i++)
+    {
+        int hi = hex_value(line[2 * i]), lo = hex_value(line[2 * i + 1]);
+
+        if ((hi < 0) || (lo < 0))
+            return FAIL;
+        digest[i] = (unsigned char) ((hi << 4) | lo);
+    }
+    for (pos++; (pos < len) && (line[pos] >= '0') && (line[pos] <= '9'); pos++)
+        size = size * 10 + (unsigned long long) (line[pos] - '0');
+    if ((pos >= len) || (line[pos] != ' ') || (len - pos - 1 >= MAX_FILE_NAME_SIZE) ||
+            (len - pos - 1 == 0))
+        return FAIL;
+    memcpy(path, line + pos + 1, len - pos - 1);
+    path[len - pos - 1] = '\0';
+    if (manifest_add(m, path, size, NULL) != SUCCESS)
+        return FAIL;
+    memcpy(m->entries[m->count - 1].digest, digest, m->dlen);
+    m->entries[m->count - 1].stat = SUCCESS;
+    return SUCCESS;
+}
+
+/*
+ * Returns the first line after the header, NULL if there is no header
+ */
+static const char *manifest_header(const char *text, size_t len,
+                                   char *hash_name, size_t hash_name_len)
+{
+    size_t n = strlen(MANIFEST_MAGIC MANIFEST_HASH_FIELD);
+    const char *p = text + n, *nl;
+
+    if ((len < n) || memcmp(text, MANIFEST_MAGIC MANIFEST_HASH_FIELD, n))
+    {
+        ERROR_LOG("Not a manifest\n");
+        return NULL;
+    }
+    nl = memchr(p, '\n', len - n);
+    if (!nl || ((size_t) (nl - p) >= hash_name_len))
+    {
+        ERROR_LOG("Invalid manifest hash\n");
+        return NULL;
+    }
+    memcpy(hash_name, p, nl - p);
+    hash_name[nl - p] = '\0';
+    return nl + 1;
+}
+
+status manifest_hash_name(const char *text, size_t len,
+                          char *hash_name, size_t hash_name_len)
+{
+    CHECK_PARAM(text);
+    CHECK_PARAM(hash_name);
+
+    return manifest_header(text, len, hash_name, hash_name_len) ? SUCCESS : FAIL;
+}
+
+status manifest_parse(manifest_t *m, const char *text, size_t len, int md_algo)
+{
+    const char *p, *end = text + len, *nl;
+    char hash_name[32];
+    status stat;
+
+    CHECK_PARAM(m);
+    CHECK_PARAM(text);
+
+    if ((stat = manifest_init(m, md_algo)) != SUCCESS)
+        return stat;
+    p = manifest_header(text, len, hash_name, sizeof(hash_name));
+    if (!p)
+        return FAIL;
+
+    for (; p < end; p = nl + 1)
+    {
+        nl = memchr(p, '\n', end - p);
+        if (!nl || (manifest_parse_line(m, p, nl - p) != SUCCESS))
+        {
+            ERROR_LOG("Malformed manifest line %lu\n", m->count + 3);
+            manifest_release(m);
+            return FAIL;
+        }
+    }
+    qsort(m->entries, m->count, sizeof(manifest_entry_t), manifest_entry_cmp);
+    return SUCCESS;
+}
+
+status manifest_remove_file(manifest_t *m, const char *dir, const char *file)
+{
+    char path[MAX_FILE_NAME_SIZE];
+    struct stat st, fst;
+    unsigned long i;
+
+    CHECK_PARAM(m);
+    CHECK_PARAM(dir);
+    CHECK_PARAM(file);
+
+    if (stat(file, &fst) != 0)
+        return SUCCESS;
+    for (i = 0; i < m->count; i++)
+    {
+        snprintf(path, MAX_FILE_NAME_SIZE, "%s/%s", dir, m->entries[i].path);
+        if ((lstat(path, &st) == 0) && (st.st_dev == fst.st_dev) && (st.st_ino == fst.st_ino))
+        {
+            FREE(m->entries[i].path);
+            FREE(m->entries[i].target);
+            memmove(&m->entries[i], &m->entries[i + 1],
+                    (m->count - i - 1) * sizeof(manifest_entry_t));
+            m->count--;
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+void manifest_release(manifest_t *m)
+{
+    unsigned long i;
+
+    if (!m)
+        return;
+    for (i = 0; i < m->count; i++)
+    {
+        FREE(m->entries[i].path);
+        FREE(m->entries[i].target);
+    }
+    FREE(m->entries);
+    m->count = m->alloc = 0;
+}
@@ -0,0 +1,100 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_MANIFEST_H_
+#define _SPG_MANIFEST_H_
+
+/*
+ * Manifest of a directory tree - one line per regular file:
+ *   <hex digest> <size> <path>
+ * and per symbolic link, which is not followed:
+ *   l <target length> <target> <path>
+ * sorted by the path, which is relative to the directory. It starts
+ * with the version and the hash of the file digests:
+ *   SPG-Manifest: 1
+ *   Hash: sha256
+ * Signing the manifest once covers all the files. The files are hashed
+ * in parallel, each file by one thread
+ */
+#define MANIFEST_MAGIC "SPG-Manifest: 1\n"
+
+typedef struct manifest_entry_s
+{
+    char *path;
+    char *target;                     /* link target, NULL for a file */
+    unsigned long long size;          /* target length for a link */
+    unsigned char digest[SHA512_LEN];
+    status stat;                      /* result of hashing the file */
+} manifest_entry_t;
+
+typedef struct manifest_s
+{
+    int md_algo;
+    unsigned int dlen;
+    manifest_entry_t *entries;
+    unsigned long count;
+    unsigned long alloc;
+} manifest_t;
+
+/*
+ * Function: manifest_scan
+ * Lists regular files and symbolic links under dir, the links are
+ * not followed
+ */
+status manifest_scan(manifest_t *m, const char *dir, int md_algo);
+
+/*
+ * Function: manifest_remove_file
+ * Takes file off the list if it is in the scanned directory,
+ * so the manifest can be stored in the directory it describes
+ */
+status manifest_remove_file(manifest_t *m, const char *dir, const char *file);
+
+/*
+ * Function: manifest_hash
+ * Hashes the listed files on threads workers, 0 means one per CPU.
+ * Files that could not be read have their stat set. Links are not
+ * hashed, their target is compared
+ */
+status manifest_hash(manifest_t *m, const char *dir, unsigned int threads);
+
+/*
+ * Function: manifest_format
+ * Writes the manifest text into newly allocated buffer
+ */
+status manifest_format(const manifest_t *m, const char *hash_name,
+                       char **text, size_t *len);
+
+/*
+ * Function: manifest_hash_name
+ * Gets name of the hash of the file digests from the manifest text
+ */
+status manifest_hash_name(const char *text, size_t len,
+                          char *hash_name, size_t hash_name_len);
+
+/*
+ * Function: manifest_parse
+ * Reads the manifest text with md_algo file digests
+ */
+status manifest_parse(manifest_t *m, const char *text, size_t len, int md_algo);
+
+/*
+ * Function: manifest_release
+ */
+void manifest_release(manifest_t *m);
+
+#endif /* _SPG_MANIFEST_H_ */
@@ -0,0 +1,382 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <gcrypt.h>
+#include "defs.h"
+#include "mb_hash.h"
+
+/*
+ * Build the lane functions for AVX2 as well and pick at run time
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define MB_TARGET __attribute__((target_clones("avx2", "default")))
+#define MB_HAVE_SHA_INSN() __builtin_cpu_supports("sha")
+#else
+#define MB_TARGET
+#define MB_HAVE_SHA_INSN() 0
+#endif
+
+typedef uint32_t v8u32 __attribute__((vector_size(MB_SHA256_LANES * 4)));
+typedef uint64_t v4u64 __attribute__((vector_size(MB_SHA512_LANES * 8)));
+
+#define MB_MAX_BLOCK 128
+
+/*
+ * One message in a lane. Full blocks are read straight from the message,
+ * the rest of it with the padding is in tail
+ */
+typedef struct mb_lane_s
+{
+    const unsigned char *msg;
+    unsigned long idx;      /* message index in the batch */
+    size_t full;            /* number of full blocks in the message */
+    size_t blocks;          /* number of blocks with padding */
+    size_t block;           /* next block */
+    int busy;
+    unsigned char tail[2 * MB_MAX_BLOCK];
+} mb_lane_t;
+
+static const uint32_t sha256_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t sha512_iv[8] =
+{
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint64_t sha512_k[80] =
+{
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const unsigned char mb_zero_block[MB_MAX_BLOCK];
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/*
+ * Puts message into the lane. len_size is the size of the length
+ * field in the padding - 8 bytes for SHA-256 and 16 for SHA-512
+ */
+static void mb_lane_start(mb_lane_t *lane, const void *msg, size_t len,
+                          unsigned long idx, size_t block_size, size_t len_size)
+{
+    size_t rem = len % block_size;
+    size_t tail_len = (rem + 1 + len_size <= block_size) ? block_size : 2 * block_size;
+    uint64_t bits = (uint64_t) len << 3;
+    unsigned int i;
+
+    lane->msg = msg;
+    lane->idx = idx;
+    lane->full = len / block_size;
+    lane->blocks = lane->full + tail_len / block_size;
+    lane->block = 0;
+    lane->busy = 1;
+
+    memset(lane->tail, 0, tail_len);
+    if (rem)
+        memcpy(lane->tail, (const unsigned char *) msg + lane->full * block_size, rem);
+    lane->tail[rem] = 0x80;
+    for (i = 0; i < 8; i++)
+        lane->tail[tail_len - 1 - i] = (unsigned char) (bits >> (8 * i));
+    /*
+     * The top bits of the 128 bit SHA-512 length stay 0, size_t is not that big
+     */
+    if (len_size > 8)
+        lane->tail[tail_len - 9] |= (unsigned char) ((uint64_t) len >> 61);
+}
+
+static inline const unsigned char *mb_lane_block(const mb_lane_t *lane, size_t block_size)
+{
+    if (!lane->busy)
+        return mb_zero_block;
+    if (lane->block < lane->full)
+        return lane->msg + lane->block * block_size;
+    return lane->tail + (lane->block - lane->full) * block_size;
+}
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+/*
+ * One block of SHA-256 in each of the lanes
+ */
+MB_TARGET
+static void sha256_blocks(v8u32 st[8], const unsigned char *const blocks[MB_SHA256_LANES])
+{
+    v8u32 w[16];
+    v8u32 a = st[0], b = st[1], c = st[2], d = st[3];
+    v8u32 e = st[4], f = st[5], g = st[6], h = st[7];
+    v8u32 t1, t2;
+    unsigned int t, l;
+
+    for (t = 0; t < 16; t++)
+    {
+        for (l = 0; l < MB_SHA256_LANES; l++)
+            w[t][l] = get_be32(blocks[l] + 4 * t);
+    }
+    for (t = 0; t < 64; t++)
+    {
+        if (t >= 16)
+        {
+            v8u32 w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+
+            w[t & 15] += (ROR32(w2, 17) ^ ROR32(w2, 19) ^ (w2 >> 10)) + w[(t - 7) & 15] +
+                         (ROR32(w15, 7) ^ ROR32(w15, 18) ^ (w15 >> 3));
+        }
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+             sha256_k[t] + w[t & 15];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+    st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+/*
+ * One block of SHA-512 in each of the lanes
+ */
+MB_TARGET
+static void sha512_blocks(v4u64 st[8], const unsigned char *const blocks[MB_SHA512_LANES])
+{
+    v4u64 w[16];
+    v4u64 a = st[0], b = st[1], c = st[2], d = st[3];
+    v4u64 e = st[4], f = st[5], g = st[6], h = st[7];
+    v4u64 t1, t2;
+    unsigned int t, l;
+
+    for (t = 0; t < 16; t++)
+    {
+        for (l = 0; l < MB_SHA512_LANES; l++)
+            w[t][l] = get_be64(blocks[l] + 8 * t);
+    }
+    for (t = 0; t < 80; t++)
+    {
+        if (t >= 16)
+        {
+            v4u64 w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+
+            w[t & 15] += (ROR64(w2, 19) ^ ROR64(w2, 61) ^ (w2 >> 6)) + w[(t - 7) & 15] +
+                         (ROR64(w15, 1) ^ ROR64(w15, 8) ^ (w15 >> 7));
+        }
+        t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) + ((e & f) ^ (~e & g)) +
+             sha512_k[t] + w[t & 15];
+        t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+    st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+/*
+ * Keep all the lanes busy till there are no messages left.
+ * A lane that is done stores its digest and starts on the next message
+ */
+static void mb_sha256(const void *const *msgs, const size_t *lens,
+                      unsigned int count, unsigned char *digests)
+{
+    mb_lane_t lanes[MB_SHA256_LANES];
+    const unsigned char *blocks[MB_SHA256_LANES];
+    v8u32 st[8];
+    unsigned int next = 0, busy, l, i;
+
+    memset(lanes, 0, sizeof(lanes));
+    while (1)
+    {
+        for (l = 0, busy = 0; l < MB_SHA256_LANES; l++)
+        {
+            if (!lanes[l].busy && (next < count))
+            {
+                mb_lane_start(&lanes[l], msgs[next], lens[next], next, 64, 8);
+                for (i = 0; i < 8; i++)
+                    st[i][l] = sha256_iv[i];
+                next++;
+            }
+            busy += lanes[l].busy;
+            blocks[l] = mb_lane_block(&lanes[l], 64);
+        }
+        if (!busy)
+            break;
+
+        sha256_blocks(st, blocks);
+
+        for (l = 0; l < MB_SHA256_LANES; l++)
+        {
+            if (lanes[l].busy && (++lanes[l].block == lanes[l].blocks))
+            {
+                unsigned char *out = digests + lanes[l].idx * 32;
+
+                for (i = 0; i < 8; i++)
+                {
+                    out[4 * i] = st[i][l] >> 24;
+                    out[4 * i + 1] = st[i][l] >> 16;
+                    out[4 * i + 2] = st[i][l] >> 8;
+                    out[4 * i + 3] = st[i][l];
+                }
+                lanes[l].busy = 0;
+            }
+        }
+    }
+}
+
+static void mb_sha512(const void *const *msgs, const size_t *lens,
+                      unsigned int count, unsigned char *digests)
+{
+    mb_lane_t lanes[MB_SHA512_LANES];
+    const unsigned char *blocks[MB_SHA512_LANES];
+    v4u64 st[8];
+    unsigned int next = 0, busy, l, i, j;
+
+    memset(lanes, 0, sizeof(lanes));
+    while (1)
+    {
+        for (l = 0, busy = 0; l < MB_SHA512_LANES; l++)
+        {
+            if (!lanes[l].busy && (next < count))
+            {
+                mb_lane_start(&lanes[l], msgs[next], lens[next], next, 128, 16);
+                for (i = 0; i < 8; i++)
+                    st[i][l] = sha512_iv[i];
+                next++;
+            }
+            busy += lanes[l].busy;
+            blocks[l] = mb_lane_block(&lanes[l], 128);
+        }
+        if (!busy)
+            break;
+
+        sha512_blocks(st, blocks);
+
+        for (l = 0; l < MB_SHA512_LANES; l++)
+        {
+            if (lanes[l].busy && (++lanes[l].block == lanes[l].blocks))
+            {
+                unsigned char *out = digests + lanes[l].idx * 64;
+
+                for (i = 0; i < 8; i++)
+                {
+                    for (j = 0; j < 8; j++)
+                        out[8 * i + j] = st[i][l] >> (56 - 8 * j);
+                }
+                lanes[l].busy = 0;
+            }
+        }
+    }
+}
+
+status mb_hash(int md_algo, const void *const *msgs, const size_t *lens,
+               unsigned int count, unsigned char *digests)
+{
+    gcry_md_hd_t hash;
+    unsigned int dlen = gcry_md_get_algo_dlen(md_algo);
+    unsigned int i;
+
+    CHECK_PARAM(msgs);
+    CHECK_PARAM(lens);
+    CHECK_PARAM(digests);
+
+    /*
+     * With the SHA instructions one SHA-256 stream in gcrypt is faster
+     * than 8 lanes of generic vector code
+     */
+    if ((GCRY_MD_SHA256 == md_algo) && !MB_HAVE_SHA_INSN())
+    {
+        mb_sha256(msgs, lens, count, digests);
+        return SUCCESS;
+    }
+    if (GCRY_MD_SHA512 == md_algo)
+    {
+        mb_sha512(msgs, lens, count, digests);
+        return SUCCESS;
+    }
+    if (gcry_md_open(&hash, md_algo, 0) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hash function failed\n");
+        return FAIL;
+    }
+    for (i = 0; i < count; i++)
+    {
+        gcry_md_write(hash, msgs[i], lens[i]);
+        memcpy(digests + (size_t) i * dlen, gcry_md_read(hash, 0), dlen);
+        gcry_md_reset(hash);
+    }
+    gcry_md_close(hash);
+    return SUCCESS;
+}
@@ -0,0 +1,40 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_MB_HASH_H_
+#define _SPG_MB_HASH_H_
+
+/*
+ * Multi-buffer hashing of batches of independent messages.
+ * SHA-256 runs 8 messages and SHA-512 4 messages side by side, one per
+ * SIMD lane, so a batch of small records doesn't pay a hash context
+ * setup per record and keeps the vector unit busy. A lane that finishes
+ * its message picks up the next one, so the lengths don't have to match.
+ * Other hashes go through one gcrypt context reused for the whole batch.
+ */
+#define MB_SHA256_LANES 8
+#define MB_SHA512_LANES 4
+
+/*
+ * Function: mb_hash
+ * Hashes count messages with md_algo. Digest of message i is stored
+ * at digests + i * gcry_md_get_algo_dlen(md_algo)
+ */
+status mb_hash(int md_algo, const void *const *msgs, const size_t *lens,
+               unsigned int count, unsigned char *digests);
+
+#endif /* _SPG_MB_HASH_H_ */
@@ -0,0 +1,805 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gcrypt.h>
+#include "defs.h"
+#include "file_io.h"
+#include "thread_pool.h"
+#include "merkle.h"
+
+#define SHA256_LEN 32
+
+/*
+ * Leaf hashes of the file being processed
+ */
+typedef struct merkle_leaves_s
+{
+    int md_algo;
+    unsigned int dlen;
+    size_t chunk;
+    const unsigned char *data; /* mapped file, NULL when read */
+    size_t size;
+    unsigned long count;
+    unsigned long next;        /* next leaf to hash, taken atomically */
+    unsigned long alloc;
+    unsigned char *hashes;
+    unsigned long *todo;       /* leaves to hash, NULL - all of them */
+    unsigned long todo_count;
+} merkle_leaves_t;
+
+static void merkle_hash_leaf(int md_algo, unsigned char *out,
+                             const void *data, size_t len)
+{
+    unsigned char prefix = MERKLE_LEAF_PREFIX;
+    gcry_buffer_t iov[2];
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].data = &prefix;
+    iov[0].len = 1;
+    iov[1].data = (void *) data;
+    iov[1].len = len;
+    gcry_md_hash_buffers(md_algo, 0, out, iov, 2);
+}
+
+static void merkle_hash_node(int md_algo, unsigned int dlen, unsigned char *out,
+                             const unsigned char *left, const unsigned char *right)
+{
+    unsigned char prefix = MERKLE_NODE_PREFIX;
+    gcry_buffer_t iov[3];
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].data = &prefix;
+    iov[0].len = 1;
+    iov[1].data = (void *) left;
+    iov[1].len = dlen;
+    iov[2].data = (void *) right;
+    iov[2].len = dlen;
+    gcry_md_hash_buffers(md_algo, 0, out, iov, 3);
+}
+
+/*
+ * Thread pool task - hashes leaves of the mapped file till there is none left.
+ * Every worker takes the next leaf, so they all stay close to each other
+ * in the file and the read ahead keeps working
+ */
+static void merkle_leaves_task(void *arg)
+{
+    merkle_leaves_t *l = arg;
+    unsigned long n;
+
+    while ((n = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->todo_count)
+    {
+        unsigned long i = l->todo ? l->todo[n] : n;
+        size_t off = (size_t) i * l->chunk;
+        size_t len = l->size - off;
+
+        if (len > l->chunk)
+            len = l->chunk;
+        merkle_hash_leaf(l->md_algo, l->hashes + (size_t) i * l->dlen,
+                         l->data + off, len);
+    }
+}
+
+/*
+ * file_io callback for files that can not be mapped. Each full chunk
+ * is one leaf
+ */
+static status merkle_leaf_cb(void *ctx, const void *data, size_t len)
+{
+    merkle_leaves_t *l = ctx;
+
+    if (l->count == l->alloc)
+    {
+        unsigned long alloc = l->alloc ? l->alloc * 2 : 64;
+        unsigned char *hashes = realloc(l->hashes, (size_t) alloc * l->dlen);
+
+        if (!hashes)
+        {
+            ERROR_LOG("Memory allocation failed\n");
+            return FAIL;
+        }
+        l->hashes = hashes;
+        l->alloc = alloc;
+    }
+    merkle_hash_leaf(l->md_algo, l->hashes + (size_t) l->count * l->dlen,
+                     data, len);
+    l->count++;
+    return SUCCESS;
+}
+
+/*
+ * Hashes the leaves of the mapped file listed in l->todo on threads workers.
+ * l->hashes has to be allocated for all the leaves
+ */
+static void merkle_hash_mapped(merkle_leaves_t *l, unsigned int threads)
+{
+    thread_pool_t *pool = NULL;
+    unsigned int i;
+
+    if (!threads)
+        threads = thread_pool_cpus();
+    if (threads > l->todo_count)
+        threads = l->todo_count;
+
+    if ((threads > 1) && (thread_pool_create(&pool, threads) == SUCCESS))
+    {
+        for (i = 0; i < threads; i++)
+        {
+            if (thread_pool_submit(pool, merkle_leaves_task, l) != SUCCESS)
+                break;
+        }
+        thread_pool_destroy(pool);
+    }
+    /*
+     * Picks up whatever is left if the pool could not be used
+     */
+    merkle_leaves_task(l);
+}
+
+/*
+ * Go up the tree level by level, in place
+ */
+static void merkle_root(merkle_leaves_t *l, unsigned char *root)
+{
+    unsigned long n;
+
+    for (n = l->count; n > 1; n = (n + 1) / 2)
+    {
+        unsigned long i;
+
+        for (i = 0; i < n / 2; i++)
+        {
+            merkle_hash_node(l->md_algo, l->dlen, l->hashes + i * l->dlen,
+                             l->hashes + (2 * i) * l->dlen,
+                             l->hashes + (2 * i + 1) * l->dlen);
+        }
+        if (n & 1)
+        {
+            memmove(l->hashes + (n / 2) * l->dlen,
+                    l->hashes + (n - 1) * l->dlen, l->dlen);
+        }
+    }
+    memcpy(root, l->hashes, l->dlen);
+}
+
+static status merkle_leaves_init(merkle_leaves_t *l, int md_algo, size_t chunk)
+{
+    if (!chunk || (chunk > MERKLE_MAX_CHUNK_SIZE))
+    {
+        ERROR_LOG("Invalid Merkle tree chunk size %lu\n", (unsigned long) chunk);
+        return BAD_PARAMS;
+    }
+    memset(l, 0, sizeof(merkle_leaves_t));
+    l->md_algo = md_algo;
+    l->dlen = gcry_md_get_algo_dlen(md_algo);
+    l->chunk = chunk;
+    if (!l->dlen)
+    {
+        ERROR_LOG("Invalid hash algorithm\n");
+        return BAD_PARAMS;
+    }
+    return SUCCESS;
+}
+
+status merkle_digest_fd(int fd, int md_algo, size_t chunk,
+                        unsigned int threads, unsigned char *root)
+{
+    status stat = SUCCESS;
+    merkle_leaves_t l;
+    file_io_map_t m;
+
+    CHECK_PARAM(root);
+
+    if ((stat = merkle_leaves_init(&l, md_algo, chunk)) != SUCCESS)
+        return stat;
+
+    if (file_io_map_fd(fd, &m) == SUCCESS)
+    {
+        l.data = m.data;
+        l.size = m.size;
+        l.count = (l.size + l.chunk - 1) / l.chunk;
+        l.todo_count = l.count;
+        l.hashes = malloc((size_t) l.count * l.dlen);
+        if (l.hashes)
+        {
+            merkle_hash_mapped(&l, threads);
+        }
+        else
+        {
+            ERROR_LOG("Memory allocation failed\n");
+            stat = FAIL;
+        }
+        file_io_unmap(&m);
+    }
+    else
+    {
+        stat = file_io_process_fd(fd, chunk, merkle_leaf_cb, &l);
+        if ((SUCCESS == stat) && !l.count)
+        {
+            /*
+             * Empty file - one empty leaf
+             */
+            stat = merkle_leaf_cb(&l, NULL, 0);
+        }
+    }
+    if (SUCCESS == stat)
+    {
+        merkle_root(&l, root);
+    }
+    FREE(l.hashes);
+    return stat;
+}
+
+/*
+ * Chunk cache file.
+ * All numbers are big endian
+ *   0 magic "SPGC"
+ *   4 u16 version
+ *   6 u16 hash algorithm
+ *   8 u16 digest length
+ *  12 u32 chunk size
+ *  16 u64 file size
+ *  24 u64 file mtime seconds
+ *  32 u32 file mtime nanoseconds
+ *  40 u64 file inode
+ *  48 u64 number of leaves
+ *  56 u64 file ctime seconds
+ *  64 u32 file ctime nanoseconds
+ *  72 SHA-256 of the header up to here and the leaves
+ * 104 leaf hashes
+ * The mtime can be set back after the file is rewritten, the ctime can't.
+ * Version 1 had no ctime and is not read any more
+ */
+#define MERKLE_CACHE_MAGIC "SPGC"
+#define MERKLE_CACHE_VERSION 2
+#define MERKLE_CACHE_SUM_OFFSET 72
+#define MERKLE_CACHE_HEADER_SIZE 104
+
+typedef struct merkle_cache_s
+{
+    int md_algo;
+    unsigned int dlen;
+    unsigned long chunk;
+    unsigned long long size;
+    unsigned long long mtime_sec;
+    unsigned long mtime_nsec;
+    unsigned long long ctime_sec;
+    unsigned long ctime_nsec;
+    unsigned long long ino;
+    unsigned long count;
+    unsigned char *hashes;
+} merkle_cache_t;
+
+static void put_be(unsigned char *p, unsigned long long v, unsigned int len)
+{
+    while (len--)
+    {
+        p[len] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static unsigned long long get_be(const unsigned char *p, unsigned int len)
+{
+    unsigned long long v = 0;
+
+    while (len--)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+static status merkle_cache_checksum(unsigned char *sum, const unsigned char *header,
+                                    const unsigned char *hashes, size_t hashes_len)
+{
+    gcry_md_hd_t hash;
+
+    if (gcry_md_open(&hash, GCRY_MD_SHA256, 0) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hash function failed\n");
+        return FAIL;
+    }
+    gcry_md_write(hash, header, MERKLE_CACHE_SUM_OFFSET);
+    gcry_md_write(hash, hashes, hashes_len);
+    gcry_md_final(hash);
+    memcpy(sum, gcry_md_read(hash, 0), SHA256_LEN);
+    gcry_md_close(hash);
+    return SUCCESS;
+}
+
+/*
+ * Reads the cache. Anything that doesn't look right means there is no cache
+ */
+static status merkle_cache_read(merkle_cache_t *c, const char *file_name)
+{
+    unsigned char header[MERKLE_CACHE_HEADER_SIZE];
+    unsigned char sum[SHA256_LEN];
+    size_t hashes_len;
+    FILE *file;
+
+    memset(c, 0, sizeof(merkle_cache_t));
+    file = fopen(file_name, "rb");
+    if (!file)
+    {
+        LOG("No chunk cache %s\n", file_name);
+        return FAIL;
+    }
+    if ((fread(header, 1, 6, file) != 6) || memcmp(header, MERKLE_CACHE_MAGIC, 4))
+    {
+        ERROR_LOG("The file %s is not an SPG chunk cache\n", file_name);
+        fclose(file);
+        return FAIL;
+    }
+    if (get_be(header + 4, 2) != MERKLE_CACHE_VERSION)
+    {
+        LOG("The chunk cache %s is of an older version, all chunks are hashed\n", file_name);
+        fclose(file);
+        return FAIL;
+    }
+    if (fread(header + 6, 1, MERKLE_CACHE_HEADER_SIZE - 6, file) != MERKLE_CACHE_HEADER_SIZE - 6)
+    {
+        ERROR_LOG("The chunk cache %s is corrupted\n", file_name);
+        fclose(file);
+        return FAIL;
+    }
+    c->md_algo = (int) get_be(header + 6, 2);
+    c->dlen = (unsigned int) get_be(header + 8, 2);
+    c->chunk = (unsigned long) get_be(header + 12, 4);
+    c->size = get_be(header + 16, 8);
+    c->mtime_sec = get_be(header + 24, 8);
+    c->mtime_nsec = (unsigned long) get_be(header + 32, 4);
+    c->ino = get_be(header + 40, 8);
+    c->count = (unsigned long) get_be(header + 48, 8);
+    c->ctime_sec = get_be(header + 56, 8);
+    c->ctime_nsec = (unsigned long) get_be(header + 64, 4);
+
+    if (!c->chunk || !c->dlen || (c->dlen > SHA512_LEN) ||
+            (c->count != (c->size + c->chunk - 1) / c->chunk))
+    {
+        ERROR_LOG("The chunk cache %s is corrupted\n", file_name);
+        fclose(file);
+        return FAIL;
+    }
+    hashes_len = (size_t) c->count * c->dlen;
+    c->hashes = malloc(hashes_len ? hashes_len : 1);
+    if (!c->hashes)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        fclose(file);
+        return FAIL;
+    }
+    if ((fread(c->hashes, 1, hashes_len, file) != hashes_len) ||
+            (fgetc(file) != EOF) ||
+            (merkle_cache_checksum(sum, header, c->hashes, hashes_len) != SUCCESS) ||
+            memcmp(sum, header + MERKLE_CACHE_SUM_OFFSET, SHA256_LEN))
+    {
+        ERROR_LOG("The chunk cache %s is corrupted\n", file_name);
+        FREE(c->hashes);
+        fclose(file);
+        return FAIL;
+    }
+    fclose(file);
+    return SUCCESS;
+}
+
+static status merkle_cache_write(const merkle_leaves_t *l, const struct stat *st,
+                                 const char *file_name)
+{
+    status stat = SUCCESS;
+    unsigned char header[MERKLE_CACHE_HEADER_SIZE];
+    size_t hashes_len = (size_t) l->count * l->dlen;
+    char tmp_name[MAX_FILE_NAME_SIZE + 16];
+    FILE *file;
+
+    memset(header, 0, MERKLE_CACHE_HEADER_SIZE);
+    memcpy(header, MERKLE_CACHE_MAGIC, 4);
+    put_be(header + 4, MERKLE_CACHE_VERSION, 2);
+    put_be(header + 6, l->md_algo, 2);
+    put_be(header + 8, l->dlen, 2);
+    put_be(header + 12, l->chunk, 4);
+    put_be(header + 16, st->st_size, 8);
+    put_be(header + 24, st->st_mtim.tv_sec, 8);
+    put_be(header + 32, st->st_mtim.tv_nsec, 4);
+    put_be(header + 40, st->st_ino, 8);
+    put_be(header + 48, l->count, 8);
+    put_be(header + 56, st->st_ctim.tv_sec, 8);
+    put_be(header + 64, st->st_ctim.tv_nsec, 4);
+    if ((stat = merkle_cache_checksum(header + MERKLE_CACHE_SUM_OFFSET, header,
+                                      l->hashes, hashes_len)) != SUCCESS)
+    {
+        return stat;
+    }
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int) getpid());
+    file = fopen(tmp_name, "wb");
+    if (!file)
+    {
+        ERROR_LOG("Can not create file %s.\n", tmp_name);
+        return FAIL;
+    }
+    if ((fwrite(header, 1, MERKLE_CACHE_HEADER_SIZE, file) != MERKLE_CACHE_HEADER_SIZE) ||
+            (fwrite(l->hashes, 1, hashes_len, file) != hashes_len))
+    {
+        ERROR_LOG("Filed to write chunk cache to %s file\n", tmp_name);
+        stat = FAIL;
+    }
+    if (fclose(file))
+        stat = FAIL;
+    if ((SUCCESS == stat) && rename(tmp_name, file_name))
+    {
+        ERROR_LOG("Can not create file %s.\n", file_name);
+        stat = FAIL;
+    }
+    if (SUCCESS != stat)
+        remove(tmp_name);
+    else
+        LOG("Chunk cache written to %s file\n", file_name);
+    return stat;
+}
+
+/*
+ * Works out which leaves have to be hashed again. The others
+ * are copied from the cache
+ */
+static void merkle_cache_todo(merkle_leaves_t *l, const merkle_cache_t *c,
+                              const struct stat *st,
+                              const merkle_range_t *changed, unsigned int changed_count)
+{
+    unsigned long long size = (unsigned long long) st->st_size;
+    unsigned long i, keep = 0; /* leaves below keep come from the cache */
+    int unmodified = 0;
+    unsigned int r;
+
+    if ((c->md_algo == l->md_algo) && (c->dlen == l->dlen) && (c->chunk == l->chunk))
+    {
+        unmodified = (c->size == size) &&
+                     (c->mtime_sec == (unsigned long long) st->st_mtim.tv_sec) &&
+                     (c->mtime_nsec == (unsigned long) st->st_mtim.tv_nsec) &&
+                     (c->ctime_sec == (unsigned long long) st->st_ctim.tv_sec) &&
+                     (c->ctime_nsec == (unsigned long) st->st_ctim.tv_nsec) &&
+                     (c->ino == (unsigned long long) st->st_ino);
+        if (unmodified)
+        {
+            LOG("File not modified since the chunk cache was written\n");
+            keep = l->count;
+        }
+        else if (changed_count)
+        {
+            /*
+             * Only the given ranges changed. If the size changed
+             * too the old last chunk and everything after it is new
+             */
+            if (c->size == size)
+                keep = c->count;
+            else
+                keep = (unsigned long) (((c->size < size) ? c->size : size) / l->chunk);
+        }
+    }
+    if (keep > l->count)
+        keep = l->count;
+    memcpy(l->hashes, c->hashes, (size_t) keep * l->dlen);
+
+    l->todo_count = 0;
+    for (i = 0; i < l->count; i++)
+    {
+        int dirty = (i >= keep);
+
+        for (r = 0; !dirty && !unmodified && (r < changed_count); r++)
+        {
+            unsigned long long off = (unsigned long long) i * l->chunk;
+
+            dirty = changed[r].len && (changed[r].off < off + l->chunk) &&
+                    (off < changed[r].off + changed[r].len);
+        }
+        if (dirty)
+            l->todo[l->todo_count++] = i;
+    }
+    LOG("Hashing %lu of %lu chunks\n", l->todo_count, l->count);
+}
+
+status merkle_digest_cached(int fd, int md_algo, size_t chunk, unsigned int threads,
+                            const char *cache_file,
+                            const merkle_range_t *changed, unsigned int changed_count,
+                            unsigned char *root)
+{
+    status stat = SUCCESS;
+    merkle_leaves_t l;
+    merkle_cache_t c;
+    file_io_map_t m;
+    struct stat st, st_after;
+
+    CHECK_PARAM(cache_file);
+    CHECK_PARAM(root);
+
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) ||
+            (lseek(fd, 0, SEEK_CUR) != 0) ||
+            (file_io_map_fd(fd, &m) != SUCCESS))
+    {
+        /*
+         * Only whole regular files can be cached
+         */
+        return merkle_digest_fd(fd, md_algo, chunk, threads, root);
+    }
+    if ((stat = merkle_leaves_init(&l, md_algo, chunk)) != SUCCESS)
+    {
+        file_io_unmap(&m);
+        return stat;
+    }
+    l.data = m.data;
+    l.size = m.size;
+    l.count = (l.size + l.chunk - 1) / l.chunk;
+    l.hashes = malloc((size_t) l.count * l.dlen);
+    l.todo = malloc((size_t) l.count * sizeof(unsigned long));
+    if (!l.hashes || !l.todo)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        FREE(l.hashes);
+        FREE(l.todo);
+        file_io_unmap(&m);
+        return FAIL;
+    }
+
+    if (merkle_cache_read(&c, cache_file) == SUCCESS)
+    {
+        merkle_cache_todo(&l, &c, &st, changed, changed_count);
+        FREE(c.hashes);
+    }
+    else
+    {
+        FREE(l.todo);
+        l.todo_count = l.count;
+    }
+    merkle_hash_mapped(&l, threads);
+    file_io_unmap(&m);
+
+    /*
+     * Don't cache the leaves if the file changed under us
+     */
+    if ((fstat(fd, &st_after) == 0) &&
+            (st_after.st_size == st.st_size) &&
+            (st_after.st_mtim.tv_sec == st.st_mtim.tv_sec) &&
+            (st_after.st_mtim.tv_nsec == st.st_mtim.tv_nsec) &&
+            (st_after.st_ctim.tv_sec == st.st_ctim.tv_sec) &&
+            (st_after.st_ctim.tv_nsec == st.st_ctim.tv_nsec))
+    {
+        merkle_cache_write(&l, &st, cache_file);
+    }
+    else
+    {
+        INFO_LOG("File %s changed while it was hashed, chunk cache not updated\n", cache_file);
+    }
+
+    merkle_root(&l, root);
+    FREE(l.hashes);
+    FREE(l.todo);
+    return stat;
+}
+
+status merkle_parse_ranges(const char *str, merkle_range_t **ranges,
+                           unsigned int *count)
+{
+    merkle_range_t *r = NULL;
+    unsigned int n = 1, i = 0;
+    const char *p;
+    char *end;
+
+    CHECK_PARAM(str);
+    CHECK_PARAM(ranges);
+    CHECK_PARAM(count);
+
+    for (p = str; *p; p++)
+    {
+        if (*p == ',')
+            n++;
+    }
+    r = calloc(n, sizeof(merkle_range_t));
+    if (!r)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    for (p = str; i < n; i++)
+    {
+        r[i].off = strtoull(p, &end, 0);
+        if ((end == p) || (*end != ':'))
+            break;
+        p = end + 1;
+        r[i].len = strtoull(p, &end, 0);
+        if ((end == p) || ((*end != ',') && (*end != '\0')))
+            break;
+        p = end + 1;
+    }
+    if (i != n)
+    {
+        ERROR_LOG("Invalid range list %s, expected OFFSET:LENGTH[,OFFSET:LENGTH...]\n", str);
+        free(r);
+        return BAD_PARAMS;
+    }
+    *ranges = r;
+    *count = n;
+    return SUCCESS;
+}
+
+/*
+ * Number of tree nodes over count leaves, all levels
+ */
+static unsigned long merkle_batch_nodes(unsigned long count)
+{
+    unsigned long n, total = 0;
+
+    for (n = count; n > 1; n = (n + 1) / 2)
+        total += n;
+    return total + 1;
+}
+
+status merkle_batch_init(merkle_batch_t *b, int md_algo, unsigned long count)
+{
+    CHECK_PARAM(b);
+
+    memset(b, 0, sizeof(merkle_batch_t));
+    b->md_algo = md_algo;
+    b->dlen = gcry_md_get_algo_dlen(md_algo);
+    b->count = count;
+    if (!b->dlen)
+    {
+        ERROR_LOG("Invalid hash algorithm\n");
+        return BAD_PARAMS;
+    }
+    if (!count)
+    {
+        ERROR_LOG("Empty batch\n");
+        return BAD_PARAMS;
+    }
+    b->nodes = malloc((size_t) merkle_batch_nodes(count) * b->dlen);
+    if (!b->nodes)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+status merkle_batch_leaf(merkle_batch_t *b, unsigned long index,
+                         const void *data, size_t len)
+{
+    CHECK_PARAM(b);
+    CHECK_PARAM(b->nodes);
+
+    if (index >= b->count)
+    {
+        ERROR_LOG("Record %lu out of batch of %lu\n", index, b->count);
+        return BAD_PARAMS;
+    }
+    merkle_hash_leaf(b->md_algo, b->nodes + (size_t) index * b->dlen, data, len);
+    return SUCCESS;
+}
+
+status merkle_batch_root(merkle_batch_t *b, unsigned char *root)
+{
+    unsigned char *level;
+    unsigned long n;
+
+    CHECK_PARAM(b);
+    CHECK_PARAM(b->nodes);
+    CHECK_PARAM(root);
+
+    for (level = b->nodes, n = b->count; n > 1; level += (size_t) n * b->dlen, n = (n + 1) / 2)
+    {
+        unsigned char *up = level + (size_t) n * b->dlen;
+        unsigned long i;
+
+        for (i = 0; i < n / 2; i++)
+        {
+            merkle_hash_node(b->md_algo, b->dlen, up + i * b->dlen,
+                             level + (2 * i) * b->dlen, level + (2 * i + 1) * b->dlen);
+        }
+        if (n & 1)
+        {
+            memcpy(up + (n / 2) * b->dlen, level + (n - 1) * b->dlen, b->dlen);
+        }
+    }
+    memcpy(root, level, b->dlen);
+    return SUCCESS;
+}
+
+status merkle_batch_proof(const merkle_batch_t *b, unsigned long index,
+                          unsigned char *proof, unsigned int *proof_count)
+{
+    const unsigned char *level;
+    unsigned long n;
+    unsigned int k = 0;
+
+    CHECK_PARAM(b);
+    CHECK_PARAM(b->nodes);
+    CHECK_PARAM(proof);
+    CHECK_PARAM(proof_count);
+
+    if (index >= b->count)
+    {
+        ERROR_LOG("Record %lu out of batch of %lu\n", index, b->count);
+        return BAD_PARAMS;
+    }
+    for (level = b->nodes, n = b->count; n > 1; level += (size_t) n * b->dlen, n = (n + 1) / 2)
+    {
+        /*
+         * The last node of odd level has no pair, it goes up as it is
+         */
+        if ((index ^ 1) < n)
+        {
+            memcpy(proof + (size_t) k * b->dlen, level + (index ^ 1) * b->dlen, b->dlen);
+            k++;
+        }
+        index /= 2;
+    }
+    *proof_count = k;
+    return SUCCESS;
+}
+
+void merkle_batch_release(merkle_batch_t *b)
+{
+    if (b)
+    {
+        FREE(b->nodes);
+    }
+}
+
+status merkle_proof_root(int md_algo, const void *data, size_t len,
+                         unsigned long index, unsigned long count,
+                         const unsigned char *proof, unsigned int proof_count,
+                         unsigned char *root)
+{
+    unsigned char node[SHA512_LEN];
+    unsigned int dlen = gcry_md_get_algo_dlen(md_algo);
+    unsigned int k = 0;
+    unsigned long n;
+
+    CHECK_PARAM(root);
+
+    if (!dlen || (dlen > SHA512_LEN) || (index >= count))
+    {
+        ERROR_LOG("Invalid inclusion proof\n");
+        return BAD_PARAMS;
+    }
+    merkle_hash_leaf(md_algo, root, data, len);
+    for (n = count; n > 1; n = (n + 1) / 2)
+    {
+        if ((index ^ 1) < n)
+        {
+            if (k == proof_count)
+                break;
+            if (index & 1)
+                merkle_hash_node(md_algo, dlen, node, proof + (size_t) k * dlen, root);
+            else
+                merkle_hash_node(md_algo, dlen, node, root, proof + (size_t) k * dlen);
+            memcpy(root, node, dlen);
+            k++;
+        }
+        index /= 2;
+    }
+    if ((n > 1) || (k != proof_count))
+    {
+        ERROR_LOG("Inclusion proof doesn't match the batch size\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,142 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_MERKLE_H_
+#define _SPG_MERKLE_H_
+
+/*
+ * Merkle tree digest of a file.
+ * The file is split into fixed size chunks, the last one may be shorter.
+ * leaf = H(0x00 || chunk)
+ * node = H(0x01 || left || right)
+ * A node without a pair is moved one level up as it is. An empty file
+ * has one empty leaf. The leaves are hashed in parallel, so the digest
+ * of a big file scales with the number of cores.
+ */
+#define MERKLE_CHUNK_SIZE 0x100000 /*1M Bytes*/
+#define MERKLE_MAX_CHUNK_SIZE 0x40000000 /*1G Bytes*/
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+/*
+ * Function: merkle_digest_fd
+ * Computes the tree root over the file from its current position using
+ * md_algo hash. Leaves are hashed by threads workers, 0 means one per
+ * CPU. The root is gcry_md_get_algo_dlen(md_algo) bytes long
+ */
+status merkle_digest_fd(int fd, int md_algo, size_t chunk,
+                        unsigned int threads, unsigned char *root);
+
+/*
+ * Byte range of a file
+ */
+typedef struct merkle_range_s
+{
+    unsigned long long off;
+    unsigned long long len;
+} merkle_range_t;
+
+/*
+ * Function: merkle_digest_cached
+ * Same as merkle_digest_fd, but the leaf hashes are kept in cache_file
+ * between runs, so re-signing a big file that changed in a few places
+ * costs about the changed bytes:
+ * - if the size, mtime, ctime and inode of the file match the cache nothing
+ *   is hashed, so a file rewritten with its mtime set back is still hashed
+ * - otherwise if changed ranges are given only the leaves they touch are
+ *   hashed, plus the ones past the old or new end of the file
+ * - otherwise all the leaves are hashed
+ * The cache is rewritten afterwards. It is trusted the same way as the
+ * file itself, a wrong changed list gives a signature that doesn't verify.
+ * Anything other than a whole regular file is not cached
+ */
+status merkle_digest_cached(int fd, int md_algo, size_t chunk, unsigned int threads,
+                            const char *cache_file,
+                            const merkle_range_t *changed, unsigned int changed_count,
+                            unsigned char *root);
+
+/*
+ * Function: merkle_parse_ranges
+ * Parses OFFSET:LENGTH[,OFFSET:LENGTH...] list.
+ * The returned array has to be freed by the caller
+ */
+status merkle_parse_ranges(const char *str, merkle_range_t **ranges,
+                           unsigned int *count);
+
+/*
+ * Merkle tree over a batch of records, one record per leaf, hashed the
+ * same way as the file chunks above. One signature of the root covers
+ * the whole batch. The inclusion proof of a record is the list of
+ * hashes of its siblings on the way up to the root, at most
+ * MERKLE_MAX_PROOF of them, so checking a record costs a few hashes
+ * and one signature verify per batch
+ */
+#define MERKLE_MAX_PROOF 64
+
+typedef struct merkle_batch_s
+{
+    int md_algo;
+    unsigned int dlen;
+    unsigned long count;
+    unsigned char *nodes; /* all the levels of the tree, leaves first */
+} merkle_batch_t;
+
+/*
+ * Function: merkle_batch_init
+ * Allocates tree for count records
+ */
+status merkle_batch_init(merkle_batch_t *b, int md_algo, unsigned long count);
+
+/*
+ * Function: merkle_batch_leaf
+ * Hashes record number index into its leaf
+ */
+status merkle_batch_leaf(merkle_batch_t *b, unsigned long index,
+                         const void *data, size_t len);
+
+/*
+ * Function: merkle_batch_root
+ * Builds the rest of the tree once all the leaves are in, returns the root
+ */
+status merkle_batch_root(merkle_batch_t *b, unsigned char *root);
+
+/*
+ * Function: merkle_batch_proof
+ * Stores inclusion proof of record number index in proof, the number
+ * of hashes in proof_count. proof has room for MERKLE_MAX_PROOF hashes
+ */
+status merkle_batch_proof(const merkle_batch_t *b, unsigned long index,
+                          unsigned char *proof, unsigned int *proof_count);
+
+/*
+ * Function: merkle_batch_release
+ */
+void merkle_batch_release(merkle_batch_t *b);
+
+/*
+ * Function: merkle_proof_root
+ * Computes root of the batch from the record, its index, size of the
+ * batch and the inclusion proof. The record is in the batch if the root
+ * matches the signed one
+ */
+status merkle_proof_root(int md_algo, const void *data, size_t len,
+                         unsigned long index, unsigned long count,
+                         const unsigned char *proof, unsigned int proof_count,
+                         unsigned char *root);
+
+#endif /* _SPG_MERKLE_H_ */
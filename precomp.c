@@ -0,0 +1,337 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <gcrypt.h>
+#include "defs.h"
+#include "ec_point.h"
+#include "ecc.h"
+#include "curves.h"
+#include "precomp.h"
+
+#define SHA256_LEN 32
+
+static void put_be16(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static void put_be32(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static unsigned int get_be16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned int get_be32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Number of bytes for one coordinate on curve c
+ */
+static inline unsigned int coord_size(const curve *c)
+{
+    return (mpi_get_nbits(c->params.p) + 7) / 8;
+}
+
+/*
+ * SHA-256 of the table file - everything apart from the sum itself
+ */
+static status table_checksum(unsigned char *sum, const unsigned char *header,
+                             const unsigned char *points, size_t points_len)
+{
+    gcry_md_hd_t hash;
+
+    if (gcry_md_open(&hash, GCRY_MD_SHA256, 0) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Init hash function failed\n");
+        return FAIL;
+    }
+    gcry_md_write(hash, header, PRECOMP_SUM_OFFSET);
+    gcry_md_write(hash, points, points_len);
+    gcry_md_final(hash);
+    memcpy(sum, gcry_md_read(hash, 0), SHA256_LEN);
+    gcry_md_close(hash);
+    return SUCCESS;
+}
+
+/*
+ * Export big number as fixed width big endian number
+ */
+static status print_fixed(unsigned char *out, unsigned int out_len, big_number num)
+{
+    unsigned char buff[MAX_BIG_NUM_SIZE];
+    size_t len = 0;
+
+    if (gcry_mpi_print(GCRYMPI_FMT_USG, buff, MAX_BIG_NUM_SIZE, &len, num) != GPG_ERR_NO_ERROR ||
+            len > out_len)
+    {
+        ERROR_LOG("Filed to export data");
+        return FAIL;
+    }
+    memset(out, 0, out_len - len);
+    memcpy(out + out_len - len, buff, len);
+    return SUCCESS;
+}
+
+status precomp_table_write(const EC_point_table_t *t, precomp_type type,
+                           const curve *c, const char *file_name)
+{
+    status stat = SUCCESS;
+    unsigned char header[PRECOMP_HEADER_SIZE];
+    unsigned char *points = NULL;
+    unsigned int clen = coord_size(c);
+    size_t points_len = (size_t) t->d * 2 * clen;
+    char tmp_name[MAX_FILE_NAME_SIZE + 16];
+    unsigned int i = 0;
+    EC_point_t p;
+    FILE *file = NULL;
+
+    CHECK_PARAM(t);
+    CHECK_PARAM(c);
+    CHECK_PARAM(file_name);
+
+    if (strlen(c->name) >= PRECOMP_CURVE_NAME_SIZE)
+    {
+        ERROR_LOG("Curve name too long %s\n", c->name);
+        return FAIL;
+    }
+    points = malloc(points_len);
+    if (!points)
+    {
+        ERROR_LOG("Memory allocation failed to allocate %d bytes \n", (int) points_len);
+        return FAIL;
+    }
+    for (i = 0; (i < t->d) && (SUCCESS == stat); i++)
+    {
+        ec_point_table_get(t, i, &p);
+        stat = print_fixed(points + (2 * i) * clen, clen, p.x);
+        if (SUCCESS == stat)
+            stat = print_fixed(points + (2 * i + 1) * clen, clen, p.y);
+        ec_point_free(&p);
+    }
+    memset(header, 0, PRECOMP_HEADER_SIZE);
+    memcpy(header, PRECOMP_MAGIC, 4);
+    put_be16(header + 4, PRECOMP_VERSION);
+    header[6] = (unsigned char) type;
+    header[7] = (unsigned char) t->w;
+    put_be32(header + 8, t->d);
+    put_be32(header + 12, clen);
+    memcpy(header + 16, c->name, strlen(c->name));
+    if (SUCCESS == stat)
+        stat = table_checksum(header + PRECOMP_SUM_OFFSET, header, points, points_len);
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, (int) getpid());
+    if (SUCCESS == stat)
+    {
+        file = fopen(tmp_name, "wb");
+        if (!file)
+        {
+            ERROR_LOG("Can not create file %s.\n", tmp_name);
+            stat = FAIL;
+        }
+    }
+    if (SUCCESS == stat)
+    {
+        if ((fwrite(header, 1, PRECOMP_HEADER_SIZE, file) != PRECOMP_HEADER_SIZE) ||
+                (fwrite(points, 1, points_len, file) != points_len))
+        {
+            ERROR_LOG("Filed to write precomputed table to %s file\n", tmp_name);
+            stat = FAIL;
+        }
+        if (fclose(file))
+            stat = FAIL;
+        if ((SUCCESS == stat) && rename(tmp_name, file_name))
+        {
+            ERROR_LOG("Can not create file %s.\n", file_name);
+            stat = FAIL;
+        }
+        if (SUCCESS != stat)
+            remove(tmp_name);
+        else
+            LOG("Precomputed table written - %d bytes written to %s file\n",
+                (int)(PRECOMP_HEADER_SIZE + points_len), file_name);
+    }
+    free(points);
+    return stat;
+}
+
+/*
+ * Decodes the points of the table once, so the multiply uses them
+ * as they are. Every point has to be on the curve, the checksum only
+ * tells the file is whole, not who wrote it
+ */
+static status table_decode(EC_point_table_t *t, const unsigned char *raw,
+                           unsigned int clen, const curve *c)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < t->d; i++)
+    {
+        EC_point_t *pt = &t->points[i];
+
+        if ((gcry_mpi_scan(&pt->x, GCRYMPI_FMT_USG, raw + (2 * i) * clen, clen, NULL) != GPG_ERR_NO_ERROR) ||
+            (gcry_mpi_scan(&pt->y, GCRYMPI_FMT_USG, raw + (2 * i + 1) * clen, clen, NULL) != GPG_ERR_NO_ERROR))
+        {
+            return FAIL;
+        }
+#ifdef JACOBIAN_COORDINATES
+        pt->z = mpi_set_ui(NULL, 1);
+#endif
+        if (!ec_point_on_curve(pt, &c->params))
+            return FAIL;
+    }
+    return SUCCESS;
+}
+
+status precomp_table_map(EC_point_table_t **t, precomp_type type,
+                         const curve *c, const EC_point_t *p, const char *file_name)
+{
+    status stat = SUCCESS;
+    unsigned char sum[SHA256_LEN];
+    unsigned char *map = NULL;
+    unsigned int w = 0, d = 0, clen = 0;
+    char name[PRECOMP_CURVE_NAME_SIZE + 1];
+    struct stat st;
+    EC_point_table_t *tab = NULL;
+    int fd = -1;
+
+    CHECK_PARAM(t);
+    CHECK_PARAM(c);
+    CHECK_PARAM(p);
+    CHECK_PARAM(file_name);
+
+    *t = NULL;
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        LOG("No precomputed table %s\n", file_name);
+        return FAIL;
+    }
+    if (fstat(fd, &st) || st.st_size < PRECOMP_HEADER_SIZE)
+    {
+        ERROR_LOG("The file %s is not an SPG precomputed table\n", file_name);
+        close(fd);
+        return FAIL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+    {
+        ERROR_LOG("Can not map file %s\n", file_name);
+        return FAIL;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    w = map[7];
+    d = get_be32(map + 8);
+    clen = get_be32(map + 12);
+    memcpy(name, map + 16, PRECOMP_CURVE_NAME_SIZE);
+    name[PRECOMP_CURVE_NAME_SIZE] = '\0';
+
+    if (memcmp(map, PRECOMP_MAGIC, 4) || get_be16(map + 4) != PRECOMP_VERSION)
+    {
+        ERROR_LOG("The file %s is not an SPG precomputed table\n", file_name);
+        stat = FAIL;
+    }
+    else if (map[6] != type || strcmp(name, c->name) ||
+             clen != coord_size(c) || w == 0 || w > 8 ||
+             (w * d < mpi_get_nbits(c->params.n)) ||
+             (st.st_size != PRECOMP_HEADER_SIZE + (off_t) d * 2 * clen))
+    {
+        ERROR_LOG("The table %s doesn't match the key\n", file_name);
+        stat = FAIL;
+    }
+    if (SUCCESS == stat)
+    {
+        stat = table_checksum(sum, map, map + PRECOMP_HEADER_SIZE,
+                              st.st_size - PRECOMP_HEADER_SIZE);
+        if ((SUCCESS == stat) && memcmp(sum, map + PRECOMP_SUM_OFFSET, SHA256_LEN))
+        {
+            ERROR_LOG("The table %s is corrupted\n", file_name);
+            stat = FAIL;
+        }
+    }
+    if (SUCCESS == stat)
+    {
+        tab = calloc(1, sizeof(EC_point_table_t));
+        if (tab)
+            tab->points = calloc(d, sizeof(EC_point_t));
+        if (!tab || !tab->points)
+        {
+            ERROR_LOG("Memory allocation failed\n");
+            stat = FAIL;
+        }
+    }
+    if (SUCCESS == stat)
+    {
+        tab->w = w;
+        tab->d = d;
+        stat = table_decode(tab, map + PRECOMP_HEADER_SIZE, clen, c);
+        /*
+         * First point is 2^0 * P so it has to be the point itself
+         */
+        if ((SUCCESS == stat) &&
+            ((mpi_cmp(tab->points[0].x, p->x) != 0) || (mpi_cmp(tab->points[0].y, p->y) != 0)))
+        {
+            stat = FAIL;
+        }
+        if (SUCCESS != stat)
+            ERROR_LOG("The table %s doesn't match the key\n", file_name);
+    }
+    munmap(map, st.st_size);
+    if (SUCCESS == stat)
+    {
+        LOG("Using precomputed table %s\n", file_name);
+        *t = tab;
+    }
+    else if (tab)
+    {
+        ec_point_table_free(tab);
+        free(tab);
+    }
+    return stat;
+}
+
+status precomp_curve_table_file(char *name, const curve *c)
+{
+    const char *home = getenv("HOME");
+
+    if (!home || (strlen(home) + strlen(c->name) + 16 > MAX_FILE_NAME_SIZE))
+    {
+        return FAIL;
+    }
+    sprintf(name, "%s/" SPG_DIR_NAME "/%s" PRECOMP_FILE_SUFFIX, home, c->name);
+    return SUCCESS;
+}
@@ -0,0 +1,73 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_PRECOMP_H_
+#define _SPG_PRECOMP_H_
+
+/*
+ * Precomputed table file format. All numbers are big endian.
+ *
+ *  +-------+---------+------+---+---+-----------+-------+---------+--------...
+ *  | magic | version | type | w | d | coord len | curve | SHA-256 | points
+ *  +-------+---------+------+---+---+-----------+-------+---------+--------...
+ *      4        2        1    1   4       4         32       32
+ *
+ * Points are d times x || y, each coordinate is coord len bytes long.
+ * The SHA-256 covers the whole file apart from the SHA-256 field itself.
+ * The file is mapped read-only and the points are decoded once when
+ * it is loaded, so the multiply uses them without any parsing. The
+ * SHA-256 only catches a damaged file, any process of the same user
+ * can replace it, so every point is checked to be on the curve.
+ */
+#define PRECOMP_MAGIC "SPGT"
+#define PRECOMP_VERSION 1
+#define PRECOMP_CURVE_NAME_SIZE 32
+#define PRECOMP_SUM_OFFSET 48
+#define PRECOMP_HEADER_SIZE 80
+
+typedef enum
+{
+    PRECOMP_BASE_POINT = 1, /* curve base point G */
+    PRECOMP_PUBLIC_KEY      /* public key point Q */
+} precomp_type;
+
+/*
+ * Function: precomp_table_write
+ * Writes fixed-base table built for point of given type on curve c
+ * to file_name. The file is written to a temp file first and renamed
+ * so readers never see half written table
+ */
+status precomp_table_write(const EC_point_table_t *t, precomp_type type,
+                           const curve *c, const char *file_name);
+
+/*
+ * Function: precomp_table_map
+ * Maps table file read-only and decodes the points. Checks the header,
+ * the checksum, that every point is on the curve and that the first
+ * point in the table is p
+ */
+status precomp_table_map(EC_point_table_t **t, precomp_type type,
+                         const curve *c, const EC_point_t *p, const char *file_name);
+
+/*
+ * Function: precomp_curve_table_file
+ * Builds name of the base point table file for curve c.
+ * The tables for G live in the spg home dir
+ */
+status precomp_curve_table_file(char *name, const curve *c);
+
+#endif /* _SPG_PRECOMP_H_ */
@@ -0,0 +1,226 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <gcrypt.h>
+#include "defs.h"
+#include "ec_point.h"
+#include "rng.h"
+
+#define CHACHA_KEY_SIZE 32
+#define CHACHA_BLOCK_SIZE 64
+#define RNG_BLOCKS 8
+#define RNG_BUFF_SIZE (RNG_BLOCKS * CHACHA_BLOCK_SIZE)
+
+/*
+ * Per thread generator state
+ */
+typedef struct rng_state_s
+{
+    uint32_t key[CHACHA_KEY_SIZE / 4];
+    uint64_t nonce;
+    unsigned char buff[RNG_BUFF_SIZE];
+    size_t avail;         /* unused bytes at the end of buff */
+    size_t output;        /* bytes generated since last reseed */
+    time_t seeded;        /* time of last reseed */
+    unsigned int fork_gen;
+    int ready;
+} rng_state_t;
+
+static __thread rng_state_t rng;
+
+/*
+ * Bumped in the child after fork so that all generators
+ * in the child reseed and don't repeat the parent output
+ */
+static volatile unsigned int rng_fork_gen = 0;
+static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+
+static void rng_atfork_child(void)
+{
+    rng_fork_gen++;
+}
+
+static void rng_register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, rng_atfork_child);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)              \
+    do {                                      \
+        a += b; d ^= a; d = ROTL32(d, 16);    \
+        c += d; b ^= c; b = ROTL32(b, 12);    \
+        a += b; d ^= a; d = ROTL32(d, 8);     \
+        c += d; b ^= c; b = ROTL32(b, 7);     \
+    } while(0)
+
+/*
+ * ChaCha20 block function as in RFC 8439 section 2.3
+ */
+static void chacha20_block(const uint32_t key[8], uint32_t counter,
+                           const uint32_t nonce[3], unsigned char out[CHACHA_BLOCK_SIZE])
+{
+    uint32_t in[16], x[16];
+    int i = 0;
+
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+        in[4 + i] = key[i];
+    in[12] = counter;
+    in[13] = nonce[0];
+    in[14] = nonce[1];
+    in[15] = nonce[2];
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++)
+    {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++)
+    {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v & 0xff;
+        out[4 * i + 1] = (v >> 8) & 0xff;
+        out[4 * i + 2] = (v >> 16) & 0xff;
+        out[4 * i + 3] = (v >> 24) & 0xff;
+    }
+}
+
+/*
+ * Get fresh key from the kernel. If getrandom() is not
+ * there fall back to gcrypt strong random pool
+ */
+static void rng_reseed(void)
+{
+    size_t got = 0;
+    ssize_t ret = 0;
+    unsigned char *key = (unsigned char*) rng.key;
+
+    pthread_once(&rng_once, rng_register_atfork);
+    while (got < CHACHA_KEY_SIZE)
+    {
+        ret = getrandom(key + got, CHACHA_KEY_SIZE - got, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            gcry_randomize(key, CHACHA_KEY_SIZE, GCRY_STRONG_RANDOM);
+            break;
+        }
+        got += ret;
+    }
+    rng.nonce = 0;
+    rng.avail = 0;
+    rng.output = 0;
+    rng.seeded = time(NULL);
+    rng.fork_gen = rng_fork_gen;
+    rng.ready = 1;
+}
+
+/*
+ * Generate RNG_BLOCKS blocks of key stream. The first 32 bytes
+ * replace the key so the previous output can't be recomputed
+ * from the state, the rest is the output
+ */
+static void rng_refill(void)
+{
+    uint32_t nonce[3];
+    unsigned int i = 0;
+
+    nonce[0] = (uint32_t) rng.nonce;
+    nonce[1] = (uint32_t) (rng.nonce >> 32);
+    nonce[2] = 0;
+    rng.nonce++;
+    for (i = 0; i < RNG_BLOCKS; i++)
+    {
+        chacha20_block(rng.key, i, nonce, rng.buff + i * CHACHA_BLOCK_SIZE);
+    }
+    memcpy(rng.key, rng.buff, CHACHA_KEY_SIZE);
+    memset(rng.buff, 0, CHACHA_KEY_SIZE);
+    rng.avail = RNG_BUFF_SIZE - CHACHA_KEY_SIZE;
+}
+
+void rng_bytes(void* buff, size_t len)
+{
+    unsigned char *out = buff;
+    size_t n = 0;
+
+    if (!rng.ready || (rng.fork_gen != rng_fork_gen) ||
+            (rng.output >= RNG_RESEED_BYTES) ||
+            (time(NULL) - rng.seeded >= RNG_RESEED_INTERVAL))
+    {
+        rng_reseed();
+    }
+    rng.output += len;
+    while (len)
+    {
+        if (!rng.avail)
+        {
+            rng_refill();
+        }
+        n = (len < rng.avail) ? len : rng.avail;
+        memcpy(out, rng.buff + RNG_BUFF_SIZE - rng.avail, n);
+        /* don't keep what was given out */
+        memset(rng.buff + RNG_BUFF_SIZE - rng.avail, 0, n);
+        rng.avail -= n;
+        out += n;
+        len -= n;
+    }
+}
+
+big_number rng_random_mpi(unsigned int nbits)
+{
+    unsigned char buff[MAX_BIG_NUM_SIZE];
+    size_t len = (nbits + 7) / 8;
+    big_number num = NULL;
+
+    if (len > MAX_BIG_NUM_SIZE)
+    {
+        num = mpi_new(0);
+        gcry_mpi_randomize(num, nbits, GCRY_STRONG_RANDOM);
+        return num;
+    }
+    rng_bytes(buff, len);
+    if (gcry_mpi_scan(&num, GCRYMPI_FMT_USG, buff, len, NULL) != GPG_ERR_NO_ERROR)
+    {
+        num = mpi_new(0);
+        gcry_mpi_randomize(num, nbits, GCRY_STRONG_RANDOM);
+    }
+    else
+    {
+        mpi_clear_highbit(num, nbits);
+    }
+    memset(buff, 0, len);
+    return num;
+}
@@ -0,0 +1,46 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_RNG_H_
+#define _SPG_RNG_H_
+
+/*
+ * Userspace ChaCha20 based DRBG. Every thread has its own generator,
+ * seeded from getrandom(), so there is no lock on the hot path.
+ * The key is replaced after every refill (fast key erasure) and the
+ * generator reseeds itself after RNG_RESEED_BYTES of output, after
+ * RNG_RESEED_INTERVAL seconds and in a child process after fork().
+ * Used for per-signature nonces and ephemeral keys. Long term keys
+ * are still generated with gcrypt GCRY_VERY_STRONG_RANDOM.
+ */
+#define RNG_RESEED_BYTES    (1024 * 1024)
+#define RNG_RESEED_INTERVAL 300
+
+/*
+ * Function: rng_bytes
+ * Fills buff with len random bytes
+ */
+void rng_bytes(void* buff, size_t len);
+
+/*
+ * Function: rng_random_mpi
+ * Returns new random big number nbits long.
+ * It needs to be released by the caller
+ */
+big_number rng_random_mpi(unsigned int nbits);
+
+#endif /* _SPG_RNG_H_ */
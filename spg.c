@@ -17,7 +17,9 @@
  *************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -43,6 +45,8 @@ typedef enum
     op_ver_sign,
     op_encrypt,
     op_decrypt,
+    op_append,
+    op_precompute,
     op_help
 
 } operation;
@@ -54,9 +58,18 @@ typedef struct operation_params_s
     char* output;
     char* key_file;
     char* arg;
+    char** args;        /* all the files given, arg is the first one */
+    unsigned int args_count;
+    char* digest;       /* message digest to sign or verify instead of a file */
     sym_cipher cipher;
 } operation_params_t;
 
+static int is_directory( const char* path )
+{
+    struct stat st;
+    return path && (stat(path, &st) == 0) && S_ISDIR(st.st_mode);
+}
+
 static status do_operation( operation op, operation_params_t* params )
 {
     status stat = SUCCESS;
@@ -95,7 +108,17 @@ static status do_operation( operation op, operation_params_t* params )
         /*
          * Operation generate message signature
          */
-        stat = generate_signature( params->key_file, params->output, params->arg );
+        if (params->digest)
+            stat = generate_signature_digest( params->key_file, params->output, params->digest );
+        else if (params->args_count == 1 && is_directory(params->arg))
+            stat = generate_manifest( params->key_file, params->output, params->arg );
+        else if (SIGN_MODE_BATCH == signature_mode)
+            stat = generate_batch_signature( params->key_file, params->output,
+                                             params->args, params->args_count );
+        else if (params->args_count > 1)
+            stat = generate_signatures( params->key_file, params->args, params->args_count );
+        else
+            stat = generate_signature( params->key_file, params->output, params->arg );
         if (stat != SUCCESS)
         {
             INFO_LOG( "Generate message signature operation failed\n");
@@ -110,7 +133,17 @@ static status do_operation( operation op, operation_params_t* params )
         /*
          * Operation verify message signature
          */
-        stat = verify_signature( params->key_file, params->input, params->arg );
+        if (params->digest)
+            stat = verify_signature_digest( params->key_file, params->input, params->digest );
+        else if (params->args_count == 1 && is_directory(params->arg))
+            stat = verify_manifest( params->key_file, params->input, params->arg );
+        else if (params->args_count > 1 && params->input)
+            stat = verify_batch_signature( params->key_file, params->input,
+                                           params->args, params->args_count );
+        else if (params->args_count > 1)
+            stat = verify_signatures( params->key_file, params->args, params->args_count );
+        else
+            stat = verify_signature( params->key_file, params->input, params->arg );
         if (stat == SUCCESS)
         {
             INFO_LOG("Signature is valid\n");
@@ -128,7 +161,7 @@ static status do_operation( operation op, operation_params_t* params )
         /*
          * Operation Encrypt
          */
-        stat = encrypt( params->key_file, params->arg, params->cipher);
+        stat = encrypt( params->key_file, params->arg, params->output, params->cipher);
         if (stat != SUCCESS)
         {
             ERROR_LOG( "Encrypt operation failed\n");
@@ -144,6 +177,30 @@ static status do_operation( operation op, operation_params_t* params )
             ERROR_LOG( "Decrypt operation failed\n");
         }
         break;
+    case op_append:
+        /*
+         * Operation Append
+         */
+        stat = append( params->key_file, params->input, params->arg );
+        if (stat != SUCCESS)
+        {
+            ERROR_LOG( "Append operation failed\n");
+        }
+        break;
+    case op_precompute:
+        /*
+         * Operation precompute public key table
+         */
+        stat = precompute_public_key( params->key_file, params->curve_name );
+        if (stat != SUCCESS)
+        {
+            ERROR_LOG( "Precompute operation failed\n");
+        }
+        else
+        {
+            INFO_LOG("Precomputed tables stored\n");
+        }
+        break;
     case op_help:
         /*
          * Operation print help
@@ -238,6 +295,7 @@ int main(int argc, char** argv)
 {
     status stat = SUCCESS;
     int next_option = 0;
+    unsigned int range_count = 0;
     const char* const default_curve = "secp160r2";
     char default_priv_key[256] = {0};
     char default_pub_key[256] = {0};
@@ -245,7 +303,11 @@ int main(int argc, char** argv)
     operation opr = op_noop;
     operation_params_t params;
     memset( &params, '\0', sizeof(params));
-    params.cipher = SYM_CIPHER_BLOWFISH;
+    /*
+     * Not given - auto to encrypt, the one in the header
+     * or Blowfish for old files to decrypt
+     */
+    params.cipher = SYM_CIPHER_TERM;
 
     /* validate environment */
     if(230 < strlen(getenv("HOME")))
@@ -276,7 +338,7 @@ int main(int argc, char** argv)
     /*
      * Possible user params are
      */
-    const char* const short_options = "gxsvedlphc:i:k:o:V";
+    const char* const short_options = "gxsvedatlphc:i:k:o:n:m:j:CR:H:D:K:S:I:Q:r:OV";
     const struct option long_options [] =
     {
         /* Operations */
@@ -286,6 +348,8 @@ int main(int argc, char** argv)
         { "verify", 0, NULL, 'v' },      /* Verify message signature */
         { "encrypt", 0, NULL, 'e' },     /* Encrypt data */
         { "decrypt", 0, NULL, 'd' },     /* Decrypt data */
+        { "append", 0, NULL, 'a' },      /* Append data to encrypted file */
+        { "precompute", 0, NULL, 't' },  /* Precompute public key table */
         { "list_curves", 0, NULL, 'l' }, /* Lits implemented curves */
         { "list_sym_ciphers", 0, NULL, 'p' }, /* Lits symmetric ciphers */
         { "help", 0, NULL, 'h' },        /* Print help and exit */
@@ -295,6 +359,19 @@ int main(int argc, char** argv)
         { "input", 1, NULL, 'i' },       /* Input file */
         { "key", 1, NULL, 'k' },         /* Private/Public Key file */
         { "output", 1, NULL, 'o' },      /* Output file */
+        { "nonce", 1, NULL, 'n' },       /* Signature nonce type */
+        { "mode", 1, NULL, 'm' },        /* Signature digest mode */
+        { "hash", 1, NULL, 'H' },        /* Signature hash */
+        { "jobs", 1, NULL, 'j' },        /* Number of worker threads */
+        { "cache", 0, NULL, 'C' },       /* Keep Merkle tree chunk cache */
+        { "changed", 1, NULL, 'R' },     /* Ranges changed since last signature */
+        { "digest", 1, NULL, 'D' },      /* Sign or verify message digest */
+        { "kdf", 1, NULL, 'K' },         /* Encryption key derivation function */
+        { "cipher", 1, NULL, 'S' },      /* Symmetric cipher */
+        { "io", 1, NULL, 'I' },          /* Encryption I/O engine */
+        { "queue_depth", 1, NULL, 'Q' }, /* I/O requests in flight */
+        { "direct", 0, NULL, 'O' },      /* O_DIRECT for plain text */
+        { "range", 1, NULL, 'r' },       /* Decrypt part of the file */
         { NULL, 0, NULL, 0 }             /* NULL terminator*/
     };
 
@@ -325,6 +402,12 @@ int main(int argc, char** argv)
         case 'd':
             opr = op_decrypt;
             break;
+        case 'a':
+            opr = op_append;
+            break;
+        case 't':
+            opr = op_precompute;
+            break;
         case 'l':
             list_curves();
             exit(SUCCESS);
@@ -346,6 +429,117 @@ int main(int argc, char** argv)
         case 'o':
             params.output = optarg;
             break;
+        case 'n':
+            if (strcmp(optarg, "rfc6979") == 0)
+            {
+                nonce_type = EC_NONCE_RFC6979;
+            }
+            else if (strcmp(optarg, "random") == 0)
+            {
+                nonce_type = EC_NONCE_RANDOM;
+            }
+            else
+            {
+                ERROR_LOG("Unknown nonce type %s\n", optarg);
+                exit(FAIL);
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "stream") == 0)
+            {
+                signature_mode = SIGN_MODE_STREAM;
+            }
+            else if (strcmp(optarg, "merkle") == 0)
+            {
+                signature_mode = SIGN_MODE_MERKLE;
+            }
+            else if (strcmp(optarg, "batch") == 0)
+            {
+                signature_mode = SIGN_MODE_BATCH;
+            }
+            else
+            {
+                ERROR_LOG("Unknown signature mode %s\n", optarg);
+                exit(FAIL);
+            }
+            break;
+        case 'H':
+            if (ec_hash_by_name(optarg, &signature_hash) != SUCCESS)
+            {
+                ERROR_LOG("Unknown hash %s\n", optarg);
+                exit(FAIL);
+            }
+            break;
+        case 'j':
+            jobs = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            chunk_cache = 1;
+            break;
+        case 'R':
+            FREE(changed_ranges);
+            if (merkle_parse_ranges(optarg, &changed_ranges, &changed_ranges_count) != SUCCESS)
+            {
+                exit(FAIL);
+            }
+            chunk_cache = 1;
+            break;
+        case 'D':
+            params.digest = optarg;
+            break;
+        case 'K':
+            if (strcmp(optarg, "sha512") == 0)
+            {
+                kdf_type = EC_KDF_SHA512;
+            }
+            else if (strcmp(optarg, "blake3") == 0)
+            {
+                kdf_type = EC_KDF_BLAKE3;
+            }
+            else
+            {
+                ERROR_LOG("Unknown key derivation function %s\n", optarg);
+                exit(FAIL);
+            }
+            break;
+        case 'S':
+            if (sym_cipher_by_name(optarg, &params.cipher) != SUCCESS)
+            {
+                ERROR_LOG("Unknown cipher %s\n", optarg);
+                sym_cipher_list();
+                exit(FAIL);
+            }
+            break;
+        case 'I':
+            if (io_engine_by_name(optarg, &io_engine_config.type) != SUCCESS)
+            {
+                ERROR_LOG("Unknown I/O engine %s\n", optarg);
+                exit(FAIL);
+            }
+            break;
+        case 'Q':
+            io_engine_config.depth = (unsigned int) strtoul(optarg, NULL, 10);
+            if (!io_engine_config.depth || (io_engine_config.depth > IO_ENGINE_MAX_DEPTH))
+            {
+                ERROR_LOG("Queue depth has to be 1 - %d\n", IO_ENGINE_MAX_DEPTH);
+                exit(FAIL);
+            }
+            break;
+        case 'O':
+            io_engine_config.direct = 1;
+            break;
+        case 'r':
+            FREE(decrypt_range);
+            if (merkle_parse_ranges(optarg, &decrypt_range, &range_count) != SUCCESS)
+            {
+                exit(FAIL);
+            }
+            if (range_count != 1)
+            {
+                ERROR_LOG("Only one range can be decrypted at a time\n");
+                exit(FAIL);
+            }
+            break;
         case 'V':
             verbose = 1;
             break;
@@ -359,6 +553,12 @@ int main(int argc, char** argv)
     }
     while ( next_option != -1 );
 
+    /* Keep stdout clean when it carries encrypted or decrypted data */
+    if ( (opr == op_encrypt || opr == op_decrypt) &&
+         ((NULL != params.output && strcmp(params.output, "-") == 0) ||
+          (NULL == params.output && optind < argc && strcmp(argv[optind], "-") == 0)) )
+        log_stderr = 1;
+
     /*
      * Validate params
      */
@@ -379,6 +579,9 @@ int main(int argc, char** argv)
 
     if (!params.curve_name)
         params.curve_name = (char*) default_curve;
+    blake3_set_threads(jobs);
+    params.args = argv + optind;
+    params.args_count = (unsigned int) (argc - optind);
     switch ( opr )
     {
     case op_gen_key:
@@ -416,7 +619,7 @@ int main(int argc, char** argv)
     case op_gen_sign:
 
         params.arg = argv[optind];
-        if ( NULL != params.arg )
+        if ( NULL != params.digest )
         {
             if ( NULL == params.key_file )
             {
@@ -424,6 +627,34 @@ int main(int argc, char** argv)
                          "default location: %s\n", default_priv_key );
                 params.key_file = (char*)default_priv_key;
             }
+            if ( NULL == params.output || NULL != params.arg )
+            {
+                INFO_LOG("Signature of a digest needs -o and no message file. Try --help\n");
+                stat = BAD_PARAMS;
+            }
+        }
+        else if ( NULL != params.arg )
+        {
+            if ( NULL == params.key_file )
+            {
+                INFO_LOG("Looking for the private key in the "
+                         "default location: %s\n", default_priv_key );
+                params.key_file = (char*)default_priv_key;
+            }
+            if ( SIGN_MODE_BATCH == signature_mode )
+            {
+                if ( NULL == params.output )
+                {
+                    INFO_LOG("No batch signature file provided. Try --help\n");
+                    stat = BAD_PARAMS;
+                }
+            }
+            else if ( params.args_count > 1 && NULL != params.output )
+            {
+                INFO_LOG("Signatures of many files go to <file>" SIGNATURE_FILE_SUFFIX
+                         ", -o can't be used. Try --help\n");
+                stat = BAD_PARAMS;
+            }
         }
         else
         {
@@ -434,7 +665,15 @@ int main(int argc, char** argv)
     case op_ver_sign:
 
         params.arg = argv[optind];
-        if ( NULL != params.arg )
+        if ( NULL != params.digest )
+        {
+            if ( NULL == params.key_file || NULL == params.input || NULL != params.arg )
+            {
+                INFO_LOG("Digest is verified with -k and -i and no message file. Try --help\n");
+                stat = BAD_PARAMS;
+            }
+        }
+        else if ( NULL != params.arg )
         {
             if ( NULL == params.key_file)
             {
@@ -442,7 +681,8 @@ int main(int argc, char** argv)
                 stat = BAD_PARAMS;
 
             }
-            if ( NULL == params.input )
+            if ( params.args_count == 1 && NULL == params.input &&
+                    !is_directory(params.arg) )
             {
                 INFO_LOG("No signature file provided. Try --help\n");
                 stat = BAD_PARAMS;
@@ -490,6 +730,24 @@ int main(int argc, char** argv)
             stat = BAD_PARAMS;
         }
 
+        break;
+    case op_append:
+
+        params.arg = argv[optind];
+        if ( NULL != params.arg )
+        {
+            if ( NULL == params.key_file )
+            {
+                INFO_LOG("Looking for the private key in the "
+                         "default location: %s\n", default_priv_key );
+                params.key_file = (char*)default_priv_key;
+            }
+        }
+        else
+        {
+            INFO_LOG("No file to append to. Try --help\n");
+            stat = BAD_PARAMS;
+        }
         break;
     case op_help:
 
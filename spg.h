@@ -28,6 +28,15 @@
 #include "utils.h"
 #include "help.h"
 #include "sym_cipher.h"
+#include "precomp.h"
+#include "rng.h"
+#include "file_io.h"
+#include "mb_hash.h"
+#include "blake3.h"
+#include "thread_pool.h"
+#include "merkle.h"
+#include "manifest.h"
+#include "io_engine.h"
 #include "spg_ops.h"
 
 #endif
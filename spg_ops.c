@@ -21,6 +21,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <gcrypt.h>
 #include <openssl/pem.h>
 #include <openssl/hmac.h>
@@ -34,12 +36,62 @@
 #include "utils.h"
 #include "help.h"
 #include "sym_cipher.h"
+#include "precomp.h"
+#include "file_io.h"
+#include "thread_pool.h"
+#include "merkle.h"
+#include "manifest.h"
+#include "enc_segment.h"
+#include "spg_ops.h"
 
 /*
  * Globals
  */
 #define BUFFER_SIZE 512
 
+sign_mode signature_mode = SIGN_MODE_STREAM;
+ec_hash_type signature_hash = EC_HASH_LEGACY;
+unsigned int jobs = 0;
+int chunk_cache = 0;
+merkle_range_t* changed_ranges = NULL;
+unsigned int changed_ranges_count = 0;
+merkle_range_t* decrypt_range = NULL;
+
+/*
+ * Signature PEM header fields. Signatures in the default
+ * stream mode have no header, same as the old ones
+ */
+#define SIGN_HDR_MODE        "Digest-Mode"
+#define SIGN_HDR_CHUNK_SIZE  "Chunk-Size"
+#define SIGN_HDR_HASH        "Hash"
+#define SIGN_HDR_BATCH_SIZE  "Batch-Size"
+#define SIGN_MODE_STREAM_STR "stream"
+#define SIGN_MODE_MERKLE_STR "merkle"
+#define SIGN_MODE_BATCH_STR  "batch"
+
+/*
+ * Tags of the digests signed in place of a Merkle tree root, a batch
+ * root and a manifest, see ec_tagged_digest()
+ */
+#define SIGN_TAG_MERKLE      "SPG-MERKLE-v1"
+#define SIGN_TAG_BATCH       "SPG-BATCH-v1"
+#define SIGN_TAG_MANIFEST    "SPG-MANIFEST-v1"
+
+/*
+ * Inclusion proof is PEM with 8 bytes big endian index of the message
+ * in the batch followed by the sibling hashes
+ */
+#define PROOF_INDEX_SIZE     8
+
+typedef struct sign_digest_s
+{
+    sign_mode mode;
+    ec_hash_type hash;
+    unsigned long chunk_size; /* Merkle tree leaf size */
+    char* cache_file;         /* Merkle tree leaf cache, NULL if not used */
+    unsigned long batch_size; /* number of messages signed in batch mode */
+} sign_digest_t;
+
 /*
  * generate_key
  * Generates private key on curve curve_name
@@ -154,6 +206,7 @@ static status read_private_key(EC_private_key_t* private_key, char* in_file)
     CHECK_PARAM(private_key);
     CHECK_PARAM(in_file);
 
+    private_key->pub.Q_table = NULL;
     FILE *file = fopen(in_file, "r");
 
     if (!file)
@@ -354,6 +407,7 @@ static status read_public_key (EC_public_key_t* public_key, char* in_file)
     CHECK_PARAM(public_key);
     CHECK_PARAM(in_file);
 
+    public_key->Q_table = NULL;
     FILE *file = fopen(in_file, "r");
 
     if (!file)
@@ -472,21 +526,130 @@ status export_public_key (char* in_file, char* out_file)
 }
 
 /*
- *
+ * Builds the name of the precomputed table file for a key file
+ */
+static status precomputed_table_file_name(char* name, char* key_file)
+{
+    if (strlen(key_file) > MAX_FILE_NAME_SIZE - MAX_SUFFIX_SIZE)
+    {
+        ERROR_LOG("Key file name too long %s\n", key_file);
+        return FAIL;
+    }
+    strcpy(name, key_file);
+    strcat(name, PRECOMP_FILE_SUFFIX);
+    return SUCCESS;
+}
+
+/*
+ * load_precomputed_tables
+ * Maps the fixed-base tables for the public key Q (stored next to
+ * the key file) and for the curve base point G (stored in spg home dir)
+ * if they are there. The tables are optional - without them the slow
+ * path is used, so it is not an error if there are none
+ */
+static void load_precomputed_tables(EC_public_key_t* public_key, char* key_file)
+{
+    char tab_file_name[MAX_FILE_NAME_SIZE];
+
+    if ((NULL == public_key->c.params.G_table) &&
+            (precomp_curve_table_file(tab_file_name, &public_key->c) == SUCCESS))
+    {
+        precomp_table_map(&public_key->c.params.G_table, PRECOMP_BASE_POINT,
+                          &public_key->c, &public_key->c.params.G, tab_file_name);
+    }
+    if ((NULL != key_file) && (NULL == public_key->Q_table) &&
+            (precomputed_table_file_name(tab_file_name, key_file) == SUCCESS))
+    {
+        precomp_table_map(&public_key->Q_table, PRECOMP_PUBLIC_KEY,
+                          &public_key->c, &public_key->Q, tab_file_name);
+    }
+}
+
+/*
+ * Builds and writes fixed-base table for the curve base point G
+ */
+static status precompute_curve(curve* c)
+{
+    status stat = SUCCESS;
+    char tab_file_name[MAX_FILE_NAME_SIZE];
+    EC_point_table_t t;
+
+    if ((stat = precomp_curve_table_file(tab_file_name, c)) != SUCCESS)
+    {
+        ERROR_LOG("Can not build table file name for curve %s\n", c->name);
+        return stat;
+    }
+    stat = ec_point_table_build(&t, &c->params.G, mpi_get_nbits(c->params.n), &c->params);
+    if (SUCCESS == stat)
+    {
+        stat = precomp_table_write(&t, PRECOMP_BASE_POINT, c, tab_file_name);
+        ec_point_table_free(&t);
+    }
+    return stat;
+}
+
+/*
+ * precompute_public_key
+ * Builds fixed-base table for the public key in key_file and stores
+ * it next to the key file. The table for the base point of the key
+ * curve is stored in spg home dir. If no key file is given only the
+ * base point table for curve_name is built
+ */
+status precompute_public_key(char* key_file, char* curve_name)
+{
+    status stat = SUCCESS;
+    EC_public_key_t pub_key;
+    char tab_file_name[MAX_FILE_NAME_SIZE];
+
+    if (NULL == key_file)
+    {
+        curve c;
+        CHECK_PARAM(curve_name);
+        if ((stat = get_curve_by_name(&c, curve_name)) != SUCCESS)
+        {
+            ERROR_LOG("Curve %s not found.\n", curve_name);
+            return stat;
+        }
+        stat = precompute_curve(&c);
+        free_curve(&c);
+        return stat;
+    }
+    if ((stat = precomputed_table_file_name(tab_file_name, key_file)) != SUCCESS)
+    {
+        return stat;
+    }
+    if ((stat = read_public_key(&pub_key, key_file)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read public key file\n");
+        return stat;
+    }
+    if ((stat = ec_public_key_precompute(&pub_key)) == SUCCESS)
+    {
+        stat = precomp_table_write(pub_key.Q_table, PRECOMP_PUBLIC_KEY,
+                                   &pub_key.c, tab_file_name);
+    }
+    if (SUCCESS == stat)
+    {
+        stat = precompute_curve(&pub_key.c);
+    }
+    ec_release_public_key(&pub_key);
+    return stat;
+}
+
+/*
+ * write_signature_fp
+ * Writes the signature in PEM format to already open file
  */
-static status write_signature(EC_signature_t* signature, char* output)
+static status write_signature_fp(EC_signature_t* signature, const sign_digest_t* digest,
+                                 FILE* out_file, const char* output)
 {
     status stat = SUCCESS;
+    char header[BUFFER_SIZE] = PEM_EMPTY_STR;
     unsigned char key_buff[BUFFER_SIZE];
     unsigned char *buff_ptr = key_buff;
     size_t len = 0;
     unsigned int space = 0;
-    FILE *out_file = fopen(output, "w");
-    if (!out_file)
-    {
-        ERROR_LOG("Can not create signature file %s.\n", output);
-        stat = FAIL;
-    }
+
     if ((SUCCESS == stat) && (gcry_mpi_print(GCRYMPI_FMT_USG, buff_ptr + 1,
                                   BUFFER_SIZE - space, &len, signature->r) == GPG_ERR_NO_ERROR))
     {
@@ -515,7 +678,25 @@ static status write_signature(EC_signature_t* signature, char* output)
         ERROR_LOG("Filed to export data");
         stat = FAIL;
     }
-    if ((SUCCESS == stat) && (PEM_write(out_file, PEM_SIGN_NAME, PEM_EMPTY_STR,
+    if (EC_HASH_LEGACY != digest->hash)
+    {
+        snprintf(header, BUFFER_SIZE, SIGN_HDR_HASH ": %s\n", ec_hash_name(digest->hash));
+    }
+    if (SIGN_MODE_MERKLE == digest->mode)
+    {
+        size_t hlen = strlen(header);
+
+        snprintf(header + hlen, BUFFER_SIZE - hlen, SIGN_HDR_MODE ": " SIGN_MODE_MERKLE_STR "\n"
+                 SIGN_HDR_CHUNK_SIZE ": %lu\n", digest->chunk_size);
+    }
+    else if (SIGN_MODE_BATCH == digest->mode)
+    {
+        size_t hlen = strlen(header);
+
+        snprintf(header + hlen, BUFFER_SIZE - hlen, SIGN_HDR_MODE ": " SIGN_MODE_BATCH_STR "\n"
+                 SIGN_HDR_BATCH_SIZE ": %lu\n", digest->batch_size);
+    }
+    if ((SUCCESS == stat) && (PEM_write(out_file, PEM_SIGN_NAME, header,
                                             (void*) key_buff, space)))
     {
         LOG("Signature generated successfully - %d bytes written to %s file\n", space, output);
@@ -525,43 +706,157 @@ static status write_signature(EC_signature_t* signature, char* output)
         ERROR_LOG("Filed to wirte signature (%d bytes) to %s file\n", space, output);
         stat = FAIL;
     }
-    if (out_file)
-        fclose(out_file);
-
     return stat;
 }
 
 /*
  *
  */
-static status read_signature(EC_signature_t *sign, char* sign_file)
+static status write_signature(EC_signature_t* signature, const sign_digest_t* digest,
+                              char* output)
 {
-    status stat = SUCCESS;
-    char *name = NULL, *header = NULL ;
-    unsigned char *data = NULL;
-    long len = 0;
-    CHECK_PARAM(sign);
-    CHECK_PARAM(sign_file);
-
-    FILE *file = fopen(sign_file, "r");
+    status stat;
+    FILE *out_file = fopen(output, "w");
 
-    if (!file)
+    if (!out_file)
     {
-        ERROR_LOG("Can not open signature file %s.\n", sign_file);
-        stat = FAIL;
+        ERROR_LOG("Can not create signature file %s.\n", output);
+        return FAIL;
     }
-    if (SUCCESS == stat)
+    stat = write_signature_fp(signature, digest, out_file, output);
+    fclose(out_file);
+    return stat;
+}
+
+/*
+ * parse_signature_header
+ * Reads the digest mode from the "Name: value" lines of signature PEM header.
+ * Fields it does not know are rejected, they could change what got signed
+ */
+static status parse_signature_header(const char* header, sign_digest_t* digest)
+{
+    const char* line = header;
+
+    digest->mode = SIGN_MODE_STREAM;
+    digest->hash = EC_HASH_LEGACY;
+    digest->chunk_size = 0;
+    digest->cache_file = NULL;
+    digest->batch_size = 0;
+
+    while (line && *line)
     {
-        if (PEM_read(file, &name, &header, &data, &len) == 1)
+        const char* end = strchr(line, '\n');
+        const char* value = strchr(line, ':');
+        size_t name_len, value_len;
+
+        if (!end)
+            end = line + strlen(line);
+        if (end == line)
         {
-            LOG("Read %d bytes from signature file %s\n", (int)len, sign_file);
-            if ((strncmp(PEM_SIGN_NAME, name, strlen(PEM_SIGN_NAME))) == 0)
+            line++;
+            continue;
+        }
+        if (!value || (value > end))
+        {
+            ERROR_LOG("Malformed signature header\n");
+            return FAIL;
+        }
+        name_len = value - line;
+        value++;
+        while ((value < end) && (*value == ' '))
+            value++;
+        value_len = end - value;
+
+        if ((name_len == strlen(SIGN_HDR_MODE)) &&
+                (strncmp(line, SIGN_HDR_MODE, name_len) == 0))
+        {
+            if ((value_len == strlen(SIGN_MODE_MERKLE_STR)) &&
+                    (strncmp(value, SIGN_MODE_MERKLE_STR, value_len) == 0))
+            {
+                digest->mode = SIGN_MODE_MERKLE;
+            }
+            else if ((value_len == strlen(SIGN_MODE_BATCH_STR)) &&
+                     (strncmp(value, SIGN_MODE_BATCH_STR, value_len) == 0))
+            {
+                digest->mode = SIGN_MODE_BATCH;
+            }
+            else if ((value_len == strlen(SIGN_MODE_STREAM_STR)) &&
+                     (strncmp(value, SIGN_MODE_STREAM_STR, value_len) == 0))
             {
-                LOG("The file is a signature in PEM format\n");
+                digest->mode = SIGN_MODE_STREAM;
             }
             else
             {
-                ERROR_LOG("The file %s in not a signature in PEM format\n", sign_file);
+                ERROR_LOG("Unknown signature digest mode %.*s\n", (int) value_len, value);
+                return FAIL;
+            }
+        }
+        else if ((name_len == strlen(SIGN_HDR_HASH)) &&
+                 (strncmp(line, SIGN_HDR_HASH, name_len) == 0))
+        {
+            char hash_name[16];
+
+            snprintf(hash_name, sizeof(hash_name), "%.*s", (int) value_len, value);
+            if ((value_len >= sizeof(hash_name)) ||
+                    (ec_hash_by_name(hash_name, &digest->hash) != SUCCESS))
+            {
+                ERROR_LOG("Unknown signature hash %.*s\n", (int) value_len, value);
+                return FAIL;
+            }
+        }
+        else if ((name_len == strlen(SIGN_HDR_CHUNK_SIZE)) &&
+                 (strncmp(line, SIGN_HDR_CHUNK_SIZE, name_len) == 0))
+        {
+            digest->chunk_size = strtoul(value, NULL, 10);
+        }
+        else if ((name_len == strlen(SIGN_HDR_BATCH_SIZE)) &&
+                 (strncmp(line, SIGN_HDR_BATCH_SIZE, name_len) == 0))
+        {
+            digest->batch_size = strtoul(value, NULL, 10);
+        }
+        else
+        {
+            ERROR_LOG("Unknown signature header field %.*s\n", (int) name_len, line);
+            return FAIL;
+        }
+        line = *end ? end + 1 : end;
+    }
+    if ((SIGN_MODE_MERKLE == digest->mode) &&
+            (!digest->chunk_size || (digest->chunk_size > MERKLE_MAX_CHUNK_SIZE)))
+    {
+        ERROR_LOG("Invalid Merkle tree chunk size in signature header\n");
+        return FAIL;
+    }
+    if ((SIGN_MODE_BATCH == digest->mode) && !digest->batch_size)
+    {
+        ERROR_LOG("Invalid batch size in signature header\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * read_signature_fp
+ * Reads the signature from already open file, from its current position
+ */
+static status read_signature_fp(EC_signature_t *sign, sign_digest_t* digest,
+                                FILE* file, const char* sign_file)
+{
+    status stat = SUCCESS;
+    char *name = NULL, *header = NULL ;
+    unsigned char *data = NULL;
+    long len = 0;
+    CHECK_PARAM(sign);
+    CHECK_PARAM(file);
+
+    if (PEM_read(file, &name, &header, &data, &len) == 1)
+    {
+        LOG("Read %d bytes from signature file %s\n", (int)len, sign_file);
+        if ((strncmp(PEM_SIGN_NAME, name, strlen(PEM_SIGN_NAME))) == 0)
+        {
+            LOG("The file is a signature in PEM format\n");
+            if (parse_signature_header(header, digest) != SUCCESS)
+            {
                 FREE(data);
                 FREE(name);
                 FREE(header);
@@ -570,49 +865,56 @@ static status read_signature(EC_signature_t *sign, char* sign_file)
         }
         else
         {
-            ERROR_LOG("PEM_read failed to read %s file\n", sign_file);
+            ERROR_LOG("The file %s in not a signature in PEM format\n", sign_file);
+            FREE(data);
+            FREE(name);
+            FREE(header);
+            stat = FAIL;
+        }
+    }
+    else
+    {
+        ERROR_LOG("PEM_read failed to read %s file\n", sign_file);
+        stat = FAIL;
+    }
+    if (SUCCESS == stat)
+    {
+        unsigned char size = 0;
+        size_t size_scanned = 0;
+        unsigned char *buff_ptr = data;
+
+        size = *buff_ptr;
+        buff_ptr += 1;
+
+        /*
+         * Data read from the file
+         * now going to scan data into signature
+         */
+        /*
+         * Scan public key r
+         */
+        if (gcry_mpi_scan(&sign->r, GCRYMPI_FMT_USG,
+                            buff_ptr, (size_t) size, &size_scanned) != GPG_ERR_NO_ERROR)
+        {
             stat = FAIL;
         }
-        fclose(file);
         if (SUCCESS == stat)
         {
-            unsigned char size = 0;
-            size_t size_scanned = 0;
-            unsigned char *buff_ptr = data;
-
-            size = *buff_ptr;
-            buff_ptr += 1;
-
-            /*
-             * Data read from the file
-             * now going to scan data into signature
-             */
             /*
-             * Scan public key r
+             * Scan public s
              */
-            if (gcry_mpi_scan(&sign->r, GCRYMPI_FMT_USG,
+            buff_ptr += size;
+            size = *buff_ptr;
+            buff_ptr += 1;
+            if (gcry_mpi_scan(&sign->s, GCRYMPI_FMT_USG,
                                 buff_ptr, (size_t) size, &size_scanned) != GPG_ERR_NO_ERROR)
             {
                 stat = FAIL;
             }
-            if (SUCCESS == stat)
-            {
-                /*
-                 * Scan public s
-                 */
-                buff_ptr += size;
-                size = *buff_ptr;
-                buff_ptr += 1;
-                if (gcry_mpi_scan(&sign->s, GCRYMPI_FMT_USG,
-                                    buff_ptr, (size_t) size, &size_scanned) != GPG_ERR_NO_ERROR)
-                {
-                    stat = FAIL;
-                }
-            }
-            FREE(data);
-            FREE(name);
-            FREE(header);
         }
+        FREE(data);
+        FREE(name);
+        FREE(header);
     }
     return stat;
 }
@@ -620,200 +922,1546 @@ static status read_signature(EC_signature_t *sign, char* sign_file)
 /*
  *
  */
-status generate_signature(char* key, char* output, char* message)
+static status read_signature(EC_signature_t *sign, sign_digest_t* digest, char* sign_file)
 {
-    status stat = SUCCESS;
-    EC_private_key_t priv_key;
-    EC_signature_t sign;
-    void* msg_buffer = NULL;
-    long msg_size = 0;
-    int dummy;
-    char signature_file_name[MAX_FILE_NAME_SIZE];
-    FILE *msg = NULL, *sign_file = NULL;
-
-    CHECK_PARAM(key);
-    CHECK_PARAM(message);
-    msg = fopen(message, "r");
-    if (!msg)
-    {
-        ERROR_LOG("Can not open message file %s\n", message);
-        return FAIL;
-    }
+    status stat;
+    FILE *file;
 
-    fseek(msg, 0, SEEK_END);
-    msg_size = ftell(msg);
+    CHECK_PARAM(sign_file);
 
-    if (MAX_MSG_SIZE < msg_size)
+    file = fopen(sign_file, "r");
+    if (!file)
     {
-        ERROR_LOG("Max message size is " MAX_MSG_SIZE_STR "\n");
-        fclose(msg);
+        ERROR_LOG("Can not open signature file %s.\n", sign_file);
         return FAIL;
     }
+    stat = read_signature_fp(sign, digest, file, sign_file);
+    fclose(file);
+    return stat;
+}
 
-    if(NULL == output)
-    {
-        strcpy(signature_file_name, message);
-        strcat(signature_file_name, SIGNATURE_FILE_SUFFIX);
-    }
-    else
-    {
-        strcpy(signature_file_name, output);
-    }
-    sign_file = fopen(signature_file_name, "w");
-    if (!sign_file)
-    {
-        ERROR_LOG("Can not create signature file %s\n", signature_file_name);
-        fclose(msg);
-        return FAIL;
-    }
-    fclose(sign_file);
+/*
+ * hash_message_cb
+ * Feeds next piece of the message to the sign or verify context
+ */
+static status hash_message_cb(void* ctx, const void* data, size_t len)
+{
+    return ec_sign_update((EC_sign_ctx_t*) ctx, data, len);
+}
 
-    fseek(msg, 0, SEEK_SET);
+/*
+ * check_tree_hash
+ * Merkle trees, batch proofs and manifests are hashed with gcrypt,
+ * so BLAKE3 can only be used for plain and batch signatures
+ */
+static status check_tree_hash(ec_hash_type hash, const char* what)
+{
+    if (ec_hash_md_algo(hash))
+        return SUCCESS;
+    ERROR_LOG("Hash %s can not be used for %s\n", ec_hash_name(hash), what);
+    return BAD_PARAMS;
+}
 
-    msg_buffer = malloc((size_t) msg_size);
-    if (! msg_buffer)
-    {
-        ERROR_LOG("Memory allocation failed to allocate %d bytes \n", (int) msg_size);
-        fclose(msg);
-        return FAIL;
-    }
-    dummy = fread(msg_buffer, 1, (size_t) msg_size, msg);
+/*
+ * tree_digest
+ * Computes the Merkle tree root of the message on jobs threads and
+ * returns the tagged digest of it that is signed in Merkle mode
+ */
+static status tree_digest(int msg, const sign_digest_t* digest, unsigned char* dgst)
+{
+    status stat;
+    unsigned char root[SHA512_LEN];
+    int md_algo = ec_hash_md_algo(digest->hash);
 
-    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
-    {
+    if ((stat = check_tree_hash(digest->hash, "Merkle tree signatures")) != SUCCESS)
         return stat;
-    }
+    if (digest->cache_file)
+        stat = merkle_digest_cached(msg, md_algo, digest->chunk_size, jobs,
+                                    digest->cache_file, changed_ranges,
+                                    changed_ranges_count, root);
+    else
+        stat = merkle_digest_fd(msg, md_algo, digest->chunk_size, jobs, root);
+    if (SUCCESS == stat)
+        stat = ec_tagged_digest(digest->hash, SIGN_TAG_MERKLE, digest->chunk_size,
+                                root, gcry_md_get_algo_dlen(md_algo), dgst);
+    return stat;
+}
+
+/*
+ * digest_message
+ * Passes the message to the sign or verify context.
+ * BLAKE3 gets a mapped file in one piece, so it can split it
+ * between the threads itself
+ */
+static status digest_message(EC_sign_ctx_t* ctx, int msg, const sign_digest_t* digest)
+{
+    status stat;
+
+    if (EC_HASH_BLAKE3 == digest->hash)
+    {
+        file_io_map_t map;
+
+        if (file_io_map_fd(msg, &map) == SUCCESS)
+        {
+            stat = ec_sign_update(ctx, map.data, map.size);
+            file_io_unmap(&map);
+            return stat;
+        }
+    }
+    return file_io_process_fd(msg, MSG_CHUNK_SIZE, hash_message_cb, ctx);
+}
+
+/*
+ *
+ */
+status generate_signature(char* key, char* output, char* message)
+{
+    status stat = SUCCESS;
+    EC_private_key_t priv_key;
+    EC_signature_t sign;
+    EC_sign_ctx_t ctx;
+    sign_digest_t digest;
+    char signature_file_name[MAX_FILE_NAME_SIZE];
+    char cache_file_name[MAX_FILE_NAME_SIZE];
+    FILE *sign_file = NULL;
+    int msg;
+
+    CHECK_PARAM(key);
+    CHECK_PARAM(message);
+    sign.r = sign.s = NULL;
+    digest.mode = signature_mode;
+    digest.hash = signature_hash;
+    digest.chunk_size = MERKLE_CHUNK_SIZE;
+    digest.cache_file = NULL;
+    digest.batch_size = 0;
+    if (chunk_cache)
+    {
+        /*
+         * Only the Merkle tree leaves can be cached
+         */
+        if ((size_t) snprintf(cache_file_name, MAX_FILE_NAME_SIZE, "%s" CHUNK_CACHE_FILE_SUFFIX,
+                              message) >= MAX_FILE_NAME_SIZE)
+        {
+            ERROR_LOG("Message file name too long %s\n", message);
+            return FAIL;
+        }
+        digest.mode = SIGN_MODE_MERKLE;
+        digest.cache_file = cache_file_name;
+    }
+    msg = open(message, O_RDONLY);
+    if (msg < 0)
+    {
+        ERROR_LOG("Can not open message file %s\n", message);
+        return FAIL;
+    }
+
+    if(NULL == output)
+    {
+        strcpy(signature_file_name, message);
+        strcat(signature_file_name, SIGNATURE_FILE_SUFFIX);
+    }
+    else
+    {
+        strcpy(signature_file_name, output);
+    }
+    sign_file = fopen(signature_file_name, "w");
+    if (!sign_file)
+    {
+        ERROR_LOG("Can not create signature file %s\n", signature_file_name);
+        close(msg);
+        return FAIL;
+    }
+    fclose(sign_file);
+
+    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
+    {
+        close(msg);
+        return stat;
+    }
+    load_precomputed_tables(&priv_key.pub, NULL);
+
+    if (SIGN_MODE_MERKLE == digest.mode)
+    {
+        unsigned char dgst[EC_MAX_DIGEST_LEN];
+
+        stat = tree_digest(msg, &digest, dgst);
+        close(msg);
+        if (stat == SUCCESS)
+            stat = ec_sign_digest(&priv_key, &sign, dgst,
+                                  ec_hash_size(digest.hash), digest.hash);
+    }
+    else if ((stat = ec_sign_init(&ctx, &priv_key, digest.hash)) != SUCCESS)
+    {
+        close(msg);
+    }
+    else
+    {
+        stat = digest_message(&ctx, msg, &digest);
+        close(msg);
+
+        if (stat == SUCCESS)
+        {
+            stat = ec_sign_final(&ctx, &sign);
+        }
+        else
+        {
+            ec_sign_ctx_release(&ctx);
+        }
+    }
+
+    /*
+     * Free private key - we won't need it anymore
+     */
+    ec_release_key(&priv_key);
+
+    if (stat == SUCCESS)
+        stat = write_signature(&sign, &digest, signature_file_name);
+
+    ec_release_signature(&sign);
+    return stat;
+}
+
+static status verify_records(EC_public_key_t* pub_key, EC_signature_t* sign,
+                             const sign_digest_t* digest, char** messages,
+                             unsigned int count);
+
+/*
+ * verify_message
+ * Verifies signature of the message file with already loaded key
+ */
+static status verify_message(EC_public_key_t* pub_key, EC_signature_t* sign,
+                             const sign_digest_t* digest, char* message)
+{
+    status stat;
+    EC_sign_ctx_t ctx;
+    int msg;
+
+    if (SIGN_MODE_BATCH == digest->mode)
+        return verify_records(pub_key, sign, digest, &message, 1);
+
+    msg = open(message, O_RDONLY);
+
+    if (msg < 0)
+    {
+        ERROR_LOG("Can not open message file %s\n", message);
+        return FAIL;
+    }
+    if (SIGN_MODE_MERKLE == digest->mode)
+    {
+        unsigned char dgst[EC_MAX_DIGEST_LEN];
+
+        if ((stat = tree_digest(msg, digest, dgst)) == SUCCESS)
+            stat = ec_verify_digest(pub_key, sign, dgst,
+                                    ec_hash_size(digest->hash), digest->hash);
+    }
+    else if ((stat = ec_verify_init(&ctx, pub_key, digest->hash)) == SUCCESS)
+    {
+        stat = digest_message(&ctx, msg, digest);
+        if (stat == SUCCESS)
+            stat = ec_verify_final(&ctx, sign);
+        else
+            ec_sign_ctx_release(&ctx);
+    }
+    close(msg);
+    return stat;
+}
+
+/*
+ *
+ */
+status verify_signature(char* pub_key_name, char* output, char* message)
+{
+    status stat = SUCCESS;
+    EC_public_key_t pub_key;
+    EC_signature_t sign;
+    sign_digest_t digest;
+
+    CHECK_PARAM(pub_key_name);
+    CHECK_PARAM(output);
+    CHECK_PARAM(message);
+
+    if ((stat = read_public_key(&pub_key, pub_key_name)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read public key file\n");
+        return stat;
+    }
+    load_precomputed_tables(&pub_key, pub_key_name);
+
+    if ((stat = read_signature(&sign, &digest, output)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read signature file\n");
+        ec_release_public_key(&pub_key);
+        return stat;
+    }
+
+    stat = verify_message(&pub_key, &sign, &digest, message);
+
+    ec_release_signature(&sign);
+    ec_release_public_key(&pub_key);
+    return stat;
+}
+
+/*
+ * hex_digit
+ * Returns value of hex digit, -1 if it isn't one
+ */
+static int hex_digit(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * read_digest
+ * Gets the message digest for hash from the command line argument,
+ * or from stdin if it is "-". The digest is in hex, from stdin it can
+ * also be binary. A binary digest that happens to be all hex digits
+ * is rejected, it can't be told from a hex one of another hash.
+ * Everything after the hex digest is ignored, so the output of
+ * sha512sum or openssl dgst -r can be passed as it is
+ */
+static status read_digest(const char* arg, ec_hash_type hash,
+                          unsigned char* dgst, size_t* dgst_len)
+{
+    char buff[4 * SHA512_LEN + 1];
+    const char* hex = buff;
+    size_t len, dlen = ec_hash_size(hash);
+    size_t i;
+    int is_hex = 1;
+
+    if (strcmp(arg, "-") == 0)
+    {
+        len = fread(buff, 1, sizeof(buff) - 1, stdin);
+        if (ferror(stdin))
+        {
+            ERROR_LOG("Can not read digest from stdin\n");
+            return FAIL;
+        }
+    }
+    else
+    {
+        len = strlen(arg);
+        if (len >= sizeof(buff))
+            len = sizeof(buff) - 1;
+        memcpy(buff, arg, len);
+    }
+    buff[len] = '\0';
+
+    for (i = 0; i < len; i++)
+    {
+        if (hex_digit(buff[i]) < 0)
+        {
+            is_hex = 0;
+            break;
+        }
+    }
+    if ((len == dlen) && !is_hex)
+    {
+        memcpy(dgst, buff, dlen);
+        *dgst_len = dlen;
+        return SUCCESS;
+    }
+    /*
+     * sha512sum starts the line with a backslash if it escaped the file name
+     */
+    if ('\\' == *hex)
+        hex++;
+    len = 0;
+    while (hex[len] && (hex[len] != ' ') && (hex[len] != '\t') &&
+            (hex[len] != '\n') && (hex[len] != '\r'))
+        len++;
+    if (len != 2 * dlen)
+    {
+        ERROR_LOG("Expected %u bytes %s digest\n", (unsigned int) dlen,
+                  EC_HASH_LEGACY == hash ? "sha512" : ec_hash_name(hash));
+        return FAIL;
+    }
+    for (i = 0; i < dlen; i++)
+    {
+        int hi = hex_digit(hex[2 * i]);
+        int lo = hex_digit(hex[2 * i + 1]);
+
+        if ((hi < 0) || (lo < 0))
+        {
+            ERROR_LOG("Invalid hex digest\n");
+            return FAIL;
+        }
+        dgst[i] = (unsigned char) ((hi << 4) | lo);
+    }
+    *dgst_len = dlen;
+    return SUCCESS;
+}
+
+status generate_signature_digest(char* key, char* output, char* digest_arg)
+{
+    status stat;
+    EC_private_key_t priv_key;
+    EC_signature_t sign;
+    sign_digest_t digest;
+    unsigned char dgst[SHA512_LEN];
+    size_t dgst_len;
+
+    CHECK_PARAM(key);
+    CHECK_PARAM(output);
+    CHECK_PARAM(digest_arg);
+
+    /*
+     * The signature is the same as one made of the message in stream
+     * mode, so the message can be verified with it later on
+     */
+    digest.mode = SIGN_MODE_STREAM;
+    digest.hash = signature_hash;
+    digest.chunk_size = 0;
+    digest.cache_file = NULL;
+    digest.batch_size = 0;
+    if ((stat = read_digest(digest_arg, digest.hash, dgst, &dgst_len)) != SUCCESS)
+        return stat;
+
+    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
+        return stat;
+    load_precomputed_tables(&priv_key.pub, NULL);
+
+    sign.r = sign.s = NULL;
+    stat = ec_sign_digest(&priv_key, &sign, dgst, dgst_len, digest.hash);
+    ec_release_key(&priv_key);
+
+    if (stat == SUCCESS)
+        stat = write_signature(&sign, &digest, output);
+
+    ec_release_signature(&sign);
+    return stat;
+}
+
+status verify_signature_digest(char* pub_key_name, char* sign_file, char* digest_arg)
+{
+    status stat;
+    EC_public_key_t pub_key;
+    EC_signature_t sign;
+    sign_digest_t digest;
+    unsigned char dgst[SHA512_LEN];
+    size_t dgst_len;
+
+    CHECK_PARAM(pub_key_name);
+    CHECK_PARAM(sign_file);
+    CHECK_PARAM(digest_arg);
+
+    sign.r = sign.s = NULL;
+    if ((stat = read_signature(&sign, &digest, sign_file)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read signature file\n");
+        ec_release_signature(&sign);
+        return stat;
+    }
+    if (SIGN_MODE_STREAM != digest.mode)
+    {
+        ERROR_LOG("Only stream mode signatures can be verified with a digest\n");
+        ec_release_signature(&sign);
+        return FAIL;
+    }
+    if ((stat = read_digest(digest_arg, digest.hash, dgst, &dgst_len)) != SUCCESS)
+    {
+        ec_release_signature(&sign);
+        return stat;
+    }
+    if ((stat = read_public_key(&pub_key, pub_key_name)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read public key file\n");
+        ec_release_signature(&sign);
+        return stat;
+    }
+    load_precomputed_tables(&pub_key, pub_key_name);
+
+    stat = ec_verify_digest(&pub_key, &sign, dgst, dgst_len, digest.hash);
+
+    ec_release_signature(&sign);
+    ec_release_public_key(&pub_key);
+    return stat;
+}
+
+/*
+ * Message of a batch, mapped into memory
+ */
+typedef struct batch_msg_s
+{
+    char* name;
+    char sign_file[MAX_FILE_NAME_SIZE];
+    file_io_map_t map;
+    const void* data;
+    size_t len;
+} batch_msg_t;
+
+/*
+ * batch_msg_open
+ * Maps the message and builds its signature file name
+ */
+static status batch_msg_open(batch_msg_t* msg, char* name)
+{
+    struct stat st;
+    int fd;
+
+    msg->name = name;
+    msg->map.map = NULL;
+    msg->data = NULL;
+    msg->len = 0;
+    if ((size_t) snprintf(msg->sign_file, MAX_FILE_NAME_SIZE, "%s" SIGNATURE_FILE_SUFFIX,
+                          name) >= MAX_FILE_NAME_SIZE)
+    {
+        ERROR_LOG("Message file name too long %s\n", name);
+        return FAIL;
+    }
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+        ERROR_LOG("Can not open message file %s\n", name);
+        return FAIL;
+    }
+    if (file_io_map_fd(fd, &msg->map) == SUCCESS)
+    {
+        msg->data = msg->map.data;
+        msg->len = msg->map.size;
+    }
+    else if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size == 0))
+    {
+        msg->data = PEM_EMPTY_STR;
+    }
+    else
+    {
+        ERROR_LOG("Message %s is not a regular file, sign it on its own\n", name);
+        close(fd);
+        return FAIL;
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+static void batch_msg_close(batch_msg_t* msgs, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        file_io_unmap(&msgs[i].map);
+    }
+}
+
+/*
+ * verify_batch_result
+ * Reports result of one message of a batch and merges it into
+ * the result of the whole batch. Failure beats invalid signature
+ */
+static status verify_batch_result(status stat, status result, const char* message)
+{
+    if (SUCCESS == result)
+    {
+        INFO_LOG("%s: signature is valid\n", message);
+    }
+    else if (SIGNATURE_INVALID == result)
+    {
+        INFO_LOG("%s: signature is NOT valid\n", message);
+    }
+    else
+    {
+        INFO_LOG("%s: signature verify failed\n", message);
+    }
+    if ((FAIL == stat) || (SUCCESS == result))
+        return stat;
+    return (SIGNATURE_INVALID == result) ? result : FAIL;
+}
+
+/*
+ * write_proof
+ * Writes inclusion proof of message number index of the batch
+ */
+static status write_proof(const char* message, unsigned long index,
+                          const unsigned char* proof, size_t len)
+{
+    char file_name[MAX_FILE_NAME_SIZE];
+    unsigned char* data;
+    status stat = SUCCESS;
+    FILE* out_file;
+    unsigned int i;
+
+    if ((size_t) snprintf(file_name, MAX_FILE_NAME_SIZE, "%s" PROOF_FILE_SUFFIX,
+                          message) >= MAX_FILE_NAME_SIZE)
+    {
+        ERROR_LOG("Message file name too long %s\n", message);
+        return FAIL;
+    }
+    data = malloc(PROOF_INDEX_SIZE + len);
+    if (!data)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        return FAIL;
+    }
+    for (i = 0; i < PROOF_INDEX_SIZE; i++)
+        data[i] = (unsigned char) ((unsigned long long) index >> (8 * (PROOF_INDEX_SIZE - 1 - i)));
+    memcpy(data + PROOF_INDEX_SIZE, proof, len);
+
+    out_file = fopen(file_name, "w");
+    if (!out_file)
+    {
+        ERROR_LOG("Can not create inclusion proof file %s\n", file_name);
+        FREE(data);
+        return FAIL;
+    }
+    if (!PEM_write(out_file, PEM_PROOF_NAME, PEM_EMPTY_STR, data, (long) (PROOF_INDEX_SIZE + len)))
+    {
+        ERROR_LOG("Filed to wirte inclusion proof to %s file\n", file_name);
+        stat = FAIL;
+    }
+    fclose(out_file);
+    FREE(data);
+    return stat;
+}
+
+/*
+ * read_proof
+ * Reads inclusion proof of the message, dlen bytes per hash
+ */
+static status read_proof(const char* message, unsigned int dlen, unsigned long* index,
+                         unsigned char* proof, unsigned int* proof_count)
+{
+    char file_name[MAX_FILE_NAME_SIZE];
+    char *name = NULL, *header = NULL;
+    unsigned char *data = NULL;
+    long len = 0;
+    status stat = SUCCESS;
+    FILE* file;
+    unsigned int i;
+
+    if ((size_t) snprintf(file_name, MAX_FILE_NAME_SIZE, "%s" PROOF_FILE_SUFFIX,
+                          message) >= MAX_FILE_NAME_SIZE)
+    {
+        ERROR_LOG("Message file name too long %s\n", message);
+        return FAIL;
+    }
+    file = fopen(file_name, "r");
+    if (!file)
+    {
+        ERROR_LOG("Can not open inclusion proof file %s\n", file_name);
+        return FAIL;
+    }
+    if (PEM_read(file, &name, &header, &data, &len) != 1)
+    {
+        ERROR_LOG("PEM_read failed to read %s file\n", file_name);
+        fclose(file);
+        return FAIL;
+    }
+    fclose(file);
+
+    if ((strcmp(name, PEM_PROOF_NAME) != 0) || (len < PROOF_INDEX_SIZE))
+    {
+        ERROR_LOG("The file %s is not an inclusion proof\n", file_name);
+        stat = FAIL;
+    }
+    else if (((len - PROOF_INDEX_SIZE) % dlen) ||
+             ((unsigned long) (len - PROOF_INDEX_SIZE) > (unsigned long) MERKLE_MAX_PROOF * dlen))
+    {
+        ERROR_LOG("Inclusion proof %s doesn't match the signature hash\n", file_name);
+        stat = FAIL;
+    }
+    else
+    {
+        unsigned long long idx = 0;
+
+        for (i = 0; i < PROOF_INDEX_SIZE; i++)
+            idx = (idx << 8) | data[i];
+        *index = (unsigned long) idx;
+        *proof_count = (unsigned int) ((len - PROOF_INDEX_SIZE) / dlen);
+        memcpy(proof, data + PROOF_INDEX_SIZE, (size_t) (len - PROOF_INDEX_SIZE));
+    }
+    FREE(data);
+    FREE(name);
+    FREE(header);
+    return stat;
+}
+
+status generate_batch_signature(char* key, char* output, char** messages, unsigned int count)
+{
+    status stat = SUCCESS;
+    EC_private_key_t priv_key;
+    EC_signature_t sign;
+    sign_digest_t digest;
+    merkle_batch_t batch;
+    batch_msg_t msg;
+    unsigned char root[SHA512_LEN];
+    unsigned char dgst[EC_MAX_DIGEST_LEN];
+    unsigned char* proof;
+    unsigned int proof_count, i;
+    int md_algo;
+
+    CHECK_PARAM(key);
+    CHECK_PARAM(output);
+    CHECK_PARAM(messages);
+
+    digest.mode = SIGN_MODE_BATCH;
+    digest.hash = signature_hash;
+    digest.chunk_size = 0;
+    digest.cache_file = NULL;
+    digest.batch_size = count;
+    md_algo = ec_hash_md_algo(digest.hash);
+
+    if ((stat = check_tree_hash(digest.hash, "batch signatures with proofs")) != SUCCESS)
+        return stat;
+    if ((stat = merkle_batch_init(&batch, md_algo, count)) != SUCCESS)
+        return stat;
+
+    for (i = 0; (i < count) && (SUCCESS == stat); i++)
+    {
+        if ((stat = batch_msg_open(&msg, messages[i])) == SUCCESS)
+        {
+            stat = merkle_batch_leaf(&batch, i, msg.data, msg.len);
+            batch_msg_close(&msg, 1);
+        }
+    }
+    if (SUCCESS == stat)
+        stat = merkle_batch_root(&batch, root);
+    if (SUCCESS != stat)
+    {
+        merkle_batch_release(&batch);
+        return stat;
+    }
+    LOG("Signing batch of %u messages\n", count);
+
+    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
+    {
+        merkle_batch_release(&batch);
+        return stat;
+    }
+    load_precomputed_tables(&priv_key.pub, NULL);
+
+    sign.r = sign.s = NULL;
+    stat = ec_tagged_digest(digest.hash, SIGN_TAG_BATCH, count, root, batch.dlen, dgst);
+    if (SUCCESS == stat)
+        stat = ec_sign_digest(&priv_key, &sign, dgst, ec_hash_size(digest.hash),
+                              digest.hash);
+    ec_release_key(&priv_key);
+    if (SUCCESS == stat)
+        stat = write_signature(&sign, &digest, output);
+    ec_release_signature(&sign);
+
+    proof = malloc((size_t) MERKLE_MAX_PROOF * batch.dlen);
+    if (!proof)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        stat = FAIL;
+    }
+    for (i = 0; (i < count) && (SUCCESS == stat); i++)
+    {
+        stat = merkle_batch_proof(&batch, i, proof, &proof_count);
+        if (SUCCESS == stat)
+            stat = write_proof(messages[i], i, proof, (size_t) proof_count * batch.dlen);
+    }
+    FREE(proof);
+    merkle_batch_release(&batch);
+    return stat;
+}
+
+/*
+ * verify_records
+ * Checks inclusion proofs of the messages against batch signature.
+ * The signature is verified once for all the messages of the batch,
+ * the root the others lead to only has to match
+ */
+static status verify_records(EC_public_key_t* pub_key, EC_signature_t* sign,
+                             const sign_digest_t* digest, char** messages,
+                             unsigned int count)
+{
+    status stat = SUCCESS, result;
+    int md_algo = ec_hash_md_algo(digest->hash);
+    unsigned int dlen = gcry_md_get_algo_dlen(md_algo);
+    unsigned char root[SHA512_LEN], signed_root[SHA512_LEN];
+    unsigned char* proof;
+    unsigned int proof_count, i;
+    unsigned long index;
+    int verified = 0;
+    batch_msg_t msg;
+
+    if ((stat = check_tree_hash(digest->hash, "batch signatures with proofs")) != SUCCESS)
+        return stat;
+    proof = malloc((size_t) MERKLE_MAX_PROOF * dlen);
+    if (!proof)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        return FAIL;
+    }
+    for (i = 0; i < count; i++)
+    {
+        result = read_proof(messages[i], dlen, &index, proof, &proof_count);
+        if (SUCCESS == result)
+        {
+            result = batch_msg_open(&msg, messages[i]);
+            if (SUCCESS == result)
+            {
+                /*
+                 * A proof that doesn't fit the batch proves nothing
+                 */
+                if (merkle_proof_root(md_algo, msg.data, msg.len, index, digest->batch_size,
+                                      proof, proof_count, root) != SUCCESS)
+                    result = SIGNATURE_INVALID;
+                batch_msg_close(&msg, 1);
+            }
+        }
+        if (SUCCESS == result)
+        {
+            if (!verified || memcmp(root, signed_root, dlen))
+            {
+                unsigned char dgst[EC_MAX_DIGEST_LEN];
+
+                result = ec_tagged_digest(digest->hash, SIGN_TAG_BATCH, digest->batch_size,
+                                          root, dlen, dgst);
+                if (SUCCESS == result)
+                    result = ec_verify_digest(pub_key, sign, dgst,
+                                              ec_hash_size(digest->hash), digest->hash);
+                if (SUCCESS == result)
+                {
+                    memcpy(signed_root, root, dlen);
+                    verified = 1;
+                }
+            }
+            else
+            {
+                LOG("Message is in the batch\n");
+            }
+        }
+        stat = verify_batch_result(stat, result, messages[i]);
+    }
+    FREE(proof);
+    return stat;
+}
+
+status verify_batch_signature(char* pub_key_name, char* sign_file, char** messages,
+                              unsigned int count)
+{
+    status stat;
+    EC_public_key_t pub_key;
+    EC_signature_t sign;
+    sign_digest_t digest;
+
+    CHECK_PARAM(pub_key_name);
+    CHECK_PARAM(sign_file);
+    CHECK_PARAM(messages);
+
+    sign.r = sign.s = NULL;
+    if ((stat = read_signature(&sign, &digest, sign_file)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read signature file\n");
+        ec_release_signature(&sign);
+        return stat;
+    }
+    if (SIGN_MODE_BATCH != digest.mode)
+    {
+        ERROR_LOG("%s is not a batch signature\n", sign_file);
+        ec_release_signature(&sign);
+        return FAIL;
+    }
+    if ((stat = read_public_key(&pub_key, pub_key_name)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read public key file\n");
+        ec_release_signature(&sign);
+        return stat;
+    }
+    load_precomputed_tables(&pub_key, pub_key_name);
+
+    stat = verify_records(&pub_key, &sign, &digest, messages, count);
+
+    ec_release_signature(&sign);
+    ec_release_public_key(&pub_key);
+    return stat;
+}
+
+status generate_signatures(char* key, char** messages, unsigned int count)
+{
+    status stat = SUCCESS;
+    EC_private_key_t priv_key;
+    EC_signature_t signs[SIGN_BATCH_SIZE];
+    batch_msg_t* msgs;
+    const void* data[SIGN_BATCH_SIZE];
+    size_t lens[SIGN_BATCH_SIZE];
+    sign_digest_t digest;
+    unsigned int done, n, i;
+
+    CHECK_PARAM(key);
+    CHECK_PARAM(messages);
+
+    /*
+     * Merkle mode signatures are made of big files, hashing them
+     * together wouldn't gain anything
+     */
+    if ((SIGN_MODE_STREAM != signature_mode) || chunk_cache)
+    {
+        for (i = 0; (i < count) && (SUCCESS == stat); i++)
+        {
+            stat = generate_signature(key, NULL, messages[i]);
+        }
+        return stat;
+    }
+
+    digest.mode = SIGN_MODE_STREAM;
+    digest.hash = signature_hash;
+    digest.chunk_size = 0;
+    digest.cache_file = NULL;
+    digest.batch_size = 0;
+
+    msgs = malloc(SIGN_BATCH_SIZE * sizeof(batch_msg_t));
+    if (!msgs)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        return FAIL;
+    }
+    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
+    {
+        FREE(msgs);
+        return stat;
+    }
+    load_precomputed_tables(&priv_key.pub, NULL);
+
+    for (done = 0; (done < count) && (SUCCESS == stat); done += n)
+    {
+        n = count - done;
+        if (n > SIGN_BATCH_SIZE)
+            n = SIGN_BATCH_SIZE;
+
+        for (i = 0; i < n; i++)
+        {
+            if ((stat = batch_msg_open(&msgs[i], messages[done + i])) != SUCCESS)
+                break;
+            data[i] = msgs[i].data;
+            lens[i] = msgs[i].len;
+        }
+        if (SUCCESS == stat)
+        {
+            LOG("Signing batch of %u messages\n", n);
+            stat = ec_sign_batch(&priv_key, digest.hash, data, lens, n, signs);
+            if (SUCCESS == stat)
+            {
+                for (i = 0; i < n; i++)
+                {
+                    if (SUCCESS == stat)
+                        stat = write_signature(&signs[i], &digest, msgs[i].sign_file);
+                    ec_release_signature(&signs[i]);
+                }
+            }
+        }
+        batch_msg_close(msgs, i < n ? i + 1 : n);
+    }
+
+    ec_release_key(&priv_key);
+    FREE(msgs);
+    return stat;
+}
+
+status verify_signatures(char* pub_key_name, char** messages, unsigned int count)
+{
+    status stat = SUCCESS;
+    EC_public_key_t pub_key;
+    EC_signature_t signs[SIGN_BATCH_SIZE], batch_signs[SIGN_BATCH_SIZE];
+    sign_digest_t digests[SIGN_BATCH_SIZE];
+    status results[SIGN_BATCH_SIZE], batch_results[SIGN_BATCH_SIZE];
+    batch_msg_t* msgs;
+    const void* data[SIGN_BATCH_SIZE];
+    size_t lens[SIGN_BATCH_SIZE];
+    unsigned int idx[SIGN_BATCH_SIZE];
+    unsigned int done, n, i, k;
+    int hash;
+
+    CHECK_PARAM(pub_key_name);
+    CHECK_PARAM(messages);
+
+    msgs = malloc(SIGN_BATCH_SIZE * sizeof(batch_msg_t));
+    if (!msgs)
+    {
+        ERROR_LOG("Can't allocate memory\n");
+        return FAIL;
+    }
+    if ((stat = read_public_key(&pub_key, pub_key_name)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read public key file\n");
+        FREE(msgs);
+        return stat;
+    }
+    load_precomputed_tables(&pub_key, pub_key_name);
+
+    for (done = 0; done < count; done += n)
+    {
+        n = count - done;
+        if (n > SIGN_BATCH_SIZE)
+            n = SIGN_BATCH_SIZE;
+
+        /*
+         * Read the signatures first, Merkle mode ones are verified
+         * straight away, stream mode ones are mapped for the batch
+         */
+        for (i = 0; i < n; i++)
+        {
+            char* message = messages[done + i];
+
+            signs[i].r = signs[i].s = NULL;
+            msgs[i].map.map = NULL;
+            results[i] = batch_msg_open(&msgs[i], message);
+            if (SUCCESS == results[i])
+                results[i] = read_signature(&signs[i], &digests[i], msgs[i].sign_file);
+            if ((SUCCESS == results[i]) && (SIGN_MODE_STREAM != digests[i].mode))
+            {
+                file_io_unmap(&msgs[i].map);
+                results[i] = verify_message(&pub_key, &signs[i], &digests[i], message);
+                stat = verify_batch_result(stat, results[i], message);
+                results[i] = BAD_PARAMS; /* done with */
+            }
+            else if (SUCCESS != results[i])
+            {
+                stat = verify_batch_result(stat, results[i], message);
+            }
+        }
+        /*
+         * Hash together messages signed with the same hash
+         */
+        for (hash = EC_HASH_LEGACY; hash < EC_HASH_TERM; hash++)
+        {
+            for (i = 0, k = 0; i < n; i++)
+            {
+                if ((SUCCESS == results[i]) && (digests[i].hash == (ec_hash_type) hash))
+                {
+                    idx[k] = i;
+                    data[k] = msgs[i].data;
+                    lens[k] = msgs[i].len;
+                    batch_signs[k] = signs[i];
+                    batch_results[k] = FAIL;
+                    k++;
+                }
+            }
+            if (!k)
+                continue;
+            LOG("Verifying batch of %u %s signatures\n", k, ec_hash_name((ec_hash_type) hash));
+            ec_verify_batch(&pub_key, (ec_hash_type) hash, data, lens, k, batch_signs, batch_results);
+            for (i = 0; i < k; i++)
+            {
+                stat = verify_batch_result(stat, batch_results[i], messages[done + idx[i]]);
+                results[idx[i]] = BAD_PARAMS;
+            }
+        }
+        for (i = 0; i < n; i++)
+            ec_release_signature(&signs[i]);
+        batch_msg_close(msgs, n);
+    }
 
-    stat = ec_generate_signature(&priv_key, &sign, msg_buffer, (size_t) msg_size);
+    ec_release_public_key(&pub_key);
+    FREE(msgs);
+    return stat;
+}
 
-    /*
-     * Free private key - we won't need it anymore
-     */
-    ec_release_key(&priv_key);
+/*
+ * manifest_file_name
+ * Manifest of the directory goes next to it, <dir>.manifest
+ */
+static status manifest_file_name(char* file_name, const char* dir)
+{
+    size_t len = strlen(dir);
 
-    free(msg_buffer);
+    while ((len > 1) && (dir[len - 1] == '/'))
+        len--;
+    if ((size_t) snprintf(file_name, MAX_FILE_NAME_SIZE, "%.*s" MANIFEST_FILE_SUFFIX,
+                          (int) len, dir) >= MAX_FILE_NAME_SIZE)
+    {
+        ERROR_LOG("Directory name too long %s\n", dir);
+        return FAIL;
+    }
+    return SUCCESS;
+}
 
-    if (stat == SUCCESS)
-        stat = write_signature(&sign, signature_file_name);
+/*
+ * manifest_hash_type
+ * Files in the manifest are hashed with the signature hash,
+ * SHA-512 for the legacy one
+ */
+static ec_hash_type manifest_hash_type(ec_hash_type hash)
+{
+    return (EC_HASH_LEGACY == hash) ? EC_HASH_SHA512 : hash;
+}
+
+status generate_manifest(char* key, char* output, char* dir)
+{
+    status stat;
+    EC_private_key_t priv_key;
+    EC_signature_t sign;
+    unsigned char dgst[EC_MAX_DIGEST_LEN];
+    sign_digest_t digest;
+    ec_hash_type file_hash = manifest_hash_type(signature_hash);
+    char manifest_name[MAX_FILE_NAME_SIZE];
+    manifest_t m;
+    char* text = NULL;
+    size_t text_len = 0;
+    unsigned long i;
+    FILE* out;
+
+    CHECK_PARAM(key);
+    CHECK_PARAM(dir);
+
+    if ((stat = check_tree_hash(file_hash, "manifests")) != SUCCESS)
+        return stat;
+    if (!output)
+    {
+        if (manifest_file_name(manifest_name, dir) != SUCCESS)
+            return FAIL;
+        output = manifest_name;
+    }
+
+    if ((stat = manifest_scan(&m, dir, ec_hash_md_algo(file_hash))) != SUCCESS)
+    {
+        manifest_release(&m);
+        return stat;
+    }
+    manifest_remove_file(&m, dir, output);
+    LOG("Hashing %lu files\n", m.count);
+    manifest_hash(&m, dir, jobs);
+    for (i = 0; i < m.count; i++)
+    {
+        if (SUCCESS != m.entries[i].stat)
+        {
+            ERROR_LOG("Failed to hash %s/%s\n", dir, m.entries[i].path);
+            stat = FAIL;
+        }
+    }
+    if (SUCCESS == stat)
+        stat = manifest_format(&m, ec_hash_name(file_hash), &text, &text_len);
+    manifest_release(&m);
+    if (SUCCESS != stat)
+        return stat;
+
+    digest.mode = SIGN_MODE_STREAM;
+    digest.hash = signature_hash;
+    digest.chunk_size = 0;
+    digest.cache_file = NULL;
+    digest.batch_size = 0;
+    sign.r = sign.s = NULL;
+
+    if ((stat = read_private_key(&priv_key, key)) != SUCCESS)
+    {
+        FREE(text);
+        return stat;
+    }
+    load_precomputed_tables(&priv_key.pub, NULL);
+    if ((stat = ec_tagged_digest(digest.hash, SIGN_TAG_MANIFEST, 0, text, text_len,
+                                 dgst)) == SUCCESS)
+        stat = ec_sign_digest(&priv_key, &sign, dgst, ec_hash_size(digest.hash), digest.hash);
+    ec_release_key(&priv_key);
 
+    /*
+     * The signature of the manifest text goes right after it
+     */
+    if (SUCCESS == stat)
+    {
+        out = fopen(output, "w");
+        if (!out)
+        {
+            ERROR_LOG("Can not create manifest file %s\n", output);
+            stat = FAIL;
+        }
+        else
+        {
+            if (fwrite(text, 1, text_len, out) != text_len)
+            {
+                ERROR_LOG("Failed to write manifest file %s\n", output);
+                stat = FAIL;
+            }
+            if (SUCCESS == stat)
+                stat = write_signature_fp(&sign, &digest, out, output);
+            if ((fclose(out) != 0) && (SUCCESS == stat))
+            {
+                ERROR_LOG("Failed to write manifest file %s\n", output);
+                stat = FAIL;
+            }
+        }
+    }
+    if (SUCCESS == stat)
+        INFO_LOG("Manifest of %s stored in %s\n", dir, output);
     ec_release_signature(&sign);
+    FREE(text);
     return stat;
 }
 
 /*
- *
+ * manifest_compare
+ * Goes through both sorted lists and reports the differences
  */
-status verify_signature(char* pub_key_name, char* output, char* message)
+static status manifest_compare(const manifest_t* signed_m, const manifest_t* now)
+{
+    status stat = SUCCESS;
+    unsigned long i = 0, j = 0;
+
+    while ((i < signed_m->count) || (j < now->count))
+    {
+        const manifest_entry_t* e = (i < signed_m->count) ? &signed_m->entries[i] : NULL;
+        const manifest_entry_t* f = (j < now->count) ? &now->entries[j] : NULL;
+        int cmp = !e ? 1 : (!f ? -1 : strcmp(e->path, f->path));
+
+        if (cmp < 0)
+        {
+            INFO_LOG("%s: missing\n", e->path);
+            if (FAIL != stat)
+                stat = SIGNATURE_INVALID;
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            INFO_LOG("%s: not in the manifest\n", f->path);
+            if (FAIL != stat)
+                stat = SIGNATURE_INVALID;
+            j++;
+        }
+        else
+        {
+            if (SUCCESS != f->stat)
+            {
+                INFO_LOG("%s: can not be read\n", f->path);
+                stat = FAIL;
+            }
+            else if ((e->target || f->target) ?
+                     (!e->target || !f->target || strcmp(e->target, f->target)) :
+                     ((e->size != f->size) || memcmp(e->digest, f->digest, now->dlen)))
+            {
+                INFO_LOG("%s: changed\n", f->path);
+                if (FAIL != stat)
+                    stat = SIGNATURE_INVALID;
+            }
+            else
+            {
+                LOG("%s: OK\n", f->path);
+            }
+            i++;
+            j++;
+        }
+    }
+    return stat;
+}
+
+status verify_manifest(char* pub_key_name, char* manifest_file, char* dir)
 {
     status stat = SUCCESS;
     EC_public_key_t pub_key;
     EC_signature_t sign;
-    void* msg_buffer = NULL;
-    long msg_size = 0;
-    int dummy;
+    unsigned char dgst[EC_MAX_DIGEST_LEN];
+    sign_digest_t digest;
+    ec_hash_type file_hash;
+    char manifest_name[MAX_FILE_NAME_SIZE];
+    char hash_name[32];
+    manifest_t signed_m, now;
+    file_io_map_t map;
+    size_t text_len;
+    FILE* file;
+    int fd;
 
     CHECK_PARAM(pub_key_name);
-    CHECK_PARAM(output);
-    CHECK_PARAM(message);
+    CHECK_PARAM(dir);
 
-    FILE *msg = fopen(message, "r");
-    if (!msg)
+    if (!manifest_file)
     {
-        ERROR_LOG("Can not open message file %s\n", message);
+        if (manifest_file_name(manifest_name, dir) != SUCCESS)
+            return FAIL;
+        manifest_file = manifest_name;
+    }
+    fd = open(manifest_file, O_RDONLY);
+    if ((fd < 0) || (file_io_map_fd(fd, &map) != SUCCESS))
+    {
+        ERROR_LOG("Can not read manifest file %s\n", manifest_file);
+        if (fd >= 0)
+            close(fd);
         return FAIL;
     }
+    close(fd);
 
-    fseek(msg, 0, SEEK_END);
-    msg_size = ftell(msg);
+    /*
+     * Manifest text is everything up to the signature. Its lines
+     * start with a hex digest, so the first one with '-' is the PEM
+     */
+    text_len = 0;
+    while ((text_len < map.size) && (map.data[text_len] != '-'))
+    {
+        const unsigned char* nl = memchr(map.data + text_len, '\n', map.size - text_len);
 
-    if (MAX_MSG_SIZE < msg_size)
+        text_len = nl ? (size_t) (nl - map.data) + 1 : map.size;
+    }
+    if (text_len == map.size)
     {
-        ERROR_LOG("Max message size is " MAX_MSG_SIZE_STR "\n");
-        fclose(msg);
+        ERROR_LOG("Manifest %s is not signed\n", manifest_file);
+        file_io_unmap(&map);
         return FAIL;
     }
 
-    fseek(msg, 0, SEEK_SET);
+    sign.r = sign.s = NULL;
+    file = fopen(manifest_file, "r");
+    if (!file || fseek(file, (long) text_len, SEEK_SET) ||
+            (read_signature_fp(&sign, &digest, file, manifest_file) != SUCCESS) ||
+            (SIGN_MODE_STREAM != digest.mode))
+    {
+        ERROR_LOG("Failed to read manifest signature\n");
+        stat = FAIL;
+    }
+    if (file)
+        fclose(file);
+
+    if ((SUCCESS == stat) && ((stat = read_public_key(&pub_key, pub_key_name)) == SUCCESS))
+    {
+        load_precomputed_tables(&pub_key, pub_key_name);
+        if ((stat = ec_tagged_digest(digest.hash, SIGN_TAG_MANIFEST, 0, map.data, text_len,
+                                     dgst)) == SUCCESS)
+            stat = ec_verify_digest(&pub_key, &sign, dgst, ec_hash_size(digest.hash),
+                                    digest.hash);
+        ec_release_public_key(&pub_key);
+    }
+    ec_release_signature(&sign);
+    if (SUCCESS != stat)
+    {
+        file_io_unmap(&map);
+        return stat;
+    }
 
-    msg_buffer = malloc((size_t) msg_size);
-    if (! msg_buffer)
+    /*
+     * The manifest is genuine, now check the files against it
+     */
+    if ((manifest_hash_name((const char*) map.data, text_len, hash_name, sizeof(hash_name))
+            != SUCCESS) || (ec_hash_by_name(hash_name, &file_hash) != SUCCESS) ||
+            (EC_HASH_LEGACY == file_hash) || !ec_hash_md_algo(file_hash) ||
+            (manifest_parse(&signed_m, (const char*) map.data, text_len,
+                            ec_hash_md_algo(file_hash)) != SUCCESS))
     {
-        ERROR_LOG("Memory allocation failed to allocate %d bytes \n", (int) msg_size);
-        fclose(msg);
+        ERROR_LOG("Invalid manifest %s\n", manifest_file);
+        file_io_unmap(&map);
         return FAIL;
     }
+    file_io_unmap(&map);
 
-    dummy = fread(msg_buffer, 1, (size_t) msg_size, msg);
+    if ((stat = manifest_scan(&now, dir, signed_m.md_algo)) == SUCCESS)
+    {
+        manifest_remove_file(&now, dir, manifest_file);
+        LOG("Hashing %lu files\n", now.count);
+        manifest_hash(&now, dir, jobs);
+        stat = manifest_compare(&signed_m, &now);
+    }
+    manifest_release(&now);
+    manifest_release(&signed_m);
+    return stat;
+}
 
-    if ((stat = read_public_key(&pub_key, pub_key_name)) != SUCCESS)
+/*
+ * State of the symmetric part of file encryption
+ */
+typedef struct encrypt_ctx_s
+{
+    sym_cipher_hdl_t *cipher;
+    HMAC_CTX *hmac;
+    FILE *out;
+    char buff[SYM_CIPHER_DATA_UNIT_SIZE];
+} encrypt_ctx_t;
+
+/*
+ * encrypt_cb
+ * Encrypts next chunk of the input file, writes it out
+ * and updates the HMAC over the cipher text
+ */
+static status encrypt_cb(void* ctx, const void* data, size_t len)
+{
+    encrypt_ctx_t* enc = (encrypt_ctx_t*) ctx;
+    status stat;
+
+    stat = sym_cipher_encrypt(enc->cipher, (void*) data, enc->buff, len);
+    if (SUCCESS == stat)
     {
-        ERROR_LOG("Failed to read public key file\n");
+        /*
+         * Check if everything got written
+         */
+        if (fwrite(enc->buff, 1, len, enc->out) != len)
+        {
+            ERROR_LOG("Failed to write encrypted file\n");
+            return FAIL;
+        }
+        HMAC_Update(enc->hmac, (unsigned char*) enc->buff, len);
+    }
+    return stat;
+}
+
+/*
+ * enc_point_export
+ * Puts the point R into buff as | len | R.x | len | R.y |
+ */
+static status enc_point_export(EC_enc_key_t* enc_key, unsigned char* buff, size_t* space)
+{
+    unsigned char *buff_ptr = buff;
+    size_t len = 0;
+
+    *space = 0;
+    if (gcry_mpi_print(GCRYMPI_FMT_USG, buff_ptr + 1,
+                       MAX_BIG_NUM_SIZE, &len, enc_key->R.x) != GPG_ERR_NO_ERROR)
+    {
+        ERROR_LOG("Filed to export data R.x ");
+        return FAIL;
     }
-    if ((SUCCESS == stat) &&
-            ((stat = read_signature(&sign, output)) != SUCCESS))
+    *buff_ptr = (unsigned char) len;
+    len += 1;
+    buff_ptr += len;
+    *space += len;
+    assert((MAX_BIG_NUM_SIZE * 2) > *space);
+
+    if (gcry_mpi_print(GCRYMPI_FMT_USG, buff_ptr + 1,
+                       MAX_BIG_NUM_SIZE, &len, enc_key->R.y) != GPG_ERR_NO_ERROR)
     {
-        ERROR_LOG("Failed to read signature file\n");
-        ec_release_public_key(&pub_key);
+        ERROR_LOG("Filed to export data R.y ");
+        return FAIL;
     }
+    *buff_ptr = (unsigned char) len;
+    len += 1;
+    *space += len;
+    assert((MAX_BIG_NUM_SIZE * 2) > *space);
+    return SUCCESS;
+}
 
-    if (stat == SUCCESS)
+/*
+ * enc_point_read
+ * Reads the point R written by enc_point_export. first is the first
+ * byte if it was read already, EOF if not. The raw bytes are appended
+ * to raw at *raw_len, as they are part of the authenticated header
+ */
+static status enc_point_read(FILE* f, int first, EC_enc_key_t* enc_key,
+                             unsigned char* raw, size_t* raw_len)
+{
+    big_number* coord[2] = { &enc_key->R.x, &enc_key->R.y };
+    unsigned int i;
+
+    for (i = 0; i < 2; i++)
     {
-        stat = ec_verify_signature(&pub_key, &sign, msg_buffer, msg_size);
-        ec_release_signature(&sign);
-        ec_release_public_key(&pub_key);
+        int size = (i == 0 && first != EOF) ? first : fgetc(f);
+
+        if ((size == EOF) || (size > MAX_BIG_NUM_SIZE) ||
+            (fread(raw + *raw_len + 1, 1, (size_t) size, f) != (size_t) size))
+        {
+            ERROR_LOG("The encrypted file is corrupted\n");
+            if (i)
+                mpi_release(enc_key->R.x);
+            return FAIL;
+        }
+        raw[*raw_len] = (unsigned char) size;
+        if (gcry_mpi_scan(coord[i], GCRYMPI_FMT_USG, raw + *raw_len + 1,
+                          (size_t) size, NULL) != GPG_ERR_NO_ERROR)
+        {
+            ERROR_LOG("Read data failed R.%c", i ? 'y' : 'x');
+            if (i)
+                mpi_release(enc_key->R.x);
+            return FAIL;
+        }
+        *raw_len += size + 1;
     }
+#ifdef JACOBIAN_COORDINATES
+    enc_key->R.z = mpi_new(0);
+    mpi_set_ui(enc_key->R.z, 1);
+#endif
+    return SUCCESS;
+}
 
-    free(msg_buffer);
-    return stat;
+/*
+ * is_stdio
+ * "-" stands for stdin or stdout
+ */
+static int is_stdio(const char* file_name)
+{
+    return file_name && (strcmp(file_name, "-") == 0);
+}
+
+/*
+ * close_data_file
+ * Closes the file unless it is stdin or stdout
+ */
+static void close_data_file(FILE* f)
+{
+    if (f && (f != stdin) && (f != stdout))
+        fclose(f);
+    else if (f == stdout)
+        fflush(f);
 }
 
 /*
  *
  */
-status encrypt(char* key_file, char* file_to_encrypt)
+status encrypt(char* key_file, char* file_to_encrypt, char* output, sym_cipher cipher)
 {
     status stat = SUCCESS;
     EC_enc_key_t enc_key;
     EC_public_key_t public_key;
     char enc_file_name[MAX_FILE_NAME_SIZE];
-    char plain_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
-    char cipher_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
 
     FILE* f_to_enc = NULL;
     FILE* f_enc = NULL;
 
     unsigned char hmac_buff[SHA1_LEN];
     unsigned int hmac_len = 0;
-    int dummy;
+    unsigned char header[ENC_HEADER_MAX_SIZE];
+    size_t header_len = 0;
+    int aead;
 
     CHECK_PARAM(key_file);
     CHECK_PARAM(file_to_encrypt);
 
-    f_to_enc = fopen(file_to_encrypt, "rb");
+    if (SYM_CIPHER_TERM == cipher)
+        cipher = sym_cipher_auto();
+    aead = sym_cipher_is_aead(cipher);
+    /*
+     * Files without header can't be decrypted from a pipe, nor
+     * checked before they are written out, so they are not made
+     * for one
+     */
+    if (!aead && (is_stdio(file_to_encrypt) || (output && is_stdio(output))))
+    {
+        ERROR_LOG("%s can not be used with stdin or stdout\n", cipher_names[cipher]);
+        return BAD_PARAMS;
+    }
+
+    f_to_enc = is_stdio(file_to_encrypt) ? stdin : fopen(file_to_encrypt, "rb");
 
     if (!f_to_enc)
     {
         ERROR_LOG("Failed to open file %s\n", file_to_encrypt);
         return FAIL;
     }
-    strcpy(enc_file_name, file_to_encrypt);
-    strcat(enc_file_name, ENCRYPTED_FILE_SUFFIX);
+    /*
+     * stdin goes to stdout unless told otherwise
+     */
+    if (output)
+    {
+        strncpy(enc_file_name, output, MAX_FILE_NAME_SIZE - 1);
+        enc_file_name[MAX_FILE_NAME_SIZE - 1] = '\0';
+    }
+    else if (is_stdio(file_to_encrypt))
+    {
+        strcpy(enc_file_name, "-");
+    }
+    else
+    {
+        strcpy(enc_file_name, file_to_encrypt);
+        strcat(enc_file_name, ENCRYPTED_FILE_SUFFIX);
+    }
 
-    f_enc = fopen(enc_file_name, "wb");
+    f_enc = is_stdio(enc_file_name) ? stdout : fopen(enc_file_name, "wb");
     if (!f_enc)
     {
         ERROR_LOG("Failed to create file %s\n", enc_file_name);
-        fclose(f_to_enc);
+        close_data_file(f_to_enc);
         return FAIL;
     }
 
     if ((stat = read_public_key(&public_key, key_file)) != SUCCESS)
     {
         ERROR_LOG("Failed to read public key file\n");
-        fclose(f_to_enc);
-        fclose(f_enc);
+        close_data_file(f_to_enc);
+        close_data_file(f_enc);
+        if (f_enc != stdout)
+            remove(enc_file_name);
         return FAIL;
     }
+    load_precomputed_tables(&public_key, key_file);
     /*
      * Asymetric part of the exercise
      * Generate symmetric key for ecnryption
@@ -823,142 +2471,130 @@ status encrypt(char* key_file, char* file_to_encrypt)
         ERROR_LOG("Failed to generate encryption key");
     }
     /*
-     * if ok we first put the the R point to the output file
-     * We will need to for decryption
+     * if ok we first put the header with the R point to the output file
+     * We will need to for decryption. AEAD files start with the magic,
+     * format version, cipher and key derivation function
      */
     if (SUCCESS == stat)
     {
-        unsigned char buff[MAX_BIG_NUM_SIZE * 2];
-        unsigned char *buff_ptr = buff;
-        size_t len = 0;
-        unsigned int space = 0;
-        if (gcry_mpi_print(GCRYMPI_FMT_USG, buff_ptr + 1,
-                           MAX_BIG_NUM_SIZE, &len, enc_key.R.x) == GPG_ERR_NO_ERROR)
-        {
-            *buff_ptr = (unsigned char) len;
-            len += 1;
-            buff_ptr += len;
-            space += len;
-            assert((MAX_BIG_NUM_SIZE * 2) > space);
-        }
-        else
-        {
-            ERROR_LOG("Filed to export data R.x ");
-            stat = FAIL;
-        }
-        if (gcry_mpi_print(GCRYMPI_FMT_USG, buff_ptr + 1,
-                           MAX_BIG_NUM_SIZE, &len, enc_key.R.y) == GPG_ERR_NO_ERROR)
+        size_t space = 0;
+
+        if (aead)
         {
-            *buff_ptr = (unsigned char) len;
-            len += 1;
-            buff_ptr += len;
-            space += len;
-            assert((MAX_BIG_NUM_SIZE * 2) > space);
+            memcpy(header, ENC_MAGIC, ENC_MAGIC_SIZE);
+            header[ENC_MAGIC_SIZE] = ENC_VERSION_SEGMENTED;
+            header[ENC_MAGIC_SIZE + 1] = (unsigned char) cipher;
+            header[ENC_MAGIC_SIZE + 2] = (unsigned char) kdf_type;
+            header[ENC_MAGIC_SIZE + 3] = ENC_SEGMENT_SHIFT;
+            header_len = ENC_MAGIC_SIZE + 4;
         }
-        else
+        stat = enc_point_export(&enc_key, header + header_len, &space);
+        header_len += space;
+        /*
+         * Put the header into output file
+         */
+        if ((SUCCESS == stat) &&
+            ((fwrite(header, 1, header_len, f_enc) != header_len) || fflush(f_enc)))
         {
-            ERROR_LOG("Filed to export data R.y ");
+            ERROR_LOG("Failed to write encrypted file\n");
             stat = FAIL;
         }
-        /*
-         * Put point R into output file
-         */
-        dummy = fwrite(buff, 1, space, f_enc);
     }
     /*
      * ECC part done now the symmetric part
      * of the exercise
      * if it went OK till now encrypt the file
-     * using symmetric cipher and key generated by EC
-     * and authenticate the ciphet text using HMAC
+     * using symmetric cipher and key generated by EC.
+     * AEAD ciphers seal the file segment by segment, each
+     * authenticated on its own, the others use a HMAC
      */
-    if (SUCCESS == stat)
+    if ((SUCCESS == stat) && aead)
     {
-        int read_write_ok = 1;
-        sym_cipher_hdl_t *cipher_ctx;
-        HMAC_CTX *hmac_ctx = HMAC_CTX_new();
+        enc_segment_params_t params;
+
         /*
-         * Init symmetric cipher (they say that blowfish is fast so use it for now)
-         * TODO take cipher as a parameter
+         * The segments are sealed on jobs threads, each with its own
+         * cipher session
          */
-
-	if (!hmac_ctx)
+        stat = enc_segment_params_init(&params, header, header_len,
+                                       enc_key.k2, ENC_SEGMENT_SHIFT);
+        if (SUCCESS == stat)
+        {
+            stat = enc_segment_encrypt_stream(&params, cipher, enc_key.k1, enc_key.key_size,
+                                              fileno(f_to_enc), fileno(f_enc), jobs);
+        }
+        if ((SUCCESS == stat) && fflush(f_enc))
+        {
+            ERROR_LOG("Failed to write encrypted file\n");
             stat = FAIL;
+        }
+    }
+    else if (SUCCESS == stat)
+    {
+        sym_cipher_hdl_t *cipher_ctx = NULL;
+        HMAC_CTX *hmac_ctx = NULL;
 
-        stat = sym_cipher_init(&cipher_ctx, SYM_CIPHER_BLOWFISH, enc_key.k1, enc_key.key_size);
-        HMAC_Init_ex(hmac_ctx, enc_key.k1, enc_key.key_size, EVP_sha1(), NULL);
+        /*
+         * Init symmetric cipher
+         */
+        stat = sym_cipher_init(&cipher_ctx, cipher, enc_key.k1, enc_key.key_size);
+        if (SUCCESS == stat)
+        {
+            hmac_ctx = HMAC_CTX_new();
+            if (!hmac_ctx)
+                stat = FAIL;
+            else
+                HMAC_Init_ex(hmac_ctx, enc_key.k1, enc_key.key_size, EVP_sha1(), NULL);
+        }
+        else
+        {
+            cipher_ctx = NULL;
+        }
 
         if (SUCCESS == stat)
         {
-            int read = 0;
-            int written = 0;
-            do
-            {
-                /*
-                 * Get chunk of data from input file
-                 */
-                read = fread(plain_txt_buff, 1, SYM_CIPHER_DATA_UNIT_SIZE, f_to_enc);
-                if (read)
-                {
-                    /*
-                     * encrypt it
-                     */
-                    if ((stat = sym_cipher_encrypt(cipher_ctx, (void*)plain_txt_buff,
-                                                    (void*)cipher_txt_buff, read)) == SUCCESS)
-                    {
-                        /*
-                         * Put it into output file
-                         */
-                        written = fwrite(cipher_txt_buff, 1, read, f_enc);
-
-                        /*
-                         * Update Message Auth Code
-                         */
-                        HMAC_Update(hmac_ctx, (unsigned char*)cipher_txt_buff, read);
-
-                        /*
-                         * Check if everything that got read is written
-                         */
-                        if (read != written)
-                        {
-                            read_write_ok = 0;
-                            stat = FAIL;
-                        }
-                    }
-                }
-                /*
-                 * Loop till get to the end of input file
-                 * or something bad happen
-                 */
-            }
-            while ((! feof(f_to_enc)) && (read_write_ok) && (SUCCESS == stat));
+            encrypt_ctx_t ctx;
+
+            ctx.cipher = cipher_ctx;
+            ctx.hmac = hmac_ctx;
+            ctx.out = f_enc;
             /*
-             * If ok finalise HMAC computation and put the HMAC to the output file
+             * Encrypt the file chunk by chunk till get to the end
+             * of input file or something bad happen
+             */
+            stat = file_io_process_fd(fileno(f_to_enc), SYM_CIPHER_DATA_UNIT_SIZE,
+                                      encrypt_cb, &ctx);
+            /*
+             * If ok finalise the HMAC computation and put it to the output file
              */
             if (SUCCESS == stat)
-            {
                 HMAC_Final(hmac_ctx, hmac_buff, &hmac_len);
-                dummy = fwrite(hmac_buff, 1, hmac_len, f_enc);
-                fflush(f_enc);
+            if ((SUCCESS == stat) &&
+                ((fwrite(hmac_buff, 1, hmac_len, f_enc) != hmac_len) || fflush(f_enc)))
+            {
+                ERROR_LOG("Failed to write encrypted file\n");
+                stat = FAIL;
             }
-            /*
-             * Clean the symmetric cipher session
-             */
-            sym_cipher_close(cipher_ctx);
-            HMAC_CTX_free(hmac_ctx);
         }
         else
         {
             ERROR_LOG("Failed initialise symmectic cipher\n");
         }
+        /*
+         * Clean the symmetric cipher session
+         */
+        if (cipher_ctx)
+            sym_cipher_close(cipher_ctx);
+        if (hmac_ctx)
+            HMAC_CTX_free(hmac_ctx);
     }
     /*
      * We're done - clean up
      */
     ec_release_public_key(&public_key);
     ec_release_enc_key(&enc_key);
-    fclose(f_to_enc);
-    fclose(f_enc);
+    close_data_file(f_to_enc);
+    close_data_file(f_enc);
     if (SUCCESS != stat)
     {
         /*
@@ -966,7 +2602,8 @@ status encrypt(char* key_file, char* file_to_encrypt)
          * and delete output file as there is probably some crap in it
          */
         INFO_LOG("File ecnryption failed\n");
-        remove(enc_file_name);
+        if (f_enc != stdout)
+            remove(enc_file_name);
     }
     else
     {
@@ -975,50 +2612,247 @@ status encrypt(char* key_file, char* file_to_encrypt)
     return stat;
 }
 
+/*
+ * decrypt_hmac
+ * Decrypts the rest of a file without header.
+ *  The file looks as follows:
+ *  +---+-------...------+----+
+ *  | R | cipher... text |HMAC|
+ *  +---+-------...------+----+
+ *  We are just after R now so have to get the current position of the file
+ *  and go to the end to read the HMAC then go back and read and decrypt
+ *  the file till get to place where HMAC sits and stop there
+ */
+static status decrypt_hmac(FILE* f_to_dec, FILE* f_dec, sym_cipher_hdl_t* cipher_ctx,
+                           EC_enc_key_t* enc_key)
+{
+    status stat = SUCCESS;
+    int read_write_ok = 1;
+    HMAC_CTX *hmac_ctx = HMAC_CTX_new();
+    unsigned char hmac_buff[SHA1_LEN];
+    unsigned char hmac_buff_from_file[SHA1_LEN];
+    unsigned int hmac_len = 0;
+    long file_curr_pos = 0;
+    long file_hmac_pos = 0;
+    long bytes_to_decrypt = 0;
+    char plain_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
+    char cipher_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
+    size_t read = 0;
+
+    if (!hmac_ctx)
+        return FAIL;
+    HMAC_Init_ex(hmac_ctx, enc_key->k1, enc_key->key_size, EVP_sha1(), NULL);
+
+    /* Get the current position */
+    file_curr_pos = ftell(f_to_dec);
+    if (file_curr_pos < 0)
+    {
+        ERROR_LOG("Files without header can't be decrypted from a pipe\n");
+        HMAC_CTX_free(hmac_ctx);
+        return FAIL;
+    }
+    /* Go to the end and get size of the file*/
+    fseek(f_to_dec, 0, SEEK_END);
+    /* HMAC is at the end of the file - compute the offset to it */
+    file_hmac_pos = ftell(f_to_dec) - SHA1_LEN;
+    /* Go and read the HMAC*/
+    if ((file_curr_pos < 0) || (file_hmac_pos < file_curr_pos) ||
+        fseek(f_to_dec, file_hmac_pos, SEEK_SET) ||
+        (fread(hmac_buff_from_file, 1, SHA1_LEN, f_to_dec) != SHA1_LEN))
+    {
+        ERROR_LOG("The encrypted file is corrupted\n");
+        HMAC_CTX_free(hmac_ctx);
+        return FAIL;
+    }
+    /* Go back and start from where we were */
+    fseek(f_to_dec, file_curr_pos, SEEK_SET);
+    /* will need to decrypt till we get to HMAC*/
+    bytes_to_decrypt = file_hmac_pos - file_curr_pos;
+    while (bytes_to_decrypt && read_write_ok && (SUCCESS == stat))
+    {
+        /*
+         * Get chunk of data from input file
+         */
+        if (SYM_CIPHER_DATA_UNIT_SIZE < bytes_to_decrypt)
+            read = fread(cipher_txt_buff, 1, SYM_CIPHER_DATA_UNIT_SIZE, f_to_dec);
+        else
+            read = fread(cipher_txt_buff, 1, bytes_to_decrypt, f_to_dec);
+        if (!read)
+            break;
+        /*
+         * decrypt it
+         */
+        if ((stat = sym_cipher_decrypt(cipher_ctx, (void*)cipher_txt_buff,
+                                       (void*)plain_txt_buff, read)) == SUCCESS)
+        {
+            /*
+             * Put it into output file and update Message Auth Code.
+             * Check if everything that was read got written
+             */
+            if (fwrite(plain_txt_buff, 1, read, f_dec) != read)
+            {
+                read_write_ok = 0;
+                stat = FAIL;
+            }
+            HMAC_Update(hmac_ctx, (unsigned char*)cipher_txt_buff, read);
+        }
+        bytes_to_decrypt -= read;
+    }
+    if ((SUCCESS == stat) && bytes_to_decrypt)
+    {
+        ERROR_LOG("Reading the encrypted file failed\n");
+        stat = FAIL;
+    }
+
+    /*
+     * If ok finalise HMAC computation and compare it from the HMAC from file
+     * if it is equal that operation decrypt was successful
+     */
+    if (SUCCESS == stat)
+    {
+        HMAC_Final(hmac_ctx, hmac_buff, &hmac_len);
+        if (memcmp(hmac_buff, hmac_buff_from_file, SHA1_LEN) != 0)
+        {
+            INFO_LOG("File decryption failed. HMAC doesn't match\n");
+            stat = FAIL;
+        }
+    }
+    HMAC_CTX_free(hmac_ctx);
+    return stat;
+}
+
+/*
+ * decrypt_header
+ * Reads the header of the encrypted file. Files with header start with
+ * ENC_MAGIC, which can't be the first byte of a file without one, as
+ * that is the size of R.x. The cipher, key derivation function and
+ * segment size of those come from the header. Files without header
+ * are Blowfish ones. version is 0 for files without header
+ */
+static status decrypt_header(FILE* f_to_dec, EC_enc_key_t* enc_key, sym_cipher* cipher,
+                             unsigned char* header, size_t* header_len, int* version,
+                             unsigned int* shift)
+{
+    int first = fgetc(f_to_dec);
+    int c;
+
+    *header_len = 0;
+    *version = 0;
+    if (first == EOF)
+    {
+        /* file is empty */
+        ERROR_LOG("The file to decrypt is an empty file\n");
+        return FAIL;
+    }
+    if (first == ENC_MAGIC[0])
+    {
+        header[0] = (unsigned char) first;
+        if ((fread(header + 1, 1, ENC_MAGIC_SIZE + 2, f_to_dec) != ENC_MAGIC_SIZE + 2) ||
+            memcmp(header, ENC_MAGIC, ENC_MAGIC_SIZE))
+        {
+            ERROR_LOG("The encrypted file is corrupted\n");
+            return FAIL;
+        }
+        *version = header[ENC_MAGIC_SIZE];
+        *header_len = ENC_MAGIC_SIZE + 3;
+        if ((*version != ENC_VERSION_SEGMENTED) ||
+            !sym_cipher_is_aead((sym_cipher) header[ENC_MAGIC_SIZE + 1]) ||
+            (header[ENC_MAGIC_SIZE + 2] > EC_KDF_BLAKE3))
+        {
+            ERROR_LOG("Unsupported encrypted file version %d\n", *version);
+            return FAIL;
+        }
+        c = fgetc(f_to_dec);
+        header[(*header_len)++] = (unsigned char) c;
+        *shift = (unsigned int) c;
+        if ((c == EOF) || (c < ENC_SEGMENT_SHIFT_MIN) || (c > ENC_SEGMENT_SHIFT_MAX))
+        {
+            ERROR_LOG("The encrypted file is corrupted\n");
+            return FAIL;
+        }
+        *cipher = (sym_cipher) header[ENC_MAGIC_SIZE + 1];
+        kdf_type = (ec_kdf_type) header[ENC_MAGIC_SIZE + 2];
+        first = EOF;
+    }
+    else if ((SYM_CIPHER_TERM != *cipher) && (SYM_CIPHER_BLOWFISH != *cipher))
+    {
+        ERROR_LOG("Files without header can only be decrypted with %s\n",
+                  cipher_names[SYM_CIPHER_BLOWFISH]);
+        return BAD_PARAMS;
+    }
+    else
+    {
+        *cipher = SYM_CIPHER_BLOWFISH;
+    }
+    return enc_point_read(f_to_dec, first, enc_key, header, header_len);
+}
+
 /*
  *
  */
-status decrypt(char* key_file, char* file_to_decrypt, char* output)
+status decrypt(char* key_file, char* file_to_decrypt, char* output, sym_cipher cipher)
 {
     status stat = SUCCESS;
     EC_enc_key_t enc_key;
     EC_private_key_t priv_key;
     char dec_file_name[MAX_FILE_NAME_SIZE];
+    char journal[MAX_FILE_NAME_SIZE];
 
     FILE* f_to_dec = NULL;
     FILE* f_dec = NULL;
 
-    unsigned char hmac_buff[SHA1_LEN];
-    unsigned char hmac_buff_from_file[SHA1_LEN];
-    unsigned int hmac_len = 0;
-
-    unsigned int big_number_size = 0;
-    char big_number_buffer[MAX_BIG_NUM_SIZE];
-    int dummy;
+    unsigned char header[ENC_HEADER_MAX_SIZE];
+    size_t header_len = 0;
+    int version = 0;
+    unsigned int shift = 0;
 
+    enc_key.k1 = NULL;
     /*
      * Validate parameters
      */
     CHECK_PARAM(key_file);
     CHECK_PARAM(file_to_decrypt);
 
-    f_to_dec = fopen(file_to_decrypt, "rb");
+    /*
+     * A file an append to was interrupted is only good after
+     * the next append puts it back
+     */
+    if (!is_stdio(file_to_decrypt) &&
+            ((size_t) snprintf(journal, MAX_FILE_NAME_SIZE, "%s" APPEND_JOURNAL_FILE_SUFFIX,
+                               file_to_decrypt) < MAX_FILE_NAME_SIZE) &&
+            (access(journal, F_OK) == 0))
+    {
+        ERROR_LOG("An append to %s was interrupted, append to it again to put it back\n",
+                  file_to_decrypt);
+        return FAIL;
+    }
+    f_to_dec = is_stdio(file_to_decrypt) ? stdin : fopen(file_to_decrypt, "rb");
 
     if (!f_to_dec)
     {
         ERROR_LOG("Failed to open file %s\n", file_to_decrypt);
         return FAIL;
     }
+    /*
+     * No read ahead, segmented files are read from the descriptor
+     * right after the header
+     */
+    setvbuf(f_to_dec, NULL, _IONBF, 0);
     /*
      * Not going to write and read from/to the same file in the same time
      */
-    if (output && (strcmp(file_to_decrypt, output) == 0))
+    if (output && (strcmp(file_to_decrypt, output) == 0) && !is_stdio(output))
     {
-        fclose(f_to_dec);
+        close_data_file(f_to_dec);
         ERROR_LOG("Input file and output file have to be different\n");
         return FAIL;
     }
-    if (!output)
+    if (!output && is_stdio(file_to_decrypt))
+    {
+        /* stdin goes to stdout */
+        strcpy(dec_file_name, "-");
+    }
+    else if (!output)
     {
         char* suffix = strstr(file_to_decrypt, ENCRYPTED_FILE_SUFFIX);
         if (suffix != NULL)
@@ -1030,7 +2864,7 @@ status decrypt(char* key_file, char* file_to_decrypt, char* output)
         else
         {
             ERROR_LOG(" No output file name provided \n");
-            fclose(f_to_dec);
+            close_data_file(f_to_dec);
             return FAIL;
         }
     }
@@ -1040,236 +2874,214 @@ status decrypt(char* key_file, char* file_to_decrypt, char* output)
     }
     LOG("Decrypt file %s into %s\n", file_to_decrypt, dec_file_name);
 
-    f_dec = fopen(dec_file_name, "wb");
-    if (!f_dec)
-    {
-        ERROR_LOG("Failed to create file %s\n", dec_file_name);
-        fclose(f_to_dec);
-        return FAIL;
-    }
-
     /*
      * Read privare key from file
      */
     if ((stat = read_private_key(&priv_key, key_file)) != SUCCESS)
     {
         ERROR_LOG("Failed to read private key file\n");
-        fclose(f_to_dec);
-        fclose(f_dec);
+        close_data_file(f_to_dec);
         return FAIL;
     }
-    else
+    /*
+     * Read from encrypted file the header with the R point
+     */
+    if ((stat = decrypt_header(f_to_dec, &enc_key, &cipher, header,
+                               &header_len, &version, &shift)) != SUCCESS)
     {
-        /*
-         * Read from encrypted file the R point
-         */
-        big_number_size = fgetc(f_to_dec);
-        if(big_number_size == EOF)
-        {
-            /* file is empty */
-            ERROR_LOG("The file to encrypt is an empty file\n");
-            fclose(f_to_dec);
-            fclose(f_dec);
-            return FAIL;
-        }
-        dummy = fread(big_number_buffer, 1, (size_t) big_number_size, f_to_dec);
-        if(dummy != big_number_size)
-        {
-            ERROR_LOG("Reading the encrypted file failed\n");
-            fclose(f_to_dec);
-            fclose(f_dec);
-            return FAIL;
-
-        }
-        if (gcry_mpi_scan(&enc_key.R.x, GCRYMPI_FMT_USG,
-                            big_number_buffer, (size_t) big_number_size, NULL) != GPG_ERR_NO_ERROR)
-        {
-            ERROR_LOG("Read data failed R.x");
-            stat = FAIL;
-        }
+        ec_release_key(&priv_key);
+        close_data_file(f_to_dec);
+        return stat;
+    }
+    /*
+     * Only segments can be found without decrypting what is before them,
+     * and only they are authenticated before they are written out, so
+     * nothing else goes to stdout
+     */
+    if ((decrypt_range || is_stdio(dec_file_name)) && (ENC_VERSION_SEGMENTED != version))
+    {
+        if (decrypt_range)
+            ERROR_LOG("Only segmented files can be decrypted in part\n");
         else
-        {
-            big_number_size = fgetc(f_to_dec);
-            if(big_number_size == EOF)
-            {
-                /* file is empty */
-                ERROR_LOG("The encrypted file is corrupted\n");
-                fclose(f_to_dec);
-                fclose(f_dec);
-                mpi_release(enc_key.R.x);
-                return FAIL;
-            }
-            dummy = fread(big_number_buffer, 1, (size_t) big_number_size, f_to_dec);
+            ERROR_LOG("Only segmented files can be decrypted to stdout\n");
+        ec_release_enc_key(&enc_key);
+        ec_release_key(&priv_key);
+        close_data_file(f_to_dec);
+        return BAD_PARAMS;
+    }
 
-            if(dummy != big_number_size)
-            {
-                ERROR_LOG("Reading the encrypted file failed\n");
-                fclose(f_to_dec);
-                fclose(f_dec);
-                mpi_release(enc_key.R.x);
-                return FAIL;
-            }
-            if (gcry_mpi_scan(&enc_key.R.y, GCRYMPI_FMT_USG,
-                                big_number_buffer, (size_t) big_number_size, NULL) != GPG_ERR_NO_ERROR)
-            {
-                ERROR_LOG("Read data failed R.y");
-                stat = FAIL;
-            }
-#ifdef JACOBIAN_COORDINATES
-            else
-            {
-                enc_key.R.z = mpi_new(0);
-                mpi_set_ui(enc_key.R.z, 1);
-            }
-#endif
-        }
+    f_dec = is_stdio(dec_file_name) ? stdout : fopen(dec_file_name, "wb");
+    if (!f_dec)
+    {
+        ERROR_LOG("Failed to create file %s\n", dec_file_name);
+        stat = FAIL;
     }
     if (SUCCESS == stat)
     {
         stat = ec_generate_dec_key(&enc_key, &priv_key);
+        if (SUCCESS != stat)
+            ERROR_LOG("Failed to generate symmetric encryption key\n");
     }
     if (SUCCESS == stat)
     {
-        int read_write_ok = 1;
         sym_cipher_hdl_t *cipher_ctx;
-        HMAC_CTX *hmac_ctx = HMAC_CTX_new();
-        unsigned long file_curr_pos = 0;
-        unsigned long file_hmac_pos = 0;
-        unsigned long file_size = 0;
-        unsigned long bytes_to_decrypt = 0;
-
-	if (!hmac_ctx)
-            stat = FAIL;
-
-	if (SUCCESS == stat)
-        {
-        /*
-         * Init symmetric cipher (they say that blowfish is fast so use it for now)
-         * TODO take cipher as a parameter
-         */
-        stat = sym_cipher_init(&cipher_ctx, SYM_CIPHER_BLOWFISH, enc_key.k1, enc_key.key_size);
-        HMAC_Init_ex(hmac_ctx, enc_key.k1, enc_key.key_size, EVP_sha1(), NULL);
 
         /*
-         *  The file looks as follows:
-         *  +---+-------...------+----+
-         *  | R | cipher... text |HMAC|
-         *  +---+-------...------+----+
-         *  We are just after R now so have to get the current position of the file
-         *  and go to the end to read the HMAC then go back and read and decrypt
-         *  the file till get to place where HMAC sits and stop there
+         * Init symmetric cipher
          */
-
-        /* Get the current position */
-        file_curr_pos = ftell(f_to_dec);
-        /* Go to the end and get size of the file*/
-        fseek(f_to_dec, 0, SEEK_END);
-        file_size = ftell(f_to_dec);
-        /* HMAC is at the end of the file - compute the offset to it */
-        file_hmac_pos = file_size - SHA1_LEN;
-        /* Go and read the HMAC*/
-        fseek(f_to_dec, file_hmac_pos, SEEK_SET);
-        dummy = fread(hmac_buff_from_file, 1, SHA1_LEN, f_to_dec);
-        /* Go back and start from where we were */
-        fseek(f_to_dec, file_curr_pos, SEEK_SET);
-        /* will need to decrypt till we get to HMAC*/
-        bytes_to_decrypt = file_hmac_pos - file_curr_pos;
+        stat = sym_cipher_init(&cipher_ctx, cipher, enc_key.k1, enc_key.key_size);
         if (SUCCESS == stat)
         {
-            char plain_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
-            char cipher_txt_buff[SYM_CIPHER_DATA_UNIT_SIZE];
-            int read = 0;
-            int written = 0;
-            do
+            if (ENC_VERSION_SEGMENTED == version)
             {
-                /*
-                 * Get chunk of data from input file
-                 */
-                if (SYM_CIPHER_DATA_UNIT_SIZE < bytes_to_decrypt )
-                    read = fread(cipher_txt_buff, 1, SYM_CIPHER_DATA_UNIT_SIZE, f_to_dec);
-                else
-                    read = fread(cipher_txt_buff, 1, bytes_to_decrypt, f_to_dec);
-                if (read)
-                {
-                    /*
-                     * decrypt it
-                     */
-                    if ((stat = sym_cipher_decrypt(cipher_ctx, (void*)cipher_txt_buff,
-                                                      (void*)plain_txt_buff, read)) == SUCCESS)
-                    {
-                        /*
-                         * Put it into output file
-                         */
-                        written = fwrite(plain_txt_buff, 1, read, f_dec);
-
-                        /*
-                         * Update Message Auth Code
-                         */
-                        HMAC_Update(hmac_ctx, (unsigned char*)cipher_txt_buff, read);
-
-                        /*
-                         * Check if everything that was read got written
-                         */
-                        if (read != written)
-                        {
-                            read_write_ok = 0;
-                            stat = FAIL;
-                        }
-                    }
-                    bytes_to_decrypt -= read;
-                }
-                /*
-                 * Loop till get to the end of input file
-                 * or something bad happen
-                 */
-            }
-            while ((bytes_to_decrypt) && (! feof(f_to_dec)) && (read_write_ok) && (SUCCESS == stat));
+                enc_segment_params_t params;
 
-            /*
-             * If ok finalise HMAC computation and compare it from the HMAC from file
-             * if it is equal that operation decrypt was successful
-             * If not then something was wrong so print info and delete decrypted file
-             */
-            if (SUCCESS == stat)
-            {
-                HMAC_Final(hmac_ctx, hmac_buff, &hmac_len);
-                fflush(f_dec);
-                if (memcmp(hmac_buff, hmac_buff_from_file, SHA1_LEN) == 0)
+                stat = enc_segment_params_init(&params, header, header_len,
+                                               enc_key.k2, shift);
+                if ((SUCCESS == stat) && decrypt_range)
                 {
-                    INFO_LOG("File decrypted successfully\n");
+                    stat = enc_segment_decrypt_range(&params, cipher_ctx, fileno(f_to_dec),
+                                                     fileno(f_dec), decrypt_range->off,
+                                                     decrypt_range->len);
                 }
-                else
+                else if (SUCCESS == stat)
                 {
-                    INFO_LOG("File decryption failed. HMAC doesn't match\n");
-                    stat = FAIL;
+                    stat = enc_segment_decrypt_stream(&params, cipher, enc_key.k1,
+                                                      enc_key.key_size, fileno(f_to_dec),
+                                                      fileno(f_dec), jobs);
                 }
             }
+            else
+                stat = decrypt_hmac(f_to_dec, f_dec, cipher_ctx, &enc_key);
+            if (fflush(f_dec) && (SUCCESS == stat))
+                stat = FAIL;
+            if (SUCCESS == stat)
+                INFO_LOG("File decrypted successfully\n");
             /*
              * Clean the symmetric cipher session
              */
             sym_cipher_close(cipher_ctx);
-            HMAC_CTX_free(hmac_ctx);
         }
         else
         {
             ERROR_LOG("Failed initialise symmectic cipher\n");
         }
-        ec_release_enc_key(&enc_key);
-        ec_release_key(&priv_key);
     }
+    ec_release_enc_key(&enc_key);
+    ec_release_key(&priv_key);
+    /*
+     * Done. Do more cleanup and check the status.
+     * If something was wrong delete decrypted file
+     */
+    close_data_file(f_to_dec);
+    if (f_dec)
+    {
+        close_data_file(f_dec);
+        /*
+         * Only authenticated segments got to stdout, the reader has
+         * to check the exit status to know the file was complete
+         */
+        if ((SUCCESS != stat) && (f_dec != stdout))
+            remove(dec_file_name);
+    }
+    return stat;
+}
+
+/*
+ *
+ */
+status append(char* key_file, char* file_to_append, char* encrypted_file)
+{
+    status stat = SUCCESS;
+    EC_enc_key_t enc_key;
+    EC_private_key_t priv_key;
+    sym_cipher cipher = SYM_CIPHER_TERM;
+    unsigned char header[ENC_HEADER_MAX_SIZE];
+    size_t header_len = 0;
+    int version = 0;
+    unsigned int shift = 0;
+    char journal[MAX_FILE_NAME_SIZE];
+    FILE* f_to_app = NULL;
+    FILE* f_enc = NULL;
+
+    enc_key.k1 = NULL;
+    /*
+     * Validate parameters
+     */
+    CHECK_PARAM(key_file);
+    CHECK_PARAM(encrypted_file);
+
+    if ((size_t) snprintf(journal, MAX_FILE_NAME_SIZE, "%s" APPEND_JOURNAL_FILE_SUFFIX,
+                          encrypted_file) >= MAX_FILE_NAME_SIZE)
+    {
+        ERROR_LOG("Encrypted file name too long %s\n", encrypted_file);
+        return FAIL;
     }
-    else
+
+    f_enc = fopen(encrypted_file, "r+b");
+    if (!f_enc)
     {
-        ERROR_LOG("Failed to generate symmetric encryption key\n");
+        ERROR_LOG("Failed to open file %s\n", encrypted_file);
+        return FAIL;
     }
     /*
-     * Done. Do more cleanup and check the status.
+     * The records are read and written through the descriptor
      */
-    fclose(f_to_dec);
-    fclose(f_dec);
-    if (SUCCESS != stat)
+    setvbuf(f_enc, NULL, _IONBF, 0);
+    f_to_app = (!file_to_append || is_stdio(file_to_append)) ? stdin : fopen(file_to_append, "rb");
+    if (!f_to_app)
     {
-        remove(dec_file_name);
+        ERROR_LOG("Failed to open file %s\n", file_to_append);
+        fclose(f_enc);
+        return FAIL;
+    }
+    if ((stat = read_private_key(&priv_key, key_file)) != SUCCESS)
+    {
+        ERROR_LOG("Failed to read private key file\n");
+        close_data_file(f_to_app);
+        fclose(f_enc);
+        return FAIL;
+    }
+    /*
+     * The data key is derived again from R in the header,
+     * the same way as for decryption
+     */
+    if ((stat = decrypt_header(f_enc, &enc_key, &cipher, header,
+                               &header_len, &version, &shift)) != SUCCESS)
+    {
+        ec_release_key(&priv_key);
+        close_data_file(f_to_app);
+        fclose(f_enc);
+        return stat;
+    }
+    if (ENC_VERSION_SEGMENTED != version)
+    {
+        ERROR_LOG("Only segmented files can be appended to\n");
+        stat = BAD_PARAMS;
+    }
+    if (SUCCESS == stat)
+    {
+        stat = ec_generate_dec_key(&enc_key, &priv_key);
+        if (SUCCESS != stat)
+            ERROR_LOG("Failed to generate symmetric encryption key\n");
+    }
+    if (SUCCESS == stat)
+    {
+        enc_segment_params_t params;
+
+        stat = enc_segment_params_init(&params, header, header_len, enc_key.k2, shift);
+        if (SUCCESS == stat)
+        {
+            stat = enc_segment_append(&params, cipher, enc_key.k1, enc_key.key_size,
+                                      fileno(f_to_app), fileno(f_enc), journal, jobs);
+        }
     }
+    if (SUCCESS == stat)
+        INFO_LOG("Data appended to %s\n", encrypted_file);
+    ec_release_enc_key(&enc_key);
+    ec_release_key(&priv_key);
+    close_data_file(f_to_app);
+    if (fclose(f_enc) && (SUCCESS == stat))
+        stat = FAIL;
     return stat;
 }
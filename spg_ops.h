@@ -17,6 +17,44 @@
  *************************************************************************/
 #ifndef _SPG_OPS_H_
 #define _SPG_OPS_H_
+
+/*
+ * How the message is digested before it gets signed.
+ * Recorded in the signature file so verify does the same
+ */
+typedef enum
+{
+    SIGN_MODE_STREAM = 0, /* one hash over the whole message - default */
+    SIGN_MODE_MERKLE,     /* Merkle tree over message chunks, hashed in parallel */
+    SIGN_MODE_BATCH       /* Merkle tree over many messages, one signature of the
+                             root and an inclusion proof per message */
+} sign_mode;
+extern sign_mode signature_mode;
+
+/*
+ * Message digest for new signatures. Also recorded in the signature file
+ */
+extern ec_hash_type signature_hash;
+
+/*
+ * Number of worker threads for parallel operations, 0 - one per CPU
+ */
+extern unsigned int jobs;
+
+/*
+ * Keep Merkle tree leaves of signed messages in <message>.chunks files,
+ * so signing the message again only hashes the chunks that changed.
+ * changed_ranges optionally lists the byte ranges modified since
+ */
+extern int chunk_cache;
+extern merkle_range_t* changed_ranges;
+extern unsigned int changed_ranges_count;
+
+/*
+ * Byte range of the plain text to decrypt, the whole file if NULL
+ */
+extern merkle_range_t* decrypt_range;
+
 /*
  * generate_key
  * Generates private key on curve curve_name
@@ -30,8 +68,92 @@ status generate_keys(char* curve_name, char* out_file);
  * and writes it to out_file
  */
 status export_public_key(char* in_file, char* out_file);
+
+/*
+ * Function: precompute_public_key
+ * Builds fixed-base table for the public key stored in key_file
+ * and writes it next to the key file with .tab suffix. The table for
+ * the curve base point is written to spg home dir. Without key_file
+ * only the base point table for curve_name is built.
+ * Sign, verify and encrypt map the tables if they are there
+ */
+status precompute_public_key(char* key_file, char* curve_name);
 status generate_signature(char* input, char* output, char* message);
 status verify_signature(char* input, char* output, char* message);
-status encrypt(char* key_file, char* file_to_encrypt, sym_cipher cipher);
+
+/*
+ * Function: generate_signature_digest
+ * Signs message digest already computed with the signature hash
+ * (SHA-512 by default) without reading the message. digest_arg is the
+ * digest in hex or "-" to read it, hex or binary, from stdin
+ */
+status generate_signature_digest(char* key, char* output, char* digest_arg);
+
+/*
+ * Function: verify_signature_digest
+ * Verifies stream mode signature against the message digest
+ */
+status verify_signature_digest(char* pub_key_name, char* sign_file, char* digest_arg);
+
+/*
+ * Function: generate_batch_signature
+ * Signs root of Merkle tree over count messages and writes the signature
+ * to output. Inclusion proof of each message goes to <message>.proof
+ */
+status generate_batch_signature(char* key, char* output, char** messages, unsigned int count);
+
+/*
+ * Function: verify_batch_signature
+ * Verifies that the messages are in the batch signed in sign_file,
+ * using their <message>.proof inclusion proofs
+ */
+status verify_batch_signature(char* pub_key_name, char* sign_file, char** messages,
+                              unsigned int count);
+
+/*
+ * Function: generate_manifest
+ * Hashes all the files under dir in parallel, writes manifest of them
+ * to output, <dir>.manifest by default, and signs the manifest
+ */
+status generate_manifest(char* key, char* output, char* dir);
+
+/*
+ * Function: verify_manifest
+ * Verifies the manifest signature and then checks the files under dir
+ * against it, in parallel. Changed, missing and extra files make it
+ * SIGNATURE_INVALID
+ */
+status verify_manifest(char* pub_key_name, char* manifest_file, char* dir);
+
+/*
+ * Function: generate_signatures
+ * Signs count messages, each to <message>.sign. Stream mode messages
+ * are hashed together in batches of SIGN_BATCH_SIZE, see ec_sign_batch
+ */
+status generate_signatures(char* key, char** messages, unsigned int count);
+
+/*
+ * Function: verify_signatures
+ * Verifies count messages against their <message>.sign signatures.
+ * Returns SIGNATURE_INVALID if any of the signatures is not valid
+ */
+status verify_signatures(char* pub_key_name, char** messages, unsigned int count);
+
+/*
+ * Function: encrypt, decrypt
+ * "-" as the file or the output stands for stdin or stdout, stdin goes
+ * to stdout if no output is given. Segmented files are read and written
+ * front to back, so pipes work with constant memory
+ */
+status encrypt(char* key_file, char* file_to_encrypt, char* output, sym_cipher cipher);
 status decrypt(char* key_file, char* file_to_decrypt, char* output, sym_cipher cipher);
+
+/*
+ * Function: append
+ * Encrypts file_to_append, or stdin if it is NULL or "-", onto the end
+ * of the segmented encrypted_file. The data key is derived again from
+ * the file header with the private key, only the final segment of the
+ * file is decrypted and sealed again
+ */
+status append(char* key_file, char* file_to_append, char* encrypted_file);
 #endif
@@ -18,8 +18,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <assert.h>
 #include <openssl/blowfish.h>
+#include <openssl/evp.h>
 
 #include "defs.h"
 #include "sym_cipher.h"
@@ -31,7 +35,8 @@
 const char* cipher_names[] =
 {
     "Blowfish",
-    "AES",
+    "AES-256-GCM",
+    "ChaCha20-Poly1305",
     NULL
 };
 
@@ -84,6 +89,194 @@ static status blowfish_uninit(sym_cipher_hdl_t* cipher_hdl)
     return SUCCESS;
 }
 
+/*
+ * Private context structure for
+ * AEAD ciphers run through OpenSSL EVP
+ */
+#define AEAD_KEY_SIZE 32
+typedef struct aead_ctx_s
+{
+
+    EVP_CIPHER_CTX *evp;
+    const EVP_CIPHER *type;
+    const char *name;
+    unsigned char key[AEAD_KEY_SIZE];
+    int enc; /* -1 until aead_start sets the direction */
+
+} aead_ctx_t;
+
+/*
+ * Private start rutine for
+ * AEAD ciphers. The key schedule is only done again
+ * if the direction changes
+ */
+static status aead_start(sym_cipher_hdl_t* cipher_hdl, int enc, const void* iv,
+                         size_t iv_len, const void* aad, size_t aad_len)
+{
+    aead_ctx_t *aead_ctx = (aead_ctx_t*)cipher_hdl->ctx;
+    int out_len = 0;
+    int ok;
+
+    if ((SYM_CIPHER_IV_SIZE != iv_len) || (aad_len > INT_MAX))
+        return BAD_PARAMS;
+    if (aead_ctx->enc != enc)
+    {
+        ok = EVP_CipherInit_ex(aead_ctx->evp, aead_ctx->type, NULL, NULL, NULL, enc) &&
+             EVP_CIPHER_CTX_ctrl(aead_ctx->evp, EVP_CTRL_AEAD_SET_IVLEN,
+                                 SYM_CIPHER_IV_SIZE, NULL) &&
+             EVP_CipherInit_ex(aead_ctx->evp, NULL, NULL, aead_ctx->key, iv, enc);
+    }
+    else
+    {
+        ok = EVP_CipherInit_ex(aead_ctx->evp, NULL, NULL, NULL, iv, enc);
+    }
+    if (ok && aad_len)
+        ok = EVP_CipherUpdate(aead_ctx->evp, NULL, &out_len, aad, (int) aad_len);
+    if (!ok)
+    {
+        ERROR_LOG("%s init failed\n", aead_ctx->name);
+        aead_ctx->enc = -1;
+        return FAIL;
+    }
+    aead_ctx->enc = enc;
+    return SUCCESS;
+}
+
+/*
+ * Private final rutine for
+ * AEAD ciphers. Gets the tag after encryption,
+ * checks it after decryption
+ */
+static status aead_final(sym_cipher_hdl_t* cipher_hdl, void* tag, size_t tag_len)
+{
+    aead_ctx_t *aead_ctx = (aead_ctx_t*)cipher_hdl->ctx;
+    unsigned char last[EVP_MAX_BLOCK_LENGTH];
+    int out_len = 0;
+
+    if ((aead_ctx->enc == -1) || (tag_len > SYM_CIPHER_TAG_SIZE))
+        return BAD_PARAMS;
+    if (aead_ctx->enc)
+    {
+        if (!EVP_CipherFinal_ex(aead_ctx->evp, last, &out_len) ||
+            !EVP_CIPHER_CTX_ctrl(aead_ctx->evp, EVP_CTRL_AEAD_GET_TAG, (int) tag_len, tag))
+        {
+            ERROR_LOG("%s final failed\n", aead_ctx->name);
+            return FAIL;
+        }
+        return SUCCESS;
+    }
+    if (!EVP_CIPHER_CTX_ctrl(aead_ctx->evp, EVP_CTRL_AEAD_SET_TAG, (int) tag_len, tag))
+        return FAIL;
+    if (EVP_CipherFinal_ex(aead_ctx->evp, last, &out_len) <= 0)
+        return DECRYPTION_FAILED;
+    return SUCCESS;
+}
+
+/*
+ * Private encrypt and decrypt rutine for
+ * AEAD ciphers
+ */
+static status aead_update(sym_cipher_hdl_t* cipher_hdl, void* in, void* out,
+                          size_t len, int enc)
+{
+    aead_ctx_t *aead_ctx = (aead_ctx_t*)cipher_hdl->ctx;
+    unsigned char *in_ptr = in;
+    unsigned char *out_ptr = out;
+
+    /*
+     * Every message needs its own nonce from aead_start
+     */
+    if (aead_ctx->enc == -1)
+    {
+        ERROR_LOG("%s used without a nonce\n", aead_ctx->name);
+        return BAD_PARAMS;
+    }
+    if (aead_ctx->enc != enc)
+    {
+        ERROR_LOG("%s context can't change direction\n", aead_ctx->name);
+        return FAIL;
+    }
+    while (len)
+    {
+        int part = (len > INT_MAX) ? INT_MAX : (int) len;
+        int out_len = 0;
+
+        if (!EVP_CipherUpdate(aead_ctx->evp, out_ptr, &out_len, in_ptr, part) ||
+            (out_len != part))
+        {
+            ERROR_LOG("%s %s failed\n", aead_ctx->name, enc ? "encrypt" : "decrypt");
+            return FAIL;
+        }
+        in_ptr += part;
+        out_ptr += part;
+        len -= part;
+    }
+    return SUCCESS;
+}
+
+static status aead_encrypt(sym_cipher_hdl_t* cipher_hdl, void* in, void* out, size_t len)
+{
+    return aead_update(cipher_hdl, in, out, len, 1);
+}
+
+static status aead_decrypt(sym_cipher_hdl_t* cipher_hdl, void* in, void* out, size_t len)
+{
+    return aead_update(cipher_hdl, in, out, len, 0);
+}
+
+/*
+ * Private uninit rutine for
+ * AEAD ciphers
+ */
+static status aead_uninit(sym_cipher_hdl_t* cipher_hdl)
+{
+    aead_ctx_t *aead_ctx = (aead_ctx_t*)cipher_hdl->ctx;
+
+    EVP_CIPHER_CTX_free(aead_ctx->evp);
+    OPENSSL_cleanse(aead_ctx->key, AEAD_KEY_SIZE);
+    FREE(cipher_hdl->ctx);
+    cipher_hdl->encrypt = NULL;
+    cipher_hdl->decrypt = NULL;
+    cipher_hdl->start = NULL;
+    cipher_hdl->final = NULL;
+    cipher_hdl->uninit = NULL;
+    return SUCCESS;
+}
+
+/*
+ * Private init rutine for
+ * AEAD ciphers
+ */
+static status aead_init(sym_cipher_hdl_t* cipher_hdl, sym_cipher cipher,
+                        void* key, size_t key_len)
+{
+    aead_ctx_t *aead_ctx;
+
+    if (AEAD_KEY_SIZE != key_len)
+    {
+        ERROR_LOG("%s needs %d byte key\n", cipher_names[cipher], AEAD_KEY_SIZE);
+        return BAD_PARAMS;
+    }
+    aead_ctx = malloc(sizeof(aead_ctx_t));
+    if (!aead_ctx || !(aead_ctx->evp = EVP_CIPHER_CTX_new()))
+    {
+        ERROR_LOG("Memory allocation failed");
+        FREE(aead_ctx);
+        return FAIL;
+    }
+    aead_ctx->type = (SYM_CIPHER_AES == cipher) ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+    aead_ctx->name = cipher_names[cipher];
+    memcpy(aead_ctx->key, key, AEAD_KEY_SIZE);
+    aead_ctx->enc = -1;
+    cipher_hdl->ctx = aead_ctx;
+    cipher_hdl->encrypt = aead_encrypt;
+    cipher_hdl->decrypt = aead_decrypt;
+    cipher_hdl->start = aead_start;
+    cipher_hdl->final = aead_final;
+    cipher_hdl->uninit = aead_uninit;
+    return SUCCESS;
+}
+
 /*
  * sym_cipher_init
  */
@@ -111,7 +304,7 @@ status sym_cipher_init(sym_cipher_hdl_t** cipher_hdl, sym_cipher cipher, void* k
         if (!bf_ctx)
         {
             ERROR_LOG("Memory allocation failed");
-            FREE(cipher_hdl);
+            FREE(*cipher_hdl);
             return FAIL;
         }
         BF_set_key(&bf_ctx->key, key_len, key);
@@ -120,11 +313,16 @@ status sym_cipher_init(sym_cipher_hdl_t** cipher_hdl, sym_cipher cipher, void* k
         c_ptr->ctx = bf_ctx;
         c_ptr->encrypt = blowfish_encrypt;
         c_ptr->decrypt = blowfish_decrypt;
+        c_ptr->start = NULL;
+        c_ptr->final = NULL;
         c_ptr->uninit = blowfish_uninit;
     }
     break;
     case SYM_CIPHER_AES:
-        stat = NOT_IMPLEMENTED;
+    case SYM_CIPHER_CHACHA20_POLY1305:
+        stat = aead_init(c_ptr, cipher, key, key_len);
+        if (SUCCESS != stat)
+            FREE(*cipher_hdl);
         break;
     default:
         stat = BAD_PARAMS;
@@ -133,6 +331,45 @@ status sym_cipher_init(sym_cipher_hdl_t** cipher_hdl, sym_cipher cipher, void* k
     return stat;
 }
 
+/*
+ * sym_cipher_auto
+ */
+sym_cipher sym_cipher_auto(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("pclmul"))
+        return SYM_CIPHER_CHACHA20_POLY1305;
+#endif
+    return SYM_CIPHER_AES;
+}
+
+/*
+ * sym_cipher_by_name
+ */
+status sym_cipher_by_name(const char* name, sym_cipher* cipher)
+{
+    unsigned int i;
+
+    CHECK_PARAM(name);
+    CHECK_PARAM(cipher);
+
+    if (strcasecmp(name, SYM_CIPHER_AUTO_NAME) == 0)
+    {
+        *cipher = sym_cipher_auto();
+        return SUCCESS;
+    }
+    for (i = 0; i < SYM_CIPHER_TERM; i++)
+    {
+        if (strcasecmp(name, cipher_names[i]) == 0)
+        {
+            *cipher = (sym_cipher) i;
+            return SUCCESS;
+        }
+    }
+    return BAD_PARAMS;
+}
+
 /*
  * sym_cipher_encrypt
  */
@@ -149,6 +386,35 @@ status sym_cipher_decrypt(sym_cipher_hdl_t* cipher_hdl, void* in, void* out, siz
     return cipher_hdl->decrypt(cipher_hdl, in, out, len);
 }
 
+/*
+ * sym_cipher_start
+ */
+status sym_cipher_start(sym_cipher_hdl_t* cipher_hdl, int enc, const void* iv,
+                        size_t iv_len, const void* aad, size_t aad_len)
+{
+    if (!cipher_hdl->start)
+        return NOT_IMPLEMENTED;
+    return cipher_hdl->start(cipher_hdl, enc, iv, iv_len, aad, aad_len);
+}
+
+/*
+ * sym_cipher_final
+ */
+status sym_cipher_final(sym_cipher_hdl_t* cipher_hdl, void* tag, size_t tag_len)
+{
+    if (!cipher_hdl->final)
+        return NOT_IMPLEMENTED;
+    return cipher_hdl->final(cipher_hdl, tag, tag_len);
+}
+
+/*
+ * sym_cipher_is_aead
+ */
+int sym_cipher_is_aead(sym_cipher cipher)
+{
+    return (SYM_CIPHER_AES == cipher) || (SYM_CIPHER_CHACHA20_POLY1305 == cipher);
+}
+
 /*
  * sym_cipher_close
  */
@@ -170,6 +436,7 @@ void sym_cipher_list(void)
         printf("%2d. %s\n", i, *tab_ptr++);
         i++;
     }
+    printf("%s picks %s on this CPU\n", SYM_CIPHER_AUTO_NAME, cipher_names[sym_cipher_auto()]);
     return;
 }
 
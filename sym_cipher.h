@@ -20,16 +20,32 @@
 #define SPG_SYM_CIPHER
 
 /*
- * List of supported symmetric ciphers
+ * List of supported symmetric ciphers.
+ * SYM_CIPHER_AES is AES-256-GCM through OpenSSL EVP, which uses
+ * AES-NI and carry-less multiply when the CPU has them.
+ * SYM_CIPHER_CHACHA20_POLY1305 is much faster than AES on CPUs
+ * without them
  */
 typedef enum
 {
     SYM_CIPHER_BLOWFISH = 0,
     SYM_CIPHER_AES,
+    SYM_CIPHER_CHACHA20_POLY1305,
     SYM_CIPHER_TERM
 } sym_cipher;
 extern const char* cipher_names[];
 
+/*
+ * Name that makes sym_cipher_by_name pick the cipher for the CPU
+ */
+#define SYM_CIPHER_AUTO_NAME "auto"
+
+/*
+ * Nonce and authentication tag size of the AEAD ciphers
+ */
+#define SYM_CIPHER_IV_SIZE 12
+#define SYM_CIPHER_TAG_SIZE 16
+
 /*
  * Symmetric cipher context
  */
@@ -38,6 +54,9 @@ typedef struct sym_cipher_hdl_s
 
     status (*encrypt) (struct sym_cipher_hdl_s*, void*, void*, size_t);
     status (*decrypt) (struct sym_cipher_hdl_s*, void*, void*, size_t);
+    status (*start) (struct sym_cipher_hdl_s*, int, const void*, size_t,
+                     const void*, size_t);         /* NULL if not AEAD */
+    status (*final) (struct sym_cipher_hdl_s*, void*, size_t); /* NULL if not AEAD */
     status (*uninit) (struct sym_cipher_hdl_s*);
     void* ctx; /* cipher private context */
 
@@ -51,20 +70,59 @@ typedef struct sym_cipher_hdl_s
 status sym_cipher_init(sym_cipher_hdl_t** cipher_hdl,
 	sym_cipher cipher, void* key, size_t key_len);
 
+/*
+ * Function: sym_cipher_auto
+ * Returns AES-256-GCM if the CPU has AES and carry-less multiply
+ * instructions, ChaCha20-Poly1305 otherwise
+ */
+sym_cipher sym_cipher_auto(void);
+
+/*
+ * Function: sym_cipher_by_name
+ * Finds cipher by its name in cipher_names, case insensitive.
+ * SYM_CIPHER_AUTO_NAME gives sym_cipher_auto()
+ */
+status sym_cipher_by_name(const char* name, sym_cipher* cipher);
+
 /*
  * Function: sym_cipher_encrypt
- * Encrypt data using symmetric cipher
+ * Encrypt data using symmetric cipher. AEAD ciphers need
+ * sym_cipher_start first
  */
 status sym_cipher_encrypt(sym_cipher_hdl_t* cipher_hdl,
 	void* in, void* out, size_t len);
 
 /*
  * Function: sym_cipher_decrypt
- * Decrypt data using symmetric cipher
+ * Decrypt data using symmetric cipher. AEAD ciphers need
+ * sym_cipher_start first
  */
 status sym_cipher_decrypt(sym_cipher_hdl_t* cipher_hdl,
 	void* in, void* out, size_t len);
 
+/*
+ * Function: sym_cipher_start
+ * Starts a new AEAD message encrypted (enc 1) or decrypted (enc 0)
+ * with the nonce iv, authenticating aad along with it.
+ * NOT_IMPLEMENTED for ciphers other than AEAD
+ */
+status sym_cipher_start(sym_cipher_hdl_t* cipher_hdl, int enc, const void* iv,
+	size_t iv_len, const void* aad, size_t aad_len);
+
+/*
+ * Function: sym_cipher_final
+ * Finishes AEAD message. After encryption stores tag_len bytes of
+ * the tag in tag, after decryption checks it against tag and returns
+ * DECRYPTION_FAILED if it doesn't match
+ */
+status sym_cipher_final(sym_cipher_hdl_t* cipher_hdl, void* tag, size_t tag_len);
+
+/*
+ * Function: sym_cipher_is_aead
+ * Tells whether the cipher supports sym_cipher_start / sym_cipher_final
+ */
+int sym_cipher_is_aead(sym_cipher cipher);
+
 /*
  * Function: sym_cipher_close
  * Release symmetric cipher context
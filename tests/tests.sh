@@ -132,4 +132,410 @@ foreach KEY ($KEYS)
 		exit -1
 	endif
 end
+########################
+# Test precomputed tables
+########################
+foreach KEY ($KEYS)
+	echo "######### ${KEY} precomputing public key table  #################"
+	echo ./${PROG} -t -kkeys/public_${KEY}.pem
+	./${PROG} -t -kkeys/public_${KEY}.pem
+	if($? == 0) then
+		echo Table precomputed ok
+	else
+		echo Table precompute failed
+		echo "Test Failed!"
+		exit
+	endif
+
+	./${PROG} -s -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+	echo ./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign message.txt
+	./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign message.txt
+	if($? == 0) then
+		echo Message signature ok
+	else
+		echo Message signature verify with table failed
+		echo "Test Failed!"
+		exit
+	endif
+
+	./${PROG} -e -kkeys/public_${KEY}.pem message.txt
+	./${PROG} -d -kkeys/${KEY}.pem -o message.txt.dec message.txt.enc
+	diff message_orign.txt message.txt.dec
+	if($? != 0) then
+		echo Message encrypted with table is different
+		echo "Test Failed!"
+		exit
+	endif
+end
+########################
+# Test deterministic signatures
+########################
+foreach KEY ($KEYS)
+	echo "######### ${KEY} signing the message twice  #################"
+	./${PROG} -s -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+	./${PROG} -s -kkeys/${KEY}.pem -omessage.txt.sign2 message.txt
+	diff message.txt.sign message.txt.sign2
+	if($? != 0) then
+		echo RFC 6979 signatures are different
+		echo "Test Failed!"
+		exit
+	endif
+	echo ./${PROG} -s -n random -kkeys/${KEY}.pem -omessage.txt.sign2 message.txt
+	./${PROG} -s -n random -kkeys/${KEY}.pem -omessage.txt.sign2 message.txt
+	./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign2 message.txt
+	if($? == 0) then
+		echo Message signature ok
+	else
+		echo Message signature with random nonce failed
+		echo "Test Failed!"
+		exit
+	endif
+end
+########################
+# Test signature hashes
+########################
+foreach KEY ($KEYS)
+	foreach HASH (sha256 sha384 sha512 blake2b)
+		echo ./${PROG} -s -H ${HASH} -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+		./${PROG} -s -H ${HASH} -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+		./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign message.txt
+		if($? == 0) then
+			echo Message signature ok
+		else
+			echo Message signature with ${HASH} failed
+			echo "Test Failed!"
+			exit
+		endif
+	end
+end
+########################
+# Test message bigger than one hash chunk
+########################
+head -c 3000000 /dev/urandom > message_big.bin
+foreach KEY ($KEYS)
+	echo "######### ${KEY} signing big message  #################"
+	./${PROG} -s -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+	./${PROG} -v -kkeys/public_${KEY}.pem -imessage_big.bin.sign message_big.bin
+	if($? == 0) then
+		echo Message signature ok
+	else
+		echo Big message signature failed
+		echo "Test Failed!"
+		exit
+	endif
+	echo ./${PROG} -s -m merkle -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+	./${PROG} -s -m merkle -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+	./${PROG} -v -kkeys/public_${KEY}.pem -imessage_big.bin.sign message_big.bin
+	if($? == 0) then
+		echo Message signature ok
+	else
+		echo Merkle tree signature failed
+		echo "Test Failed!"
+		exit
+	endif
+end
+########################
+# Test re-signing big message from chunk cache
+########################
+set KEY=secp256r1
+./${PROG} -s -C -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+printf 'changed' | dd of=message_big.bin bs=1 seek=2000000 conv=notrunc
+echo ./${PROG} -s -R 2000000:7 -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+./${PROG} -s -R 2000000:7 -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+./${PROG} -v -kkeys/public_${KEY}.pem -imessage_big.bin.sign message_big.bin
+if($? == 0) then
+	echo Message signature ok
+else
+	echo Signature from chunk cache failed
+	echo "Test Failed!"
+	exit
+endif
+########################
+# Test chunk cache isn't used for message rewritten with its mtime set back
+########################
+set MTIME=`stat -c %y message_big.bin`
+printf 'again' | dd of=message_big.bin bs=1 seek=1000 conv=notrunc
+touch -d "${MTIME}" message_big.bin
+echo ./${PROG} -s -C -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+./${PROG} -s -C -kkeys/${KEY}.pem -omessage_big.bin.sign message_big.bin
+./${PROG} -v -kkeys/public_${KEY}.pem -imessage_big.bin.sign message_big.bin
+if($? == 0) then
+	echo Message signature ok
+else
+	echo Chunk cache used for rewritten message
+	echo "Test Failed!"
+	exit
+endif
+rm -f message_big.bin message_big.bin.sign message_big.bin.chunks
+########################
+# Test Merkle signature with the mode headers stripped
+# doesn't verify as a plain one over the tree root
+########################
+./${PROG} -s -H sha256 -m merkle -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+grep -v -e Digest-Mode -e Chunk-Size message.txt.sign > message_root.sign
+(printf '\0'; cat message.txt) | openssl dgst -sha256 -binary > message_root.bin
+echo ./${PROG} -v -kkeys/public_${KEY}.pem -imessage_root.sign message_root.bin
+./${PROG} -v -kkeys/public_${KEY}.pem -imessage_root.sign message_root.bin
+if($? == 3) then
+	echo Stripped Merkle signature rejected
+else
+	echo Stripped Merkle signature verified
+	echo "Test Failed!"
+	exit
+endif
+rm -f message_root.sign message_root.bin message.txt.sign
+########################
+# Test signing batch of messages
+########################
+cp message.txt message_1.txt
+cp message.txt message_2.txt
+cp message_changed.txt message_3.txt
+foreach HASH (sha256 sha512)
+	echo ./${PROG} -s -H ${HASH} -kkeys/${KEY}.pem message_1.txt message_2.txt message_3.txt
+	./${PROG} -s -H ${HASH} -kkeys/${KEY}.pem message_1.txt message_2.txt message_3.txt
+	./${PROG} -v -kkeys/public_${KEY}.pem message_1.txt message_2.txt message_3.txt
+	if($? == 0) then
+		echo Batch signatures ok
+	else
+		echo Batch signatures failed
+		echo "Test Failed!"
+		exit
+	endif
+end
+rm -f message_1.txt* message_2.txt* message_3.txt*
+########################
+# Test signing message digest
+########################
+set DIGEST="`openssl dgst -sha512 -r message.txt`"
+echo ./${PROG} -s -kkeys/${KEY}.pem -omessage.txt.sign -D "${DIGEST}"
+./${PROG} -s -kkeys/${KEY}.pem -omessage.txt.sign -D "${DIGEST}"
+./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign message.txt
+if($? == 0) then
+	echo Digest signature ok
+else
+	echo Digest signature failed
+	echo "Test Failed!"
+	exit
+endif
+echo "sha512sum message.txt | ./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign -D -"
+sha512sum message.txt | ./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign -D -
+if($? == 0) then
+	echo Digest signature from sha512sum ok
+else
+	echo Digest signature from sha512sum failed
+	echo "Test Failed!"
+	exit
+endif
+########################
+# Test batch signature with inclusion proofs
+########################
+cp message.txt message_1.txt
+cp message.txt message_2.txt
+cp message_changed.txt message_3.txt
+echo ./${PROG} -s -m batch -kkeys/${KEY}.pem -obatch.sign message_1.txt message_2.txt message_3.txt
+./${PROG} -s -m batch -kkeys/${KEY}.pem -obatch.sign message_1.txt message_2.txt message_3.txt
+./${PROG} -v -kkeys/public_${KEY}.pem -ibatch.sign message_3.txt message_1.txt
+if($? == 0) then
+	echo Batch signature ok
+else
+	echo Batch signature failed
+	echo "Test Failed!"
+	exit
+endif
+rm -f batch.sign message_1.txt* message_2.txt* message_3.txt*
+########################
+# Test directory manifest
+########################
+mkdir -p release/docs
+cp message.txt release/
+cp message_changed.txt release/docs/
+echo ./${PROG} -s -kkeys/${KEY}.pem release
+./${PROG} -s -kkeys/${KEY}.pem release
+./${PROG} -v -kkeys/public_${KEY}.pem release
+if($? == 0) then
+	echo Manifest signature ok
+else
+	echo Manifest signature failed
+	echo "Test Failed!"
+	exit
+endif
+ln -s message.txt release/link.txt
+./${PROG} -s -kkeys/${KEY}.pem release
+ln -sfn docs/message_changed.txt release/link.txt
+./${PROG} -v -kkeys/public_${KEY}.pem release
+if($? == 3) then
+	echo Changed link in manifest detected ok
+else
+	echo Changed link in manifest not detected
+	echo "Test Failed!"
+	exit
+endif
+rm -rf release release.manifest
+########################
+# Test BLAKE3 signature and key derivation
+########################
+echo ./${PROG} -s -H blake3 -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+./${PROG} -s -H blake3 -kkeys/${KEY}.pem -omessage.txt.sign message.txt
+./${PROG} -v -kkeys/public_${KEY}.pem -imessage.txt.sign message.txt
+if($? == 0) then
+	echo BLAKE3 signature ok
+else
+	echo BLAKE3 signature failed
+	echo "Test Failed!"
+	exit
+endif
+cp message.txt message_kdf.txt
+./${PROG} -e -K blake3 -kkeys/public_${KEY}.pem message_kdf.txt
+./${PROG} -d -K blake3 -kkeys/${KEY}.pem -o message_kdf.txt.dec message_kdf.txt.enc
+diff message.txt message_kdf.txt.dec
+if($? == 0) then
+	echo BLAKE3 key derivation ok
+else
+	echo BLAKE3 key derivation failed
+	echo "Test Failed!"
+	exit
+endif
+rm -f message_kdf.txt*
+########################
+# Test AEAD ciphers
+########################
+foreach CIPHER (aes-256-gcm chacha20-poly1305)
+	cp message.txt message_aead.txt
+	echo ./${PROG} -e -S ${CIPHER} -kkeys/public_${KEY}.pem message_aead.txt
+	./${PROG} -e -S ${CIPHER} -kkeys/public_${KEY}.pem message_aead.txt
+	./${PROG} -d -S ${CIPHER} -kkeys/${KEY}.pem -o message_aead.txt.dec message_aead.txt.enc
+	diff message.txt message_aead.txt.dec
+	if($? == 0) then
+		echo ${CIPHER} encryption ok
+	else
+		echo ${CIPHER} encryption failed
+		echo "Test Failed!"
+		exit
+	endif
+	rm -f message_aead.txt*
+end
+########################
+# Test file without header is only decrypted with Blowfish
+########################
+cp message.txt message_bf.txt
+./${PROG} -e -S blowfish -kkeys/public_${KEY}.pem message_bf.txt
+echo ./${PROG} -d -S aes-256-gcm -kkeys/${KEY}.pem -o message_bf.txt.dec message_bf.txt.enc
+./${PROG} -d -S aes-256-gcm -kkeys/${KEY}.pem -o message_bf.txt.dec message_bf.txt.enc
+if($? != 0 && ! -e message_bf.txt.dec) then
+	echo File without header refused with AES
+else
+	echo File without header decrypted with AES
+	echo "Test Failed!"
+	exit
+endif
+echo "./${PROG} -d -kkeys/${KEY}.pem -o - message_bf.txt.enc"
+./${PROG} -d -kkeys/${KEY}.pem -o - message_bf.txt.enc > message_bf.txt.dec
+if($? != 0 && -z message_bf.txt.dec) then
+	echo File without header refused for stdout
+else
+	echo File without header decrypted to stdout
+	echo "Test Failed!"
+	exit
+endif
+echo "./${PROG} -e -S blowfish -kkeys/public_${KEY}.pem -o - message_bf.txt"
+./${PROG} -e -S blowfish -kkeys/public_${KEY}.pem -o - message_bf.txt > message_bf.txt.out
+if($? != 0 && -z message_bf.txt.out) then
+	echo Blowfish refused for stdout
+else
+	echo Blowfish encrypted to stdout
+	echo "Test Failed!"
+	exit
+endif
+rm -f message_bf.txt*
+########################
+# Test segmented file
+########################
+cat message.txt message.txt message.txt message.txt > message_seg.txt
+foreach I (1 2 3 4 5 6 7 8 9 10)
+	cat message_seg.txt message_seg.txt > message_seg.tmp
+	mv message_seg.tmp message_seg.txt
+end
+echo ./${PROG} -e -j 4 -kkeys/public_${KEY}.pem message_seg.txt
+./${PROG} -e -j 4 -kkeys/public_${KEY}.pem message_seg.txt
+./${PROG} -d -j 1 -kkeys/${KEY}.pem -o message_seg.txt.dec message_seg.txt.enc
+diff message_seg.txt message_seg.txt.dec
+if($? == 0) then
+	echo Segmented encryption ok
+else
+	echo Segmented encryption failed
+	echo "Test Failed!"
+	exit
+endif
+./${PROG} -d -I pread -kkeys/${KEY}.pem -o message_seg.txt.dec3 message_seg.txt.enc
+diff message_seg.txt message_seg.txt.dec3
+if($? == 0) then
+	echo Segmented decryption with pread ok
+else
+	echo Segmented decryption with pread failed
+	echo "Test Failed!"
+	exit
+endif
+cat message_seg.txt | ./${PROG} -e -kkeys/public_${KEY}.pem - | ./${PROG} -d -kkeys/${KEY}.pem - > message_seg.txt.dec4
+diff message_seg.txt message_seg.txt.dec4
+if($? == 0) then
+	echo Segmented encryption in a pipe ok
+else
+	echo Segmented encryption in a pipe failed
+	echo "Test Failed!"
+	exit
+endif
+./${PROG} -d -r 200000:100000 -kkeys/${KEY}.pem -o message_seg.txt.dec5 message_seg.txt.enc
+tail -c +200001 message_seg.txt | head -c 100000 > message_seg.txt.part
+diff message_seg.txt.part message_seg.txt.dec5
+if($? == 0) then
+	echo Segmented range decryption ok
+else
+	echo Segmented range decryption failed
+	echo "Test Failed!"
+	exit
+endif
+./${PROG} -e -kkeys/public_${KEY}.pem -o message_seg.txt.app message.txt
+./${PROG} -a -kkeys/${KEY}.pem -i message_seg.txt message_seg.txt.app
+cat message.txt message_seg.txt > message_seg.txt.cat
+./${PROG} -d -kkeys/${KEY}.pem -o message_seg.txt.dec6 message_seg.txt.app
+diff message_seg.txt.cat message_seg.txt.dec6
+if($? == 0) then
+	echo Append to segmented file ok
+else
+	echo Append to segmented file failed
+	echo "Test Failed!"
+	exit
+endif
+mkfifo message_seg.txt.fifo
+(head -c 30000000 /dev/zero; sleep 3) > message_seg.txt.fifo &
+./${PROG} -a -kkeys/${KEY}.pem -i message_seg.txt.fifo message_seg.txt.app &
+set APPEND_PID=$!
+sleep 1
+kill -9 ${APPEND_PID}
+./${PROG} -d -kkeys/${KEY}.pem -o message_seg.txt.dec7 message_seg.txt.app
+if($? == 0) then
+	echo File with interrupted append decrypted
+	echo "Test Failed!"
+	exit
+endif
+./${PROG} -a -kkeys/${KEY}.pem -i /dev/null message_seg.txt.app
+./${PROG} -d -kkeys/${KEY}.pem -o message_seg.txt.dec7 message_seg.txt.app
+diff message_seg.txt.cat message_seg.txt.dec7
+if($? == 0) then
+	echo Interrupted append put back ok
+else
+	echo Interrupted append not put back
+	echo "Test Failed!"
+	exit
+endif
+head -c 70000 message_seg.txt.enc > message_seg.txt.cut
+./${PROG} -d -kkeys/${KEY}.pem -o message_seg.txt.dec2 message_seg.txt.cut
+if($? != 0) then
+	echo Truncated file detected ok
+else
+	echo Truncated file not detected
+	echo "Test Failed!"
+	exit
+endif
+rm -f message_seg.txt*
 echo "ALL TESTS PASSED"
@@ -0,0 +1,212 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "defs.h"
+#include "thread_pool.h"
+
+typedef struct thread_pool_job_s
+{
+    thread_pool_task task;
+    void *arg;
+    struct thread_pool_job_s *next;
+} thread_pool_job_t;
+
+struct thread_pool_s
+{
+    thread_pool_job_t *head;
+    thread_pool_job_t *tail;
+    unsigned int pending; /* queued and running tasks */
+    unsigned int size;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t *workers;
+};
+
+/*
+ * Worker - takes tasks from the queue till the pool is stopped
+ */
+static void* thread_pool_worker(void* arg)
+{
+    thread_pool_t *pool = arg;
+    thread_pool_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->head && !pool->stop)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (!pool->head)
+        {
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        job->task(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+        {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+unsigned int thread_pool_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus > 0) ? (unsigned int) cpus : 1;
+}
+
+status thread_pool_create(thread_pool_t **pool, unsigned int threads)
+{
+    thread_pool_t *p = NULL;
+    unsigned int i;
+
+    CHECK_PARAM(pool);
+
+    if (!threads)
+    {
+        threads = thread_pool_cpus();
+    }
+    p = calloc(1, sizeof(thread_pool_t));
+    if (!p)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    p->workers = calloc(threads, sizeof(pthread_t));
+    if (!p->workers)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        free(p);
+        return FAIL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&p->workers[i], NULL, thread_pool_worker, p))
+        {
+            ERROR_LOG("Can not start thread pool worker\n");
+            break;
+        }
+        p->size++;
+    }
+    if (!p->size)
+    {
+        thread_pool_destroy(p);
+        return FAIL;
+    }
+    *pool = p;
+    return SUCCESS;
+}
+
+unsigned int thread_pool_size(thread_pool_t *pool)
+{
+    CHECK_PARAM(pool);
+    return pool->size;
+}
+
+status thread_pool_submit(thread_pool_t *pool, thread_pool_task task, void *arg)
+{
+    thread_pool_job_t *job;
+
+    CHECK_PARAM(pool);
+    CHECK_PARAM(task);
+
+    job = malloc(sizeof(thread_pool_job_t));
+    if (!job)
+    {
+        ERROR_LOG("Memory allocation failed\n");
+        return FAIL;
+    }
+    job->task = task;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+    {
+        pool->tail->next = job;
+    }
+    else
+    {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return SUCCESS;
+}
+
+void thread_pool_wait(thread_pool_t *pool)
+{
+    CHECK_PARAM(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(thread_pool_t *pool)
+{
+    unsigned int i;
+
+    if (!pool)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->size; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,65 @@
+/*************************************************************************
+ * Small Privacy Guard
+ * Copyright (C) Tadeusz Struk 2009-2022 <tstruk@gmail.com>
+ *
+ * This is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * <http://www.gnu.org/licenses/>
+ *
+ *************************************************************************/
+#ifndef _SPG_THREAD_POOL_H_
+#define _SPG_THREAD_POOL_H_
+
+/*
+ * Fixed size pool of worker threads running submitted tasks
+ * in the order they were submitted
+ */
+typedef struct thread_pool_s thread_pool_t;
+
+typedef void (*thread_pool_task)(void *arg);
+
+/*
+ * Function: thread_pool_cpus
+ * Returns number of online CPUs, at least 1
+ */
+unsigned int thread_pool_cpus(void);
+
+/*
+ * Function: thread_pool_create
+ * Starts threads workers. If threads is 0 starts one per online CPU
+ */
+status thread_pool_create(thread_pool_t **pool, unsigned int threads);
+
+/*
+ * Function: thread_pool_size
+ * Returns number of workers in the pool
+ */
+unsigned int thread_pool_size(thread_pool_t *pool);
+
+/*
+ * Function: thread_pool_submit
+ * Queues task to be run by one of the workers
+ */
+status thread_pool_submit(thread_pool_t *pool, thread_pool_task task, void *arg);
+
+/*
+ * Function: thread_pool_wait
+ * Waits until all submitted tasks are done
+ */
+void thread_pool_wait(thread_pool_t *pool);
+
+/*
+ * Function: thread_pool_destroy
+ * Waits for the submitted tasks and stops the workers
+ */
+void thread_pool_destroy(thread_pool_t *pool);
+
+#endif /* _SPG_THREAD_POOL_H_ */
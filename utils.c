@@ -32,6 +32,7 @@
  */
 const char* program_name = "spg";
 int verbose = 0;
+int log_stderr = 0;
 
 /*
  * Debuging function - prints big number